@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "commit_log.h"
+#include "exceptions.h"
+
+namespace {
+
+const char MAGIC[8] = { 'K', 'V', 'C', 'K', 'P', 'T', '0', '2' };
+
+struct FileHeader {
+  char magic[8];
+  uint64_t first_segment;
+  uint64_t directory_offset;
+  uint64_t table_count;
+};
+
+struct RowHeader {
+  uint32_t key_len;
+  uint32_t value_len;
+  uint64_t expires_at;
+};
+
+struct DirectoryEntry {
+  uint64_t index_offset;
+  uint64_t count;
+  uint32_t name_len;
+  uint32_t flags;
+};
+
+// DirectoryEntry flags
+const uint32_t DELTA_TABLE = 1;
+
+// value_len of a row recording a deletion
+const uint32_t DELETED = uint32_t(-1);
+
+// Rows are written in chunks of about this size
+const size_t WRITE_CHUNK = 1 << 20;
+
+uint64_t align8(uint64_t n)
+{
+  return (n + 7) & ~uint64_t(7);
+}
+
+}
+
+std::string MappedTable::key(size_t i) const
+{
+  const RowHeader *row = reinterpret_cast<const RowHeader *>(m_data + m_index[i]);
+  return std::string(reinterpret_cast<const char *>(row + 1), row->key_len);
+}
+
+std::string MappedTable::value(size_t i) const
+{
+  const RowHeader *row = reinterpret_cast<const RowHeader *>(m_data + m_index[i]);
+  return std::string(reinterpret_cast<const char *>(row + 1) + align8(row->key_len), row->value_len);
+}
+
+bool MappedTable::is_deleted(size_t i) const
+{
+  return reinterpret_cast<const RowHeader *>(m_data + m_index[i])->value_len == DELETED;
+}
+
+uint64_t MappedTable::expires_at(size_t i) const
+{
+  return reinterpret_cast<const RowHeader *>(m_data + m_index[i])->expires_at;
+}
+
+int MappedTable::compare(size_t i, const std::string &key) const
+{
+  const RowHeader *row = reinterpret_cast<const RowHeader *>(m_data + m_index[i]);
+  size_t len = std::min<size_t>(row->key_len, key.size());
+  int cmp = memcmp(row + 1, key.data(), len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return row->key_len < key.size() ? -1 : (row->key_len > key.size() ? 1 : 0);
+}
+
+size_t MappedTable::lower_bound(const std::string &key) const
+{
+  size_t lo = 0, hi = m_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare(mid, key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+size_t MappedTable::upper_bound(const std::string &key) const
+{
+  size_t lo = 0, hi = m_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare(mid, key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+size_t MappedTable::find(const std::string &key) const
+{
+  size_t i = lower_bound(key);
+  return (i < m_count && compare(i, key) == 0) ? i : npos;
+}
+
+Checkpoint::Checkpoint()
+  : m_map(nullptr)
+  , m_size(0)
+  , m_first_segment(0)
+{
+}
+
+Checkpoint::~Checkpoint()
+{
+  if (m_map) {
+    munmap(m_map, m_size);
+  }
+}
+
+bool Checkpoint::open(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    throw StorageException("Could not open checkpoint " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(FileHeader)) {
+    close(fd);
+    throw StorageException("Invalid checkpoint " + path);
+  }
+  m_size = st.st_size;
+  m_map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file open
+  if (m_map == MAP_FAILED) {
+    m_map = nullptr;
+    throw StorageException("Could not map checkpoint " + path + ": " + strerror(errno));
+  }
+  madvise(m_map, m_size, MADV_RANDOM); // Rows are looked up, not read in order
+
+  // Check the header and directory (but not the rows, which would mean
+  // reading the whole file)
+  const char *data = static_cast<const char *>(m_map);
+  const FileHeader *header = reinterpret_cast<const FileHeader *>(data);
+  if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header->directory_offset % 8 != 0 || header->directory_offset > m_size) {
+    throw StorageException("Invalid checkpoint " + path);
+  }
+  m_first_segment = header->first_segment;
+  uint64_t pos = header->directory_offset;
+  for (uint64_t t = 0; t < header->table_count; t++) {
+    if (m_size - pos < sizeof(DirectoryEntry)) {
+      throw StorageException("Invalid checkpoint " + path);
+    }
+    const DirectoryEntry *entry = reinterpret_cast<const DirectoryEntry *>(data + pos);
+    pos += sizeof(DirectoryEntry);
+    if (m_size - pos < entry->name_len || entry->index_offset % 8 != 0 ||
+        entry->index_offset > header->directory_offset ||
+        entry->count > (header->directory_offset - entry->index_offset) / 8) {
+      throw StorageException("Invalid checkpoint " + path);
+    }
+    std::string name(data + pos, entry->name_len);
+    pos += align8(entry->name_len);
+    m_tables.emplace_back(name, MappedTable(data, reinterpret_cast<const uint64_t *>(data + entry->index_offset),
+                                            entry->count, entry->flags & DELTA_TABLE));
+  }
+  return true;
+}
+
+void Checkpoint::merge(const std::vector<const Checkpoint *> &chain, CheckpointWriter &writer)
+{
+  if (chain.empty()) {
+    return;
+  }
+  uint64_t now = 0;
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  // The last checkpoint lists every table. Each table's rows are its
+  // rows in the last checkpoint that saved it in full, updated by the
+  // deltas after it.
+  for (const auto &table : chain.back()->get_tables()) {
+    std::vector<const MappedTable *> sources; // Newest first
+    for (auto c = chain.rbegin(); c != chain.rend(); ++c) {
+      const MappedTable *found = nullptr;
+      for (const auto &t : (*c)->get_tables()) {
+        if (t.first == table.first) {
+          found = &t.second;
+          break;
+        }
+      }
+      if (!found) {
+        break; // (Not possible: a table created later is saved in full)
+      }
+      sources.push_back(found);
+      if (!found->is_delta()) {
+        break;
+      }
+    }
+
+    // Merge the sources' rows in key order; the newest has each key's
+    // latest change
+    writer.begin_table(table.first);
+    std::vector<size_t> pos(sources.size(), 0);
+    while (true) {
+      std::string key;
+      size_t newest = sources.size();
+      for (size_t s = 0; s < sources.size(); s++) {
+        if (pos[s] == sources[s]->size()) {
+          continue;
+        }
+        if (newest == sources.size() || sources[s]->compare(pos[s], key) < 0) {
+          key = sources[s]->key(pos[s]);
+          newest = s;
+        }
+      }
+      if (newest == sources.size()) {
+        break;
+      }
+      const MappedTable &rows = *sources[newest];
+      size_t i = pos[newest];
+      uint64_t expires_at = rows.expires_at(i);
+      if (!rows.is_deleted(i) && (expires_at == 0 || expires_at > now)) {
+        writer.add_row(key, rows.value(i), expires_at);
+      }
+      for (size_t s = 0; s < sources.size(); s++) {
+        if (pos[s] < sources[s]->size() && sources[s]->compare(pos[s], key) == 0) {
+          pos[s]++;
+        }
+      }
+    }
+  }
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &path, unsigned long first_segment)
+  : m_path(path)
+  , m_tmp_path(path + ".tmp")
+  , m_fd(-1)
+  , m_first_segment(first_segment)
+  , m_offset(0)
+{
+  m_fd = open(m_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0) {
+    throw StorageException("Could not create checkpoint " + m_tmp_path + ": " + strerror(errno));
+  }
+
+  // The header is filled in once the file is complete, so until then
+  // it isn't a valid checkpoint
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  append(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  if (m_fd >= 0) {
+    close(m_fd);
+    unlink(m_tmp_path.c_str());
+  }
+}
+
+void CheckpointWriter::append(const char *data, size_t len)
+{
+  m_buffer.append(data, len);
+  m_offset += len;
+}
+
+void CheckpointWriter::align()
+{
+  static const char zeros[8] = { 0 };
+  append(zeros, align8(m_offset) - m_offset);
+}
+
+void CheckpointWriter::write_buffer()
+{
+  if (!CommitLog::write_all(m_fd, m_buffer)) {
+    throw StorageException("Could not write checkpoint " + m_tmp_path + ": " + strerror(errno));
+  }
+  m_buffer.clear();
+}
+
+void CheckpointWriter::end_table()
+{
+  if (m_tables.empty()) {
+    return;
+  }
+  m_tables.back().index_offset = m_offset;
+  m_tables.back().count = m_rows.size();
+  append(reinterpret_cast<const char *>(m_rows.data()), m_rows.size() * sizeof(uint64_t));
+  m_rows.clear();
+}
+
+void CheckpointWriter::begin_table(const std::string &name, bool delta)
+{
+  end_table();
+  m_tables.push_back(TableInfo{name, 0, 0, delta});
+}
+
+void CheckpointWriter::add_row(const std::string &key, const std::string &value, uint64_t expires_at)
+{
+  RowHeader row;
+  row.key_len = key.size();
+  row.value_len = value.size();
+  row.expires_at = expires_at;
+  m_rows.push_back(m_offset);
+  append(reinterpret_cast<const char *>(&row), sizeof(row));
+  append(key.data(), key.size());
+  align();
+  append(value.data(), value.size());
+  align();
+  if (m_buffer.size() >= WRITE_CHUNK) {
+    write_buffer();
+  }
+}
+
+void CheckpointWriter::add_deletion(const std::string &key)
+{
+  RowHeader row;
+  row.key_len = key.size();
+  row.value_len = DELETED;
+  row.expires_at = 0;
+  m_rows.push_back(m_offset);
+  append(reinterpret_cast<const char *>(&row), sizeof(row));
+  append(key.data(), key.size());
+  align();
+}
+
+void CheckpointWriter::finish()
+{
+  end_table();
+  FileHeader header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.first_segment = m_first_segment;
+  header.directory_offset = m_offset;
+  header.table_count = m_tables.size();
+  for (const TableInfo &table : m_tables) {
+    DirectoryEntry entry;
+    entry.index_offset = table.index_offset;
+    entry.count = table.count;
+    entry.name_len = table.name.size();
+    entry.flags = table.delta ? DELTA_TABLE : 0;
+    append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    append(table.name.data(), table.name.size());
+    align();
+  }
+  write_buffer();
+
+  if (pwrite(m_fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) || fsync(m_fd) != 0) {
+    throw StorageException("Could not write checkpoint " + m_tmp_path + ": " + strerror(errno));
+  }
+  close(m_fd);
+  m_fd = -1;
+  if (rename(m_tmp_path.c_str(), m_path.c_str()) != 0) {
+    unlink(m_tmp_path.c_str());
+    throw StorageException("Could not rename checkpoint to " + m_path + ": " + strerror(errno));
+  }
+  CommitLog::sync_directory(m_path); // Make the rename durable
+}
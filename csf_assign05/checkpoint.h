@@ -0,0 +1,142 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// A checkpoint file saves the committed contents of every table as of
+// one moment, so the commit log before that moment can be removed. It
+// is laid out to be used in place once mapped into memory, rather than
+// parsed: the server opens it at startup as each table's base data, so
+// restarting only reads the pages that are actually used.
+//
+//   header     magic, the first log segment the checkpoint doesn't
+//              cover, and the offset and size of the directory
+//   per table  its rows, sorted by key, then an index of the rows'
+//              offsets (so rows are found by binary search)
+//   directory  each table's name, and the offset and size of its index
+//
+// A row is its key and value lengths and expiry time, the key, then the
+// value. Everything is aligned to 8 bytes, and stored in the host's
+// byte order. The file is written under a temporary name, synced, then
+// renamed into place, so a crash leaves the previous checkpoint intact.
+//
+// A delta checkpoint records only what changed since the checkpoint
+// before it. Its directory still lists every table, but a table whose
+// entry is marked as a delta holds just the keys changed since, with
+// deleted keys as rows without a value. Tables not listed were dropped.
+
+// One table's rows in a mapped checkpoint
+class MappedTable {
+private:
+  const char *m_data;      // Start of the file
+  const uint64_t *m_index; // Offsets of the rows, in key order
+  size_t m_count;
+  bool m_delta;            // Only the keys changed since the previous checkpoint
+
+public:
+  static const size_t npos = size_t(-1);
+
+  MappedTable() : m_data(nullptr), m_index(nullptr), m_count(0), m_delta(false) { }
+  MappedTable(const char *data, const uint64_t *index, size_t count, bool delta)
+    : m_data(data), m_index(index), m_count(count), m_delta(delta) { }
+
+  size_t size() const { return m_count; }
+  bool is_delta() const { return m_delta; }
+  bool is_deleted(size_t i) const; // Row i records a deletion (only in a delta)
+
+  // Row i's fields (0 <= i < size())
+  std::string key(size_t i) const;
+  std::string value(size_t i) const;
+  uint64_t expires_at(size_t i) const;
+
+  // Compare row i's key with key, like std::string::compare
+  int compare(size_t i, const std::string &key) const;
+
+  size_t find(const std::string &key) const;        // Row with the key, or npos
+  size_t lower_bound(const std::string &key) const; // First row with a key >= key
+  size_t upper_bound(const std::string &key) const; // First row with a key > key
+};
+
+class CheckpointWriter;
+
+// A checkpoint file mapped into memory. Its tables stay valid until
+// it is destroyed.
+class Checkpoint {
+private:
+  void *m_map;
+  size_t m_size;
+  unsigned long m_first_segment;
+  std::vector<std::pair<std::string, MappedTable>> m_tables;
+
+  // copy constructor and assignment operator are prohibited
+  Checkpoint(const Checkpoint &);
+  Checkpoint &operator=(const Checkpoint &);
+
+public:
+  Checkpoint();
+  ~Checkpoint();
+
+  // Map the checkpoint at path, returning false if there is none.
+  // Throws StorageException if it is invalid.
+  bool open(const std::string &path);
+
+  // First log segment the checkpoint doesn't cover
+  unsigned long get_first_segment() const { return m_first_segment; }
+
+  const std::vector<std::pair<std::string, MappedTable>> &get_tables() const { return m_tables; }
+
+  // Write the tables recorded by chain (a full checkpoint, then deltas
+  // in order) to writer, in full. Deleted and expired rows are left out.
+  static void merge(const std::vector<const Checkpoint *> &chain, CheckpointWriter &writer);
+};
+
+// Writes a checkpoint file, one table at a time
+class CheckpointWriter {
+private:
+  struct TableInfo {
+    std::string name;
+    uint64_t index_offset;
+    uint64_t count;
+    bool delta;
+  };
+
+  std::string m_path;
+  std::string m_tmp_path;
+  int m_fd;
+  unsigned long m_first_segment;
+  std::string m_buffer; // Bytes not yet written
+  uint64_t m_offset;    // File offset of the end of m_buffer
+  std::vector<TableInfo> m_tables;
+  std::vector<uint64_t> m_rows; // Row offsets of the last table
+
+  void append(const char *data, size_t len);
+  void align();
+  void write_buffer();
+  void end_table();
+
+  // copy constructor and assignment operator are prohibited
+  CheckpointWriter(const CheckpointWriter &);
+  CheckpointWriter &operator=(const CheckpointWriter &);
+
+public:
+  // Start a checkpoint covering the log before first_segment. Throws
+  // StorageException (as does each function below) if it can't be
+  // written.
+  CheckpointWriter(const std::string &path, unsigned long first_segment);
+
+  // Discards the checkpoint if it wasn't finished
+  ~CheckpointWriter();
+
+  // Start the next table (holding only changed keys, if delta is true).
+  // Its rows, and deletions, must be added in key order.
+  void begin_table(const std::string &name, bool delta = false);
+  void add_row(const std::string &key, const std::string &value, uint64_t expires_at);
+  void add_deletion(const std::string &key); // Only in a delta
+
+  // Sync the checkpoint, and replace the previous one with it
+  void finish();
+};
+
+#endif // CHECKPOINT_H
@@ -3,9 +3,30 @@
 #include "exceptions.h"
 #include "table.h"
 #include "message_serialization.h"
+#include "commit_log.h"
 #include <stdexcept>
 #include <memory>
 #include <iostream>
+#include <map>
+#include <algorithm>
+#include <ctime>
+
+namespace {
+
+// Holds a table's latch while one operation reads or changes its data
+class TableLatch {
+private:
+  Table *m_table;
+
+  TableLatch(const TableLatch &);
+  TableLatch &operator=(const TableLatch &);
+
+public:
+  TableLatch(Table *table) : m_table(table) { m_table->lock(); }
+  ~TableLatch() { m_table->unlock(); }
+};
+
+}
 
 bool ClientConnection::is_integer(const std::string &s) const {
   if (s.empty()) return false;
@@ -18,13 +39,20 @@ bool ClientConnection::is_integer(const std::string &s) const {
 }
 
 ClientConnection::ClientConnection(Server *server, int client_fd)
-  : m_server(server), m_client_fd(client_fd), m_inTransaction(false)
+  : m_server(server), m_client_fd(client_fd), m_inTransaction(false), m_txnMode(LOCKING)
+  , m_snapshot(0), m_snapshotTables(nullptr)
+  , m_retry(false), m_replaying(false), m_retrySeed(unsigned(client_fd) ^ unsigned(time(nullptr)))
+  , m_tableCacheCount(0), m_tableCacheGeneration(0)
+  , m_epochParticipant(server->get_epochs().register_participant()), m_pinned(false)
 {
   rio_readinitb(&m_fdbuf, m_client_fd);
 }
 
 ClientConnection::~ClientConnection()
 {
+  unpin();
+  m_server->get_epochs().unregister_participant(m_epochParticipant);
+
   // Close the client file descriptor to end connection
   Close(m_client_fd);
 }
@@ -46,6 +74,8 @@ void ClientConnection::chat_with_client()
 
       std::string line(buffer);
       Message request;
+      pin();
+      m_response.clear();
       try {
         MessageSerialization::decode(line, request);
 
@@ -54,69 +84,39 @@ void ClientConnection::chat_with_client()
           throw InvalidMessage("First message must be LOGIN");
         }
 
-        switch(request.get_message_type()) {
-          case MessageType::LOGIN:
-            handle_LOGIN(request, logged_in);
-            break;
-          case MessageType::CREATE:
-            handle_CREATE(request);
-            break;
-          case MessageType::PUSH:
-            handle_PUSH(request);
-            break;
-          case MessageType::POP:
-            handle_POP(request);
-            break;
-          case MessageType::TOP:
-            handle_TOP(request);
-            // DATA response sent, do not set done here. Continue loop.
-            break;
-          case MessageType::SET:
-            handle_SET(request);
-            break;
-          case MessageType::GET:
-            handle_GET(request);
-            break;
-          case MessageType::ADD:
-            handle_ADD(request);
-            break;
-          case MessageType::SUB:
-            handle_SUB(request);
-            break;
-          case MessageType::MUL:
-            handle_MUL(request);
-            break;
-          case MessageType::DIV:
-            handle_DIV(request);
-            break;
-          case MessageType::BEGIN:
-            handle_BEGIN(request);
-            break;
-          case MessageType::COMMIT:
-            handle_COMMIT(request);
-            break;
-          case MessageType::BYE:
-            handle_BYE(request, done); 
-            // done is set to true inside handle_BYE
-            break;
-          default:
-            throw InvalidMessage("Unknown request message");
-        }
-
+        process_request(request, logged_in, done);
       } catch (InvalidMessage &imex) {
         // Invalid message → send ERROR and end session
         send_error(imex.what());
         done = true;
       } catch (OperationException &opex) {
-        // Recoverable error → send FAILED but do not end session
-        if (m_inTransaction) {
+        // Recoverable error → send FAILED but do not end session. Once
+        // a transaction has a savepoint, a failed request (other than
+        // COMMIT) leaves it open, and the client may roll back to the
+        // savepoint or carry on.
+        if (m_inTransaction &&
+            (!m_writeSet.has_savepoints() || request.get_message_type() == MessageType::COMMIT)) {
           rollback_transaction();
         }
         send_failed(opex.what());
+        log_request(request);
       } catch (FailedTransaction &ftex) {
         // Transaction failed → send FAILED but continue session
         rollback_transaction();
         send_failed(ftex.what());
+      } catch (StorageException &sex) {
+        // Storage error → log it, and fail the request (and any
+        // transaction) rather than leaving its locks held
+        Server::log_error(sex.what());
+        if (m_inTransaction) {
+          rollback_transaction();
+        }
+        send_failed(sex.what());
+      }
+
+      if (!m_inTransaction) {
+        unlock_tables(); // Release any lock held by an autocommit request
+        unpin();
       }
     }
   } catch (CommException &cex) {
@@ -126,6 +126,206 @@ void ClientConnection::chat_with_client()
   if (m_inTransaction) {
     rollback_transaction();
   }
+  unlock_tables();
+  unpin();
+}
+
+// Handle a request, retrying it if a transaction begun with RETRY
+// loses a conflict: the transaction is replayed from BEGIN (after a
+// random delay, doubling its range each time), and then the request
+// is handled again
+void ClientConnection::process_request(const Message &request, bool &logged_in, bool &done) {
+  unsigned retries = 0;
+  for (;;) {
+    try {
+      if (retries > 0) {
+        replay_transaction(retries);
+        m_response.clear();
+      }
+      handle_request(request, logged_in, done);
+      log_request(request);
+      return;
+    } catch (TransactionConflict &tcex) {
+      if (!m_inTransaction || !m_retry || retries == m_server->get_options().txn_retries) {
+        throw;
+      }
+      retries++;
+    }
+  }
+}
+
+void ClientConnection::handle_request(const Message &request, bool &logged_in, bool &done) {
+  if (m_server->is_replica() && changes_data(request.get_message_type())) {
+    throw OperationException("Server is a read-only replica");
+  }
+  switch(request.get_message_type()) {
+    case MessageType::LOGIN:
+      handle_LOGIN(request, logged_in);
+      break;
+    case MessageType::CREATE:
+      handle_CREATE(request);
+      break;
+    case MessageType::PUSH:
+      handle_PUSH(request);
+      break;
+    case MessageType::POP:
+      handle_POP(request);
+      break;
+    case MessageType::TOP:
+      handle_TOP(request);
+      // DATA response sent, do not set done here. Continue loop.
+      break;
+    case MessageType::SET:
+      handle_SET(request);
+      break;
+    case MessageType::GET:
+      handle_GET(request);
+      break;
+    case MessageType::ADD:
+      handle_ADD(request);
+      break;
+    case MessageType::SUB:
+      handle_SUB(request);
+      break;
+    case MessageType::MUL:
+      handle_MUL(request);
+      break;
+    case MessageType::DIV:
+      handle_DIV(request);
+      break;
+    case MessageType::BEGIN:
+      handle_BEGIN(request);
+      break;
+    case MessageType::COMMIT:
+      handle_COMMIT(request);
+      break;
+    case MessageType::SCAN:
+      handle_SCAN(request);
+      break;
+    case MessageType::STATS:
+      handle_STATS(request);
+      break;
+    case MessageType::DROP:
+      handle_DROP(request);
+      break;
+    case MessageType::TRUNCATE:
+      handle_TRUNCATE(request);
+      break;
+    case MessageType::SAVEPOINT:
+      handle_SAVEPOINT(request);
+      break;
+    case MessageType::ROLLBACK:
+      handle_ROLLBACK(request);
+      break;
+    case MessageType::SNAPSHOT:
+      handle_SNAPSHOT(request);
+      break;
+    case MessageType::DUMP:
+      handle_DUMP(request);
+      break;
+    case MessageType::RESTORE:
+      handle_RESTORE(request);
+      break;
+    case MessageType::REPLICATE:
+      handle_REPLICATE(request);
+      break;
+    case MessageType::BYE:
+      handle_BYE(request, done); 
+      // done is set to true inside handle_BYE
+      break;
+    default:
+      throw InvalidMessage("Unknown request message");
+  }
+}
+
+// Requests a replica refuses, as only its primary's changes apply to
+// it. (RESTORE is refused once its records have been read.)
+bool ClientConnection::changes_data(MessageType type) {
+  switch (type) {
+    case MessageType::CREATE:
+    case MessageType::SET:
+    case MessageType::DROP:
+    case MessageType::TRUNCATE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Requests that a RETRY transaction must repeat when it's replayed:
+// those affecting the stack, using tables or setting savepoints
+void ClientConnection::log_request(const Message &request) {
+  if (!m_inTransaction || !m_retry) {
+    return;
+  }
+  switch (request.get_message_type()) {
+    case MessageType::PUSH:
+    case MessageType::POP:
+    case MessageType::TOP:
+    case MessageType::SET:
+    case MessageType::GET:
+    case MessageType::ADD:
+    case MessageType::SUB:
+    case MessageType::MUL:
+    case MessageType::DIV:
+    case MessageType::SCAN:
+    case MessageType::SAVEPOINT:
+    case MessageType::ROLLBACK:
+      m_txnLog.push_back(LoggedRequest{request, m_response});
+      break;
+    default:
+      break;
+  }
+}
+
+// Start a RETRY transaction over: drop the failed attempt's locks and
+// changes, restore the stack as of BEGIN, and handle the logged
+// requests again. The client has already seen their responses, so if
+// any response is different now, the transaction fails.
+void ClientConnection::replay_transaction(unsigned attempt) {
+  unlock_tables();
+  m_writeSet.clear();
+  m_readSet.clear();
+  m_stack = m_stackAtBegin;
+
+  unsigned range_ms = RETRY_BACKOFF_MS << std::min(attempt - 1, 10u);
+  usleep((rand_r(&m_retrySeed) % (range_ms + 1)) * 1000);
+  m_server->count_retry();
+
+  bool logged_in = true, done = false;
+  m_replaying = true;
+  try {
+    for (const LoggedRequest &logged : m_txnLog) {
+      m_response.clear();
+      try {
+        handle_request(logged.request, logged_in, done);
+      } catch (OperationException &opex) {
+        // Only logged if it failed without ending the transaction
+        send_failed(opex.what());
+      }
+      if (m_response != logged.response) {
+        throw FailedTransaction("Transaction's results changed when it was retried");
+      }
+    }
+  } catch (...) {
+    m_replaying = false;
+    throw;
+  }
+  m_replaying = false;
+}
+
+void ClientConnection::pin() {
+  if (!m_pinned) {
+    m_server->get_epochs().enter(m_epochParticipant);
+    m_pinned = true;
+  }
+}
+
+void ClientConnection::unpin() {
+  if (m_pinned) {
+    m_server->get_epochs().exit(m_epochParticipant);
+    m_pinned = false;
+  }
 }
 
 // Handlers Implementation
@@ -138,18 +338,7 @@ void ClientConnection::handle_LOGIN(const Message &msg, bool &logged_in) {
 
 void ClientConnection::handle_CREATE(const Message &msg) {
   std::string tableName = msg.get_table();
-  m_server->lock_tables_map();
-  try {
-    if (m_server->find_table(tableName) != nullptr) {
-      m_server->unlock_tables_map();
-      throw OperationException("Table already exists");
-    }
-    m_server->create_table(tableName);
-    m_server->unlock_tables_map();
-  } catch(...) {
-    m_server->unlock_tables_map();
-    throw;
-  }
+  m_server->create_table(tableName); // Throws OperationException if it exists
   send_ok();
 }
 
@@ -175,27 +364,47 @@ void ClientConnection::handle_TOP(const Message &msg) {
 void ClientConnection::handle_SET(const Message &msg) {
   std::string tableName = msg.get_table();
   std::string key = msg.get_key();
+  if (m_inTransaction && m_txnMode == READONLY) {
+    throw OperationException("SET is not allowed in a READONLY transaction");
+  }
   if (m_stack.is_empty()) {
     throw OperationException("No value on stack to SET");
   }
   std::string value = m_stack.get_top();
   m_stack.pop();
 
-  m_server->lock_tables_map();
-  Table *tbl = m_server->find_table(tableName);
-  m_server->unlock_tables_map();
-  if (!tbl) {
-    throw OperationException("No such table");
+  Table *tbl = find_table(tableName);
+  check_declared(tbl, key);
+
+  // The TTL counts from when SET is received, even inside a transaction
+  uint64_t expires_at = 0;
+  if (msg.get_ttl() != 0) {
+    expires_at = Table::wall_time_ms() + uint64_t(msg.get_ttl()) * 1000;
   }
 
   if (m_inTransaction) {
-    lock_table_transaction(tbl);
-    tbl->set(key, value);
+    // Buffer the change; the key isn't locked until COMMIT, unless
+    // this transaction read it, and so holds an UPDATE lock to upgrade now
+    if (m_txnMode == LOCKING) {
+      m_server->get_locks().upgrade_key(&m_lockOwner, tbl, key);
+    }
+    m_writeSet.set(tbl, key, value, expires_at);
+    TableLatch latch(tbl);
+    pin_key(tbl, key);
   } else {
-    lock_table_autocommit(tbl);
-    tbl->set(key, value);
-    tbl->commit_changes();
-    tbl->unlock();
+    WriteSet change;
+    change.set(tbl, key, value, expires_at);
+    lock_key(tbl, key, LockManager::EXCLUSIVE);
+    uint64_t lsn;
+    {
+      CommitGuard commit(m_server->get_commit_clock());
+      lsn = m_server->log_commit(change);
+      TableLatch latch(tbl);
+      tbl->set(key, value, expires_at, commit.get());
+    }
+    unlock_tables(); // Let the key be evicted
+    m_server->enforce_memory_limit();
+    m_server->wait_durable(lsn);
   }
 
   send_ok();
@@ -205,21 +414,36 @@ void ClientConnection::handle_GET(const Message &msg) {
   std::string tableName = msg.get_table();
   std::string key = msg.get_key();
 
-  m_server->lock_tables_map();
-  Table *tbl = m_server->find_table(tableName);
-  m_server->unlock_tables_map();
-  if (!tbl) {
-    throw OperationException("No such table");
-  }
+  Table *tbl = find_table(tableName);
+  check_declared(tbl, key);
 
   std::string val;
-  if (m_inTransaction) {
-    lock_table_transaction(tbl);
-    val = tbl->get(key);
+  if (m_inTransaction && m_txnMode == READONLY) {
+    TableLatch latch(tbl);
+    val = tbl->get_at(key, m_snapshot);
+  } else if (m_inTransaction) {
+    // The transaction's own changes take precedence over committed data
+    if (m_writeSet.lookup(tbl, key, val)) {
+      if (val.empty()) {
+        throw OperationException("Key does not exist: " + key);
+      }
+    } else if (m_txnMode == OPTIMISTIC) {
+      TableLatch latch(tbl);
+      pin_key(tbl, key); // Evicting it would fail the transaction
+      val = tbl->get(key);
+      m_readSet.record(tbl, key, tbl->get_version(key));
+    } else {
+      // The transaction may write the key it reads, so it takes an
+      // UPDATE lock (readers outside it still share the key), which
+      // writing the key upgrades
+      lock_key(tbl, key, LockManager::UPDATE);
+      TableLatch latch(tbl);
+      val = tbl->get(key);
+    }
   } else {
-    lock_table_autocommit(tbl);
+    lock_key(tbl, key, LockManager::SHARED);
+    TableLatch latch(tbl);
     val = tbl->get(key);
-    tbl->unlock();
   }
 
   m_stack.push(val);
@@ -318,11 +542,43 @@ void ClientConnection::handle_DIV(const Message &msg) {
 }
 
 void ClientConnection::handle_BEGIN(const Message &msg) {
-  (void)msg;
   if (m_inTransaction) {
     // Nested transactions not allowed
     throw FailedTransaction("Nested transactions not allowed");
   }
+  // The transaction's age decides lock conflicts, and is kept if the
+  // transaction is retried
+  m_server->get_locks().begin_transaction(&m_lockOwner);
+  m_txnMode = LOCKING;
+  m_retry = false;
+  if (msg.has_begin_options()) {
+    for (unsigned i = 0; i < msg.get_num_args(); i++) {
+      if (msg.get_arg(i) == Message::BEGIN_OPTIMISTIC) {
+        m_txnMode = OPTIMISTIC;
+      } else if (msg.get_arg(i) == Message::BEGIN_READONLY) {
+        m_txnMode = READONLY;
+      } else {
+        m_retry = true;
+      }
+    }
+    if (m_txnMode == READONLY) {
+      // The registry snapshot and every table in it stay valid, since
+      // the connection stays pinned until the transaction ends
+      m_snapshot = m_server->get_commit_clock().open_snapshot();
+      m_snapshotTables = m_server->get_table_map();
+    }
+  } else if (msg.get_num_args() > 0) {
+    try {
+      declare_locks(msg);
+    } catch (...) {
+      m_server->get_locks().end_transaction(&m_lockOwner);
+      throw;
+    }
+    m_txnMode = DECLARED;
+  }
+  if (m_retry) {
+    m_stackAtBegin = m_stack;
+  }
   m_inTransaction = true;
   send_ok();
 }
@@ -336,39 +592,482 @@ void ClientConnection::handle_COMMIT(const Message &msg) {
   send_ok();
 }
 
+void ClientConnection::handle_SCAN(const Message &msg) {
+  std::string tableName = msg.get_table();
+  std::string cursor = msg.get_cursor();
+  std::string prefix = msg.get_prefix();
+
+  // A cursor other than the start cursor is the last key already returned
+  std::string after = (cursor == Message::SCAN_START) ? "" : cursor;
+
+  Table *tbl = find_table(tableName);
+  check_declared(tbl, "");
+
+  // A read-only transaction reads the table as of its snapshot, without
+  // locking it
+  if (m_inTransaction && m_txnMode == READONLY) {
+    WriteSet::Changes found;
+    bool more;
+    {
+      TableLatch latch(tbl);
+      more = tbl->scan_at(after, prefix, m_snapshot, SCAN_BATCH_SIZE, found);
+    }
+    Rows rows;
+    for (const auto &row : found) {
+      rows.emplace_back(row.first, row.second.value);
+    }
+    send_rows(rows, more ? rows.back().first : "");
+    return;
+  }
+
+  // The whole table is locked for reading, for one batch only, unless
+  // a transaction holds (or now takes) its lock until commit. (Optimistic
+  // transactions lock tables they scan, since versions of the rows
+  // read wouldn't reveal rows added later.)
+  Rows rows;
+  bool more;
+  lock_table(tbl, LockManager::SHARED);
+  {
+    TableLatch latch(tbl);
+    more = tbl->scan(after, prefix, SCAN_BATCH_SIZE, rows);
+  }
+
+  std::string resume_after = more ? rows.back().first : "";
+  if (m_inTransaction) {
+    overlay_changes(tbl, after, prefix, resume_after, rows);
+  }
+  send_rows(rows, resume_after);
+}
+
+void ClientConnection::handle_STATS(const Message &msg) {
+  (void)msg;
+  send_data(m_server->get_stats());
+}
+
+void ClientConnection::handle_DROP(const Message &msg) {
+  if (m_inTransaction) {
+    throw OperationException("DROP is not allowed in a transaction");
+  }
+  m_server->drop_table(msg.get_table());
+  send_ok();
+}
+
+void ClientConnection::handle_TRUNCATE(const Message &msg) {
+  if (m_inTransaction) {
+    throw OperationException("TRUNCATE is not allowed in a transaction");
+  }
+  m_server->truncate_table(msg.get_table());
+  send_ok();
+}
+
+void ClientConnection::handle_SAVEPOINT(const Message &msg) {
+  if (!m_inTransaction) {
+    throw OperationException("No transaction in progress");
+  }
+  m_writeSet.savepoint(msg.get_savepoint());
+  send_ok();
+}
+
+// Undo the transaction's changes since the savepoint. Locks acquired
+// since then are kept until the transaction ends, as are its reads.
+void ClientConnection::handle_ROLLBACK(const Message &msg) {
+  if (!m_inTransaction) {
+    throw OperationException("No transaction in progress");
+  }
+  if (!m_writeSet.rollback_to(msg.get_savepoint())) {
+    throw OperationException("No such savepoint: " + msg.get_savepoint());
+  }
+  send_ok();
+}
+
+// Write a checkpoint of every table. Returns once it is durable.
+void ClientConnection::handle_SNAPSHOT(const Message &msg) {
+  (void)msg;
+  if (m_inTransaction) {
+    throw OperationException("SNAPSHOT is not allowed in a transaction");
+  }
+  m_server->checkpoint();
+  send_ok();
+}
+
+// Pass a table's rows as of a snapshot to emit, as COMMIT records of
+// DUMP_BATCH_SIZE rows. The table is latched only while each batch is
+// copied, so writers aren't held up while the rows are sent.
+void ClientConnection::read_rows_at(Table *tbl, uint64_t snapshot,
+                                    const std::function<void(const LogRecord &)> &emit) {
+  std::string after;
+  bool more = true;
+  while (more) {
+    LogRecord record{LogRecord::COMMIT, "", {}};
+    record.changes.emplace_back(tbl->get_name(), WriteSet::Changes());
+    WriteSet::Changes &rows = record.changes.back().second;
+    {
+      TableLatch latch(tbl);
+      more = tbl->scan_at(after, "", snapshot, DUMP_BATCH_SIZE, rows);
+    }
+    if (rows.empty()) {
+      break;
+    }
+    after = rows.rbegin()->first;
+    emit(record);
+  }
+}
+
+// Send a table's rows as of a snapshot: OK, then COMMIT log records
+// of the rows (framed as in the commit log), then an empty frame
+void ClientConnection::handle_DUMP(const Message &msg) {
+  if (m_inTransaction) {
+    throw OperationException("DUMP is not allowed in a transaction");
+  }
+  Table *tbl = find_table(msg.get_table());
+
+  CommitClock &clock = m_server->get_commit_clock();
+  uint64_t snapshot = clock.open_snapshot();
+  try {
+    send_ok();
+    read_rows_at(tbl, snapshot, [this](const LogRecord &record) {
+      std::string encoded;
+      record.encode(encoded);
+      write_response(encoded);
+    });
+    write_response(std::string(LogRecord::FRAME_HEADER_SIZE, '\0'));
+  } catch (...) {
+    clock.close_snapshot(snapshot);
+    throw;
+  }
+  clock.close_snapshot(snapshot);
+}
+
+// Create a table from the records a DUMP sent, which follow the
+// request. Each record's rows are loaded straight into the new table's
+// storage, which is added to the registry (and logged) once all of
+// them are read. The records are read even if the table can't be
+// restored, so the next request is found after them.
+void ClientConnection::handle_RESTORE(const Message &msg) {
+  std::string name = msg.get_table();
+  Table *tbl = m_server->new_table(name);
+  try {
+    LogRecord record;
+    while (read_record(record)) {
+      if (record.type != LogRecord::COMMIT) {
+        throw InvalidMessage("RESTORE expects COMMIT records");
+      }
+      for (const auto &table : record.changes) {
+        tbl->load(table.second);
+      }
+    }
+    if (m_inTransaction) {
+      throw OperationException("RESTORE is not allowed in a transaction");
+    }
+    if (m_server->is_replica()) {
+      throw OperationException("Server is a read-only replica");
+    }
+  } catch (...) {
+    tbl->mark_dropped();
+    delete tbl;
+    throw;
+  }
+  m_server->restore_table(name, tbl);
+  send_ok();
+}
+
+// Stream this server's tables, and then every record it logs, to a
+// replica (see ReplicationFeed). Only ends when the replica disconnects
+// or falls too far behind, which ends the session.
+void ClientConnection::handle_REPLICATE(const Message &msg) {
+  (void)msg;
+  if (m_inTransaction) {
+    throw OperationException("REPLICATE is not allowed in a transaction");
+  }
+  ReplicationFeed::Subscriber *subscriber = m_server->subscribe_replica();
+  try {
+    send_ok();
+
+    // The snapshot: each table's creation and rows, as of one moment
+    CommitClock &clock = m_server->get_commit_clock();
+    uint64_t snapshot = clock.open_snapshot();
+    try {
+      std::string messages;
+      auto emit = [this, &messages](const LogRecord &record) {
+        ReplicationFeed::encode(&record, messages);
+        if (messages.size() >= SNAPSHOT_SEND_BYTES) {
+          ReplicationFeed::send(m_client_fd, messages);
+          messages.clear();
+        }
+      };
+      for (const auto &entry : *m_server->get_table_map()) {
+        emit(LogRecord{LogRecord::CREATE_TABLE, entry.first, {}});
+        read_rows_at(entry.second, snapshot, emit);
+      }
+      ReplicationFeed::encode(nullptr, messages); // End of the snapshot
+      ReplicationFeed::send(m_client_fd, messages);
+    } catch (...) {
+      clock.close_snapshot(snapshot);
+      throw;
+    }
+    clock.close_snapshot(snapshot);
+    unpin(); // No table is used from now on
+
+    std::string messages;
+    while (m_server->take_replicated(subscriber, messages)) {
+      ReplicationFeed::send(m_client_fd, messages);
+      messages.clear();
+    }
+    m_server->log_error("Replica fell too far behind; disconnecting it");
+  } catch (...) {
+    m_server->unsubscribe_replica(subscriber);
+    throw;
+  }
+  m_server->unsubscribe_replica(subscriber);
+  throw CommException("Replica disconnected");
+}
+
 void ClientConnection::handle_BYE(const Message &msg, bool &done) {
   (void)msg;
   send_ok();
   done = true; // End session after BYE
 }
 
-void ClientConnection::lock_table_autocommit(Table *tbl) {
-  tbl->lock();
+Table *ClientConnection::find_table(const std::string &name) {
+  if (m_inTransaction && m_txnMode == READONLY) {
+    auto it = m_snapshotTables->find(name);
+    if (it == m_snapshotTables->end()) {
+      throw OperationException("No such table");
+    }
+    return it->second;
+  }
+
+  // Any registry change invalidates every cached table
+  unsigned long generation = m_server->get_tables_generation();
+  if (generation != m_tableCacheGeneration) {
+    m_tableCacheCount = 0;
+    m_tableCacheGeneration = generation;
+  }
+
+  unsigned i = 0;
+  while (i < m_tableCacheCount && m_tableCache[i].name != name) {
+    i++;
+  }
+
+  CachedTable found;
+  if (i < m_tableCacheCount) {
+    found = m_tableCache[i];
+  } else {
+    found.name = name;
+    found.table = m_server->find_table(name);
+    if (!found.table) {
+      throw OperationException("No such table");
+    }
+    if (m_tableCacheCount < TABLE_CACHE_SIZE) {
+      m_tableCacheCount++;
+    }
+    i = m_tableCacheCount - 1; // Evict the least recently used table if full
+  }
+
+  // Move the table to the front
+  for (; i > 0; i--) {
+    m_tableCache[i] = m_tableCache[i - 1];
+  }
+  m_tableCache[0] = found;
+  return found.table;
+}
+
+// Merge the current transaction's changes to tbl into a batch of
+// committed rows. Only changed keys up to resume_after (the end of the
+// batch, if the scan isn't finished) belong in this batch.
+void ClientConnection::overlay_changes(Table *tbl, const std::string &after, const std::string &prefix,
+                                       std::string &resume_after, Rows &rows) {
+  const WriteSet::Changes *changes = m_writeSet.get_changes(tbl);
+  if (!changes) {
+    return;
+  }
+
+  std::map<std::string, std::string> merged(rows.begin(), rows.end());
+  for (auto it = changes->upper_bound(after); it != changes->end(); ++it) {
+    const std::string &key = it->first;
+    if (!resume_after.empty() && key > resume_after) {
+      break;
+    }
+    if (key.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    if (it->second.value.empty()) {
+      merged.erase(key); // Deleted by this transaction
+    } else {
+      merged[key] = it->second.value;
+    }
+  }
+  rows.assign(merged.begin(), merged.end());
 }
 
-void ClientConnection::lock_table_transaction(Table *tbl) {
-  if (m_lockedTables.count(tbl)) return;
-  if (!tbl->trylock()) {
-    throw FailedTransaction("Failed to acquire table lock for transaction");
+// Locks are held until the transaction ends, or outside a transaction,
+// until the request is done. Waiting for a lock throws TransactionConflict
+// on deadlock or timeout.
+void ClientConnection::lock_table(Table *tbl, LockManager::Mode mode) {
+  m_server->get_locks().lock_table(&m_lockOwner, tbl, mode);
+  check_not_dropped(tbl);
+}
+
+void ClientConnection::lock_key(Table *tbl, const std::string &key, LockManager::Mode mode) {
+  m_server->get_locks().lock_key(&m_lockOwner, tbl, key, mode);
+  check_not_dropped(tbl);
+}
+
+// Once a table is locked (even with an intention lock), it can't be
+// dropped, but it may have been dropped before it was locked
+void ClientConnection::check_not_dropped(Table *tbl) {
+  if (!tbl->is_dropped()) {
+    return;
+  }
+  if (m_inTransaction) {
+    // Rolling back releases the lock
+    throw FailedTransaction("Table was dropped during transaction");
+  }
+  throw OperationException("Table was dropped or truncated");
+}
+
+// Lock everything a declared transaction will use: whole tables, and
+// individual keys, exclusively. If this fails, BEGIN fails, releasing
+// whatever was locked.
+void ClientConnection::declare_locks(const Message &msg) {
+  m_declared.clear();
+  std::vector<LockManager::Request> requests;
+  for (unsigned i = 0; i < msg.get_num_args(); i++) {
+    std::string arg = msg.get_arg(i);
+    size_t sep = arg.find(Message::BEGIN_KEY_SEPARATOR);
+    std::string key = (sep == std::string::npos) ? "" : arg.substr(sep + 1);
+    Table *tbl = find_table(arg.substr(0, sep));
+    if (m_declared[tbl].insert(key).second) {
+      requests.push_back(LockManager::Request{tbl, key, LockManager::EXCLUSIVE});
+    }
+  }
+
+  m_server->get_locks().lock_declared(&m_lockOwner, requests);
+  for (const auto &entry : m_declared) {
+    check_not_dropped(entry.first);
+  }
+}
+
+// A declared transaction may only use what it locked at BEGIN (an
+// empty key means the whole table is needed)
+void ClientConnection::check_declared(Table *tbl, const std::string &key) {
+  if (!m_inTransaction || m_txnMode != DECLARED) {
+    return;
+  }
+  auto it = m_declared.find(tbl);
+  if (it == m_declared.end() || (it->second.count("") == 0 && (key.empty() || it->second.count(key) == 0))) {
+    throw OperationException("Table or key was not declared at BEGIN");
+  }
+}
+
+void ClientConnection::unlock_tables() {
+  m_server->get_locks().release_all(&m_lockOwner);
+}
+
+void ClientConnection::pin_key(Table *tbl, const std::string &key) {
+  if (m_pinnedKeys[tbl].insert(key).second) {
+    tbl->pin_key(key);
+  }
+}
+
+// The tables are still valid (even if dropped since), as the
+// connection stays pinned until the transaction ends
+void ClientConnection::unpin_keys() {
+  for (const auto &entry : m_pinnedKeys) {
+    TableLatch latch(entry.first);
+    for (const std::string &key : entry.second) {
+      entry.first->unpin_key(key);
+    }
+  }
+  m_pinnedKeys.clear();
+}
+
+// With the keys it read locked, check that an optimistic
+// transaction's reads are still current
+void ClientConnection::validate_reads() {
+  for (const auto &entry : m_readSet) {
+    Table *tbl = entry.first;
+    TableLatch latch(tbl);
+    for (const auto &read : entry.second) {
+      if (tbl->get_version(read.first) != read.second) {
+        throw TransactionConflict("Conflict: " + read.first + " changed since it was read");
+      }
+    }
   }
-  m_lockedTables.insert(tbl);
 }
 
 void ClientConnection::commit_transaction() {
-  for (auto tbl : m_lockedTables) {
-    tbl->commit_changes();
-    tbl->unlock();
+  if (m_txnMode == READONLY) {
+    rollback_transaction(); // Nothing to apply
+    return;
+  }
+
+  // Keys that were written (or read optimistically) are locked now, in
+  // a canonical order, so their locks are held just for the commit
+  // itself. If one can't be acquired, the FailedTransaction rolls back
+  // and releases what was locked so far.
+  std::map<Table*, std::map<std::string, LockManager::Mode>> locks;
+  for (const auto &entry : m_readSet) {
+    for (const auto &read : entry.second) {
+      locks[entry.first][read.first] = LockManager::SHARED;
+    }
+  }
+  for (const auto &entry : m_writeSet) {
+    for (const auto &change : entry.second) {
+      locks[entry.first][change.first] = LockManager::EXCLUSIVE;
+    }
+  }
+  for (const auto &entry : locks) {
+    for (const auto &key : entry.second) {
+      lock_key(entry.first, key.first, key.second);
+    }
   }
-  m_lockedTables.clear();
+  // A transaction wounded earlier may have lost locks it was using, and
+  // once sealed, it can't lose the ones it commits with
+  m_server->get_locks().seal(&m_lockOwner);
+  validate_reads();
+
+  // Stamped only now that the keys are locked, so commits to the same
+  // key are stamped in the order they are applied
+  uint64_t lsn;
+  {
+    CommitGuard commit(m_server->get_commit_clock());
+
+    // Logged before the changes are applied (but after being stamped, so
+    // a checkpoint's log segment holds every commit its snapshot misses),
+    // and the client isn't told the commit succeeded until the record is
+    // durable. The locks needn't be held while waiting: a commit that
+    // depends on this one is logged after it, so it can't be durable
+    // unless this one is.
+    lsn = m_server->log_commit(m_writeSet);
+    for (const auto &entry : m_writeSet) {
+      TableLatch latch(entry.first);
+      entry.first->commit_changes(entry.second, commit.get());
+    }
+  }
+  m_server->get_locks().end_transaction(&m_lockOwner);
+  unpin_keys();
+  m_writeSet.clear();
+  m_readSet.clear();
+  m_declared.clear();
+  m_txnLog.clear();
   m_inTransaction = false;
+  m_server->enforce_memory_limit();
+  m_server->wait_durable(lsn);
 }
 
 void ClientConnection::rollback_transaction() {
-  for (auto tbl : m_lockedTables) {
-    tbl->rollback_changes();
-    tbl->unlock();
+  if (m_inTransaction && m_txnMode == READONLY) {
+    m_server->get_commit_clock().close_snapshot(m_snapshot);
   }
-  m_lockedTables.clear();
+
+  // Buffered changes never reached the tables, so just drop them
+  m_server->get_locks().end_transaction(&m_lockOwner);
+  unpin_keys();
+  m_writeSet.clear();
+  m_readSet.clear();
+  m_declared.clear();
+  m_txnLog.clear();
   m_inTransaction = false;
 }
 
@@ -388,7 +1087,86 @@ void ClientConnection::send_data(const std::string &value) {
   Message msg(MessageType::DATA, {value});
   std::string encoded;
   MessageSerialization::encode(msg, encoded);
-  Rio_writen(m_client_fd, encoded.c_str(), encoded.size());
+  write_response(encoded);
+}
+
+// Number of characters an argument adds to an encoded message
+// (a separating space, plus quotes if it needs them)
+static unsigned encoded_arg_len(const std::string &arg) {
+  bool quoted = arg.find_first_of(" \t\n\"") != std::string::npos;
+  return 1 + arg.size() + (quoted ? 2 : 0);
+}
+
+// Send as many rows as fit in one ROWS message, followed by the cursor
+// to resume from. resume_after is the key the scan should continue
+// after, or empty if every remaining row is in rows.
+void ClientConnection::send_rows(const Rows &rows, const std::string &resume_after) {
+  // "ROWS" plus the trailing newline
+  unsigned len = 5;
+  unsigned count = 0;
+  for (; count < rows.size(); count++) {
+    unsigned row_len = encoded_arg_len(rows[count].first) + encoded_arg_len(rows[count].second);
+    // Leave room for the cursor, which will be this key or resume_after
+    unsigned cursor_len = std::max(encoded_arg_len(rows[count].first), encoded_arg_len(resume_after));
+    if (len + row_len + cursor_len > Message::MAX_ENCODED_LEN) {
+      break;
+    }
+    len += row_len;
+  }
+  if (count == 0 && !rows.empty()) {
+    throw OperationException("Row too large for SCAN response");
+  }
+
+  std::string cursor = Message::SCAN_START;
+  if (count < rows.size()) {
+    cursor = rows[count - 1].first;
+  } else if (!resume_after.empty()) {
+    cursor = resume_after;
+  }
+
+  Message msg(MessageType::ROWS, {cursor});
+  for (unsigned i = 0; i < count; i++) {
+    msg.push_arg(rows[i].first);
+    msg.push_arg(rows[i].second);
+  }
+  std::string encoded;
+  MessageSerialization::encode(msg, encoded);
+  write_response(encoded);
+}
+
+// Read the next record a client sends after RESTORE, returning false
+// at the empty frame that ends them
+bool ClientConnection::read_record(LogRecord &record) {
+  char header[LogRecord::FRAME_HEADER_SIZE];
+  if (rio_readnb(&m_fdbuf, header, sizeof(header)) != ssize_t(sizeof(header))) {
+    throw CommException("Connection closed during RESTORE");
+  }
+  uint32_t len = LogRecord::frame_length(header);
+  if (len == 0) {
+    return false;
+  }
+  if (len > LogRecord::MAX_PAYLOAD_SIZE) {
+    throw InvalidMessage("Record too large");
+  }
+  std::vector<char> payload(len);
+  if (rio_readnb(&m_fdbuf, payload.data(), len) != ssize_t(len)) {
+    throw CommException("Connection closed during RESTORE");
+  }
+  if (!record.decode_frame(header, payload.data())) {
+    throw InvalidMessage("Corrupt record");
+  }
+  return true;
+}
+
+// Responses sent during a RETRY transaction are kept to be logged,
+// and responses to replayed requests aren't sent again
+void ClientConnection::write_response(const std::string &encoded) {
+  if (m_inTransaction && m_retry) {
+    m_response += encoded;
+  }
+  if (!m_replaying) {
+    Rio_writen(m_client_fd, encoded.c_str(), encoded.size());
+  }
 }
 
 void ClientConnection::send_response(MessageType type, const std::string &arg) {
@@ -398,5 +1176,5 @@ void ClientConnection::send_response(MessageType type, const std::string &arg) {
   }
   std::string encoded;
   MessageSerialization::encode(msg, encoded);
-  Rio_writen(m_client_fd, encoded.c_str(), encoded.size());
+  write_response(encoded);
 }
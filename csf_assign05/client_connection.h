@@ -1,35 +1,148 @@
 #ifndef CLIENT_CONNECTION_H
 #define CLIENT_CONNECTION_H
 
+#include <vector>
+#include <map>
+#include <cstdint>
 #include <set>
+#include <functional>
 #include "message.h"
 #include "csapp.h"
 #include "value_stack.h"
+#include "write_set.h"
+#include "read_set.h"
+#include "epoch_manager.h"
+#include "lock_manager.h"
 
 class Server; // forward declaration
 class Table;  // forward declaration
+struct LogRecord; // forward declaration
 
 class ClientConnection {
 private:
+  typedef std::vector<std::pair<std::string, std::string>> Rows;
+
+  // Maximum number of rows returned by one SCAN request
+  // (fewer are returned if they don't fit in one ROWS message)
+  static const unsigned SCAN_BATCH_SIZE = 64;
+
+  // Rows in each record a DUMP (or a replica's snapshot) sends
+  static const unsigned DUMP_BATCH_SIZE = 1024;
+
+  // A replica's snapshot is sent this much at a time
+  static const size_t SNAPSHOT_SEND_BYTES = 1 << 20;
+
+  // Number of recently used tables remembered by find_table
+  static const unsigned TABLE_CACHE_SIZE = 4;
+
+  // Longest delay before the first replay of a RETRY transaction
+  static const unsigned RETRY_BACKOFF_MS = 2;
+
+  // A locking transaction locks each table it reads until it ends. An
+  // optimistic transaction reads without locks, and at commit checks
+  // that nothing it read has changed since. A declared transaction
+  // locks every table and key it will use at BEGIN, and may not use
+  // any others; it never fails for lack of a lock. A read-only
+  // transaction reads a snapshot of every table as of BEGIN, without
+  // locking anything.
+  enum TransactionMode {
+    LOCKING,
+    OPTIMISTIC,
+    DECLARED,
+    READONLY,
+  };
+
+  struct LoggedRequest {
+    Message request;
+    std::string response; // Every response sent to the request
+  };
+
+  struct CachedTable {
+    std::string name;
+    Table *table;
+  };
+
   Server *m_server;
   int m_client_fd;
   rio_t m_fdbuf;
 
   ValueStack m_stack;
   bool m_inTransaction;
-  std::set<Table*> m_lockedTables;
+  TransactionMode m_txnMode;
+  LockManager::Owner m_lockOwner; // Locks of the current transaction or request
+  WriteSet m_writeSet;            // Changes made by the current transaction
+  ReadSet m_readSet;              // Versions read by an optimistic transaction
+
+  // Tables and keys locked by a declared transaction (a table's set
+  // holds an empty key if the whole table is locked)
+  std::map<Table*, std::set<std::string>> m_declared;
+
+  // Keys the current transaction has pinned, so they aren't evicted:
+  // those it will write, and those it read optimistically (which
+  // aren't locked until COMMIT, if at all)
+  std::map<Table*, std::set<std::string>> m_pinnedKeys;
+
+  // A read-only transaction's snapshot timestamp, and the tables that
+  // existed at BEGIN (kept alive by staying pinned)
+  uint64_t m_snapshot;
+  const std::map<std::string, Table*> *m_snapshotTables;
+
+  // A transaction begun with RETRY is replayed if it loses a conflict,
+  // from its requests and responses so far and the stack as of BEGIN
+  bool m_retry;
+  ValueStack m_stackAtBegin;
+  std::vector<LoggedRequest> m_txnLog;
+  std::string m_response; // Responses to the current request, if logging
+  bool m_replaying;       // Responses are logged but not sent
+  unsigned m_retrySeed;   // For randomizing the backoff
+
+  // Most recently used tables first; only valid while the server's
+  // registry generation equals m_tableCacheGeneration
+  CachedTable m_tableCache[TABLE_CACHE_SIZE];
+  unsigned m_tableCacheCount;
+  unsigned long m_tableCacheGeneration;
+
+  // Tables found by this connection can't be freed while it's pinned.
+  // It's pinned while handling a request, and throughout a transaction
+  // (which holds tables across requests).
+  EpochManager::Participant *m_epochParticipant;
+  bool m_pinned;
+
+  void pin();
+  void unpin();
 
   bool is_integer(const std::string &s) const;
 
+  void process_request(const Message &request, bool &logged_in, bool &done);
+  void handle_request(const Message &request, bool &logged_in, bool &done);
+  void log_request(const Message &request);
+  static bool changes_data(MessageType type);
+  void replay_transaction(unsigned attempt);
+
   void send_ok();
   void send_failed(const std::string &reason);
   void send_error(const std::string &reason);
   void send_data(const std::string &value);
   void send_response(MessageType type, const std::string &arg = "");
+  void write_response(const std::string &encoded);
+  void send_rows(const Rows &rows, const std::string &resume_after);
+  bool read_record(LogRecord &record);
+  void read_rows_at(Table *tbl, uint64_t snapshot, const std::function<void(const LogRecord &)> &emit);
+
+  Table *find_table(const std::string &name);
+  void overlay_changes(Table *tbl, const std::string &after, const std::string &prefix,
+                       std::string &resume_after, Rows &rows);
 
-  void lock_table_autocommit(Table *tbl);
-  void lock_table_transaction(Table *tbl);
+  void lock_table(Table *tbl, LockManager::Mode mode);
+  void lock_key(Table *tbl, const std::string &key, LockManager::Mode mode);
+  void check_not_dropped(Table *tbl);
+  void declare_locks(const Message &msg);
+  void check_declared(Table *tbl, const std::string &key);
+  void unlock_tables();
+  void pin_key(Table *tbl, const std::string &key); // With the table latched
+  void unpin_keys();
 
+  void validate_reads();
   void commit_transaction();
   void rollback_transaction();
 
@@ -47,6 +160,16 @@ private:
   void handle_BEGIN(const Message &msg);
   void handle_COMMIT(const Message &msg);
   void handle_BYE(const Message &msg, bool &done);
+  void handle_SCAN(const Message &msg);
+  void handle_STATS(const Message &msg);
+  void handle_DROP(const Message &msg);
+  void handle_TRUNCATE(const Message &msg);
+  void handle_SAVEPOINT(const Message &msg);
+  void handle_ROLLBACK(const Message &msg);
+  void handle_SNAPSHOT(const Message &msg);
+  void handle_DUMP(const Message &msg);
+  void handle_RESTORE(const Message &msg);
+  void handle_REPLICATE(const Message &msg);
 
   ClientConnection(const ClientConnection &);
   ClientConnection &operator=(const ClientConnection &);
@@ -0,0 +1,69 @@
+#include <cassert>
+#include "commit_clock.h"
+#include "guard.h"
+
+CommitClock::CommitClock()
+  : m_last(0)
+  , m_snapshot_waiters(0)
+{
+  pthread_mutex_init(&m_mutex, nullptr);
+  pthread_cond_init(&m_committed, nullptr);
+}
+
+CommitClock::~CommitClock()
+{
+  assert(m_in_flight.empty() && m_snapshots.empty());
+  pthread_cond_destroy(&m_committed);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+CommitClock::Commit CommitClock::begin_commit()
+{
+  Guard g(m_mutex);
+  Commit commit;
+  commit.ts = ++m_last;
+  // A snapshot opened later has a timestamp of at least ts, so it
+  // sees this commit, and needs nothing it replaces
+  commit.keep_history = !m_snapshots.empty();
+  m_in_flight.insert(commit.ts);
+  return commit;
+}
+
+void CommitClock::end_commit(const Commit &commit)
+{
+  Guard g(m_mutex);
+  m_in_flight.erase(commit.ts);
+  if (m_snapshot_waiters > 0) {
+    pthread_cond_broadcast(&m_committed);
+  }
+}
+
+uint64_t CommitClock::open_snapshot()
+{
+  Guard g(m_mutex);
+  uint64_t snapshot = m_last;
+  m_snapshots.insert(snapshot);
+
+  // Commits that start from now on keep history for this snapshot.
+  // Earlier ones must finish, since they are part of it.
+  m_snapshot_waiters++;
+  while (!m_in_flight.empty() && *m_in_flight.begin() <= snapshot) {
+    pthread_cond_wait(&m_committed, &m_mutex);
+  }
+  m_snapshot_waiters--;
+  return snapshot;
+}
+
+void CommitClock::close_snapshot(uint64_t snapshot)
+{
+  Guard g(m_mutex);
+  auto it = m_snapshots.find(snapshot);
+  assert(it != m_snapshots.end());
+  m_snapshots.erase(it);
+}
+
+uint64_t CommitClock::get_horizon()
+{
+  Guard g(m_mutex);
+  return m_snapshots.empty() ? m_last : *m_snapshots.begin();
+}
@@ -0,0 +1,84 @@
+#ifndef COMMIT_CLOCK_H
+#define COMMIT_CLOCK_H
+
+#include <set>
+#include <cstdint>
+#include <pthread.h>
+
+// Orders commits, so a read-only transaction can read every table as
+// of one moment. Each commit gets a timestamp, and tables stamp the
+// versions it writes with it. A snapshot's timestamp is the latest
+// commit started when it was opened; opening it waits for that commit
+// (and every earlier one) to finish, so the snapshot sees each commit
+// either completely or not at all.
+//
+// While snapshots are open, commits ask tables to keep the versions
+// they replace (history), which snapshots may still need. History no
+// open or future snapshot can see is pruned.
+class CommitClock {
+public:
+  struct Commit {
+    uint64_t ts;       // Commit timestamp (0 for unstamped writes)
+    bool keep_history; // A snapshot may need the versions replaced
+
+    Commit() : ts(0), keep_history(false) { }
+  };
+
+private:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_committed; // Signaled when a commit ends
+  uint64_t m_last;                  // Latest timestamp given out
+  std::set<uint64_t> m_in_flight;   // Commits started but not ended
+  std::multiset<uint64_t> m_snapshots; // Open snapshots
+  unsigned m_snapshot_waiters;
+
+  // copy constructor and assignment operator are prohibited
+  CommitClock(const CommitClock &);
+  CommitClock &operator=(const CommitClock &);
+
+public:
+  CommitClock();
+  ~CommitClock();
+
+  // Every change applied between begin_commit and end_commit is
+  // stamped with the returned commit
+  Commit begin_commit();
+  void end_commit(const Commit &commit);
+
+  // Open a snapshot, returning its timestamp: versions committed at or
+  // before it are visible
+  uint64_t open_snapshot();
+  void close_snapshot(uint64_t snapshot);
+
+  // History superseded at or before the horizon can't be seen by any
+  // open or future snapshot
+  uint64_t get_horizon();
+};
+
+// Begins a commit, and ends it when destroyed, so a commit that fails
+// partway (say, if the log rejects it) can't leave snapshots waiting
+// for it forever
+class CommitGuard {
+private:
+  CommitClock &m_clock;
+  CommitClock::Commit m_commit;
+
+  // copy constructor and assignment operator are prohibited
+  CommitGuard(const CommitGuard &);
+  CommitGuard &operator=(const CommitGuard &);
+
+public:
+  CommitGuard(CommitClock &clock)
+    : m_clock(clock)
+    , m_commit(clock.begin_commit())
+  { }
+
+  ~CommitGuard()
+  {
+    m_clock.end_commit(m_commit);
+  }
+
+  const CommitClock::Commit &get() const { return m_commit; }
+};
+
+#endif // COMMIT_CLOCK_H
@@ -0,0 +1,795 @@
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "commit_log.h"
+#include "exceptions.h"
+#include "guard.h"
+
+namespace {
+
+uint32_t crc32(const char *data, size_t len)
+{
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// Integers are stored little-endian
+void put_u32(std::string &out, uint32_t n)
+{
+  for (int i = 0; i < 4; i++) {
+    out.push_back(char(n >> (8 * i)));
+  }
+}
+
+void put_u64(std::string &out, uint64_t n)
+{
+  for (int i = 0; i < 8; i++) {
+    out.push_back(char(n >> (8 * i)));
+  }
+}
+
+void put_string(std::string &out, const std::string &s)
+{
+  put_u32(out, s.size());
+  out += s;
+}
+
+uint32_t get_u32(const char *p)
+{
+  uint32_t n = 0;
+  for (int i = 0; i < 4; i++) {
+    n |= uint32_t(uint8_t(p[i])) << (8 * i);
+  }
+  return n;
+}
+
+// Reads fields from an encoded record, failing (rather than reading
+// past the end) if the record is too short
+class Decoder {
+private:
+  const char *m_pos;
+  const char *m_end;
+
+public:
+  Decoder(const char *data, size_t len) : m_pos(data), m_end(data + len) { }
+
+  bool at_end() const { return m_pos == m_end; }
+
+  bool u8(uint8_t &n)
+  {
+    if (m_end - m_pos < 1) {
+      return false;
+    }
+    n = uint8_t(*m_pos++);
+    return true;
+  }
+
+  bool u32(uint32_t &n)
+  {
+    if (m_end - m_pos < 4) {
+      return false;
+    }
+    n = get_u32(m_pos);
+    m_pos += 4;
+    return true;
+  }
+
+  bool u64(uint64_t &n)
+  {
+    uint32_t lo, hi;
+    if (!u32(lo) || !u32(hi)) {
+      return false;
+    }
+    n = uint64_t(hi) << 32 | lo;
+    return true;
+  }
+
+  bool string(std::string &s)
+  {
+    uint32_t len;
+    if (!u32(len) || uint64_t(m_end - m_pos) < len) {
+      return false;
+    }
+    s.assign(m_pos, len);
+    m_pos += len;
+    return true;
+  }
+};
+
+// Buffered sequential reads from a file descriptor
+class FileReader {
+private:
+  int m_fd;
+  std::vector<char> m_buf;
+  size_t m_pos, m_len;
+
+public:
+  FileReader(int fd) : m_fd(fd), m_buf(1 << 20), m_pos(0), m_len(0) { }
+
+  // Read exactly n bytes into out. Returns false at end of file
+  // (or if only part of them remain).
+  bool read(char *out, size_t n)
+  {
+    while (n > 0) {
+      if (m_pos == m_len) {
+        ssize_t rc = ::read(m_fd, m_buf.data(), m_buf.size());
+        if (rc < 0 && errno == EINTR) {
+          continue;
+        }
+        if (rc < 0) {
+          throw StorageException(std::string("Could not read log file: ") + strerror(errno));
+        }
+        if (rc == 0) {
+          return false;
+        }
+        m_pos = 0;
+        m_len = rc;
+      }
+      size_t chunk = std::min(n, m_len - m_pos);
+      memcpy(out, m_buf.data() + m_pos, chunk);
+      m_pos += chunk;
+      out += chunk;
+      n -= chunk;
+    }
+    return true;
+  }
+};
+
+bool time_reached(const timespec &deadline)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+// Limits compaction's I/O to a rate, sleeping whenever it gets ahead
+class Throttle {
+private:
+  uint64_t m_bytes_per_s;
+  const std::atomic<bool> &m_stopping;
+  timespec m_start;
+  uint64_t m_bytes;
+
+public:
+  Throttle(uint64_t bytes_per_s, const std::atomic<bool> &stopping)
+    : m_bytes_per_s(bytes_per_s), m_stopping(stopping), m_bytes(0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &m_start);
+  }
+
+  // Account for n more bytes. Returns false if stopping.
+  bool add(uint64_t n)
+  {
+    m_bytes += n;
+    while (!m_stopping.load()) {
+      if (m_bytes_per_s == 0) {
+        return true;
+      }
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double elapsed = (now.tv_sec - m_start.tv_sec) + (now.tv_nsec - m_start.tv_nsec) / 1e9;
+      double ahead = double(m_bytes) / m_bytes_per_s - elapsed;
+      if (ahead <= 0) {
+        return true;
+      }
+      usleep(std::min(ahead, 0.1) * 1e6); // Checking often, so stopping isn't delayed
+    }
+    return false;
+  }
+};
+
+timespec time_after_ms(unsigned ms)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += long(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+}
+
+void LogRecord::encode(std::string &out) const
+{
+  size_t start = out.size();
+  out.append(FRAME_HEADER_SIZE, '\0'); // Filled in once the payload is known
+
+  out.push_back(char(type));
+  if (type != COMMIT) {
+    put_string(out, table);
+  }
+  if (type == COMMIT || type == RESTORE_TABLE) {
+    put_u32(out, changes.size());
+    for (const auto &tbl : changes) {
+      put_string(out, tbl.first);
+      put_u32(out, tbl.second.size());
+      for (const auto &change : tbl.second) {
+        put_string(out, change.first);
+        put_string(out, change.second.value);
+        put_u64(out, change.second.expires_at);
+      }
+    }
+  }
+
+  size_t len = out.size() - start - FRAME_HEADER_SIZE;
+  std::string header;
+  put_u32(header, len);
+  put_u32(header, crc32(out.data() + start + FRAME_HEADER_SIZE, len));
+  out.replace(start, FRAME_HEADER_SIZE, header);
+}
+
+bool LogRecord::decode(const char *data, size_t len)
+{
+  Decoder d(data, len);
+  uint8_t t;
+  if (!d.u8(t) || t < COMMIT || t > RESTORE_TABLE) {
+    return false;
+  }
+  type = Type(t);
+  table.clear();
+  changes.clear();
+
+  if (type != COMMIT && !d.string(table)) {
+    return false;
+  }
+  if (type != COMMIT && type != RESTORE_TABLE) {
+    return d.at_end();
+  }
+  uint32_t ntables;
+  if (!d.u32(ntables)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < ntables; i++) {
+    changes.emplace_back();
+    uint32_t nchanges;
+    if (!d.string(changes.back().first) || !d.u32(nchanges)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < nchanges; j++) {
+      std::string key;
+      WriteSet::Change change;
+      if (!d.string(key) || !d.string(change.value) || !d.u64(change.expires_at)) {
+        return false;
+      }
+      changes.back().second[key] = change;
+    }
+  }
+  return d.at_end();
+}
+
+uint32_t LogRecord::frame_length(const char *header)
+{
+  return get_u32(header);
+}
+
+bool LogRecord::decode_frame(const char *header, const char *payload)
+{
+  uint32_t len = get_u32(header);
+  return crc32(payload, len) == get_u32(header + 4) && decode(payload, len);
+}
+
+CommitLog::CommitLog(const std::string &path, SyncPolicy policy, unsigned sync_interval_ms)
+  : m_path(path)
+  , m_policy(policy)
+  , m_sync_interval_ms(sync_interval_ms)
+  , m_fd(-1)
+  , m_segment(0)
+  , m_oldest_segment(0)
+  , m_compacted_segment(0)
+  , m_queued_bytes(0)
+  , m_end(0)
+  , m_durable(0)
+  , m_failed(false)
+  , m_flushing(false)
+  , m_stopping(false)
+  , m_writer_started(false)
+  , m_syncs(0)
+{
+  pthread_mutex_init(&m_mutex, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_appended, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&m_durable_cond, nullptr);
+}
+
+CommitLog::~CommitLog()
+{
+  if (m_writer_started) {
+    {
+      Guard g(m_mutex);
+      m_stopping = true;
+      pthread_cond_signal(&m_appended);
+    }
+    pthread_join(m_writer, nullptr);
+  }
+  if (m_fd >= 0) {
+    pthread_mutex_lock(&m_mutex);
+    if (!m_queue.empty()) {
+      flush_queue(false); // Queued by committers that didn't wait
+    }
+    pthread_mutex_unlock(&m_mutex);
+    if (!m_failed) {
+      fdatasync(m_fd);
+    }
+    close(m_fd);
+  }
+  pthread_cond_destroy(&m_durable_cond);
+  pthread_cond_destroy(&m_appended);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+uint64_t CommitLog::read_records(int fd, const ApplyFunc &apply, unsigned long &count,
+                                 const std::function<bool(uint64_t)> &progress, uint64_t progress_bytes)
+{
+  FileReader reader(fd);
+  uint64_t offset = 0;
+  std::vector<char> payload;
+  LogRecord record;
+  char header[LogRecord::FRAME_HEADER_SIZE];
+  while (reader.read(header, sizeof(header))) {
+    uint32_t len = LogRecord::frame_length(header);
+    if (len > LogRecord::MAX_PAYLOAD_SIZE) {
+      break;
+    }
+    payload.resize(len);
+    if (!reader.read(payload.data(), len) || !record.decode_frame(header, payload.data())) {
+      break;
+    }
+    apply(record);
+    uint64_t next = offset + sizeof(header) + len;
+    count++;
+    if (progress && next / progress_bytes != offset / progress_bytes && !progress(next)) {
+      return next;
+    }
+    offset = next;
+  }
+  return offset;
+}
+
+bool CommitLog::write_all(int fd, const std::string &data)
+{
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t rc = write(fd, data.data() + written, data.size() - written);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc < 0) {
+      return false;
+    }
+    written += rc;
+  }
+  return true;
+}
+
+void CommitLog::sync_directory(const std::string &path)
+{
+  size_t slash = path.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+  int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+std::string CommitLog::segment_path(unsigned long segment) const
+{
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%06lu", segment);
+  return m_path + suffix;
+}
+
+std::vector<unsigned long> CommitLog::list_numbered(const std::string &path)
+{
+  size_t slash = path.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+  std::string prefix = path.substr(slash == std::string::npos ? 0 : slash + 1) + ".";
+
+  std::vector<unsigned long> segments;
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    throw StorageException("Could not read directory " + dir + ": " + strerror(errno));
+  }
+  while (struct dirent *ent = readdir(d)) {
+    std::string name = ent->d_name;
+    if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+        name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+      segments.push_back(std::stoul(name.substr(prefix.size())));
+    }
+  }
+  closedir(d);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+unsigned long CommitLog::open(const ApplyFunc &apply, unsigned long first_segment, const ProgressFunc &progress)
+{
+  assert(m_fd < 0);
+
+  std::vector<unsigned long> segments;
+  uint64_t total = 0;
+  for (unsigned long segment : list_numbered(m_path)) {
+    if (segment < first_segment) {
+      unlink(segment_path(segment).c_str()); // Covered by a checkpoint
+      continue;
+    }
+    struct stat st;
+    if (stat(segment_path(segment).c_str(), &st) == 0) {
+      total += st.st_size;
+    }
+    segments.push_back(segment);
+  }
+
+  // Replay each segment's complete records, in order. A torn record
+  // is cut off, so new records follow the last good one.
+  unsigned long count = 0;
+  uint64_t done = 0;
+  std::function<bool(uint64_t)> report;
+  if (progress) {
+    report = [&progress, &done, total](uint64_t offset) {
+      progress(done + offset, total);
+      return true;
+    };
+  }
+  m_segment = first_segment;
+  m_oldest_segment = first_segment;
+  bool first = true;
+  for (unsigned long segment : segments) {
+    std::string path = segment_path(segment);
+    unlink((path + ".compact").c_str()); // Left by an unfinished compaction
+    if (m_fd >= 0) {
+      close(m_fd);
+    }
+    m_fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+    if (m_fd < 0) {
+      throw StorageException("Could not open commit log " + path + ": " + strerror(errno));
+    }
+    uint64_t offset = read_records(m_fd, apply, count, report, PROGRESS_BYTES);
+    if (ftruncate(m_fd, offset) != 0) {
+      throw StorageException("Could not truncate commit log " + path + ": " + strerror(errno));
+    }
+    done += offset;
+    if (first) {
+      m_oldest_segment = segment;
+      first = false;
+    }
+    m_segment = segment;
+  }
+  if (m_fd < 0) {
+    m_fd = ::open(segment_path(m_segment).c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (m_fd < 0) {
+      throw StorageException("Could not create commit log " + segment_path(m_segment) + ": " + strerror(errno));
+    }
+  }
+
+  // With SYNC_ALWAYS, committers write the log themselves
+  if (m_policy == SYNC_ALWAYS) {
+    return count;
+  }
+  if (pthread_create(&m_writer, nullptr, writer_worker, this) != 0) {
+    throw StorageException("Could not create commit log writer thread");
+  }
+  m_writer_started = true;
+  return count;
+}
+
+unsigned long CommitLog::rotate()
+{
+  std::string path = segment_path(m_segment + 1);
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    throw StorageException("Could not create commit log " + path + ": " + strerror(errno));
+  }
+
+  Guard g(m_mutex);
+  while (m_flushing) {
+    pthread_cond_wait(&m_durable_cond, &m_mutex);
+  }
+  // Nothing is being written, so the file can be switched. Records
+  // still queued go to the new segment.
+  if (fdatasync(m_fd) != 0) {
+    m_failed = true;
+  }
+  close(m_fd);
+  m_fd = fd;
+  return ++m_segment;
+}
+
+void CommitLog::remove_segments_before(unsigned long segment)
+{
+  for (; m_oldest_segment < segment; m_oldest_segment++) {
+    unlink(segment_path(m_oldest_segment).c_str());
+  }
+}
+
+bool CommitLog::compact(uint64_t bytes_per_s, const std::atomic<bool> &stopping)
+{
+  unsigned long last = m_segment - 1; // Newest segment not being written
+  if (m_oldest_segment > last || (m_oldest_segment == last && last == m_compacted_segment)) {
+    return false;
+  }
+  Throttle throttle(bytes_per_s, stopping);
+
+  // Changes before a table's last creation, truncation or drop are
+  // superseded by it, like earlier changes to the same key
+  std::map<std::string, LogRecord::Type> table_ops;
+  std::map<std::string, WriteSet::Changes> latest;
+  auto apply = [&table_ops, &latest](LogRecord &record) {
+    if (record.type != LogRecord::COMMIT) {
+      // A restored table is written as its creation, then its rows
+      bool restore = record.type == LogRecord::RESTORE_TABLE;
+      table_ops[record.table] = restore ? LogRecord::CREATE_TABLE : record.type;
+      latest.erase(record.table);
+      if (!restore) {
+        return;
+      }
+    }
+    for (auto &table : record.changes) {
+      WriteSet::Changes &changes = latest[table.first];
+      for (auto &change : table.second) {
+        changes[change.first] = std::move(change.second);
+      }
+    }
+  };
+  for (unsigned long segment = m_oldest_segment; segment <= last; segment++) {
+    std::string path = segment_path(segment);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw StorageException("Could not open commit log " + path + ": " + strerror(errno));
+    }
+    unsigned long count = 0;
+    uint64_t throttled = 0;
+    auto progress = [&throttle, &throttled](uint64_t offset) {
+      bool more = throttle.add(offset - throttled);
+      throttled = offset;
+      return more;
+    };
+    uint64_t size;
+    try {
+      size = read_records(fd, apply, count, progress, COMPACT_CHUNK);
+    } catch (StorageException &ex) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    if (!throttle.add(size - throttled)) {
+      return false;
+    }
+  }
+
+  // Write the result under a temporary name, then rename it over the
+  // newest segment. If that is interrupted, replay reads the older
+  // segments and then the compacted one, which ends with the same data.
+  std::string path = segment_path(last);
+  std::string tmp_path = path + ".compact";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw StorageException("Could not create " + tmp_path + ": " + strerror(errno));
+  }
+  std::string buf;
+  bool ok = true;
+  auto write_buf = [&](bool all) {
+    if (ok && (all || buf.size() >= COMPACT_CHUNK)) {
+      if (!write_all(fd, buf)) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        throw StorageException("Could not write " + tmp_path + ": " + strerror(errno));
+      }
+      ok = throttle.add(buf.size());
+      buf.clear();
+    }
+  };
+  for (const auto &op : table_ops) {
+    LogRecord{op.second, op.first, {}}.encode(buf);
+  }
+  LogRecord record{LogRecord::COMMIT, "", {}};
+  size_t record_bytes = 0;
+  for (auto &table : latest) {
+    for (auto &change : table.second) {
+      if (!ok) {
+        break; // Stopping
+      }
+      if (record.changes.empty() || record.changes.back().first != table.first) {
+        record.changes.emplace_back(table.first, WriteSet::Changes());
+      }
+      record_bytes += change.first.size() + change.second.value.size();
+      record.changes.back().second.emplace(change.first, std::move(change.second));
+      if (record_bytes >= COMPACT_RECORD_BYTES) {
+        record.encode(buf);
+        record.changes.clear();
+        record_bytes = 0;
+        write_buf(false);
+      }
+    }
+  }
+  if (ok && !record.changes.empty()) {
+    record.encode(buf);
+  }
+  write_buf(true);
+  if (!ok) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  if (fsync(fd) != 0) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw StorageException("Could not sync " + tmp_path + ": " + strerror(errno));
+  }
+  close(fd);
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    throw StorageException("Could not rename " + tmp_path + ": " + strerror(errno));
+  }
+  sync_directory(path);
+  remove_segments_before(last);
+  m_compacted_segment = last;
+  return true;
+}
+
+uint64_t CommitLog::get_segment_size()
+{
+  Guard g(m_mutex); // rotate switches the file
+  struct stat st;
+  return fstat(m_fd, &st) == 0 ? st.st_size : 0;
+}
+
+uint64_t CommitLog::append(const LogRecord &record)
+{
+  std::string encoded;
+  record.encode(encoded);
+  if (encoded.size() - LogRecord::FRAME_HEADER_SIZE > LogRecord::MAX_PAYLOAD_SIZE) {
+    throw StorageException("Record too large for commit log");
+  }
+
+  Guard g(m_mutex);
+  while (m_queued_bytes >= MAX_QUEUED_BYTES && !m_failed) {
+    pthread_cond_wait(&m_durable_cond, &m_mutex);
+  }
+  m_queued_bytes += encoded.size();
+  m_end += encoded.size();
+  m_queue.emplace_back(std::move(encoded), m_end);
+  pthread_cond_signal(&m_appended);
+  return m_end;
+}
+
+bool CommitLog::wait_durable(uint64_t lsn)
+{
+  Guard g(m_mutex);
+  if (m_policy != SYNC_ALWAYS) {
+    return !m_failed;
+  }
+  while (m_durable < lsn && !m_failed) {
+    if (!m_flushing) {
+      // Lead the next group: flush everything queued so far, including
+      // records of committers waiting behind this one
+      flush_queue(true);
+    } else {
+      pthread_cond_wait(&m_durable_cond, &m_mutex);
+    }
+  }
+  return !m_failed;
+}
+
+unsigned long CommitLog::get_syncs()
+{
+  Guard g(m_mutex);
+  return m_syncs;
+}
+
+void *CommitLog::writer_worker(void *arg)
+{
+  static_cast<CommitLog *>(arg)->write_records();
+  return nullptr;
+}
+
+void CommitLog::write_records()
+{
+  bool unsynced = false; // Records have been written but not synced
+  struct timespec sync_due; // When they must be synced, for SYNC_INTERVAL
+
+  pthread_mutex_lock(&m_mutex);
+  while (!m_stopping || !m_queue.empty()) {
+    if (m_queue.empty()) {
+      if (unsynced && m_policy == SYNC_INTERVAL) {
+        if (pthread_cond_timedwait(&m_appended, &m_mutex, &sync_due) == ETIMEDOUT) {
+          sync_file();
+          unsynced = false;
+        }
+      } else {
+        pthread_cond_wait(&m_appended, &m_mutex);
+      }
+      continue;
+    }
+
+    flush_queue(false);
+    if (!unsynced) {
+      unsynced = true;
+      sync_due = time_after_ms(m_sync_interval_ms);
+    } else if (m_policy == SYNC_INTERVAL && time_reached(sync_due)) {
+      sync_file(); // Records keep arriving, so don't wait for a lull
+      unsynced = false;
+    }
+  }
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void CommitLog::flush_queue(bool sync)
+{
+  assert(!m_flushing);
+  m_flushing = true;
+  std::string batch;
+  uint64_t end = m_durable;
+  while (!m_queue.empty()) {
+    batch += m_queue.front().first;
+    end = m_queue.front().second;
+    m_queue.pop_front();
+  }
+  m_queued_bytes = 0;
+  bool failed = m_failed;
+  pthread_mutex_unlock(&m_mutex);
+
+  // After a failure nothing more is written, so the log stays a
+  // prefix of what was committed
+  bool ok = !failed && write_all(m_fd, batch);
+  if (ok && sync) {
+    ok = fdatasync(m_fd) == 0;
+  }
+
+  pthread_mutex_lock(&m_mutex);
+  if (!ok) {
+    m_failed = true;
+  } else {
+    m_durable = end;
+  }
+  if (sync) {
+    m_syncs++;
+  }
+  m_flushing = false;
+  pthread_cond_broadcast(&m_durable_cond);
+}
+
+void CommitLog::sync_file()
+{
+  assert(!m_flushing);
+  m_flushing = true; // Keeps the file from being rotated meanwhile
+  pthread_mutex_unlock(&m_mutex);
+  bool ok = fdatasync(m_fd) == 0;
+  pthread_mutex_lock(&m_mutex);
+  if (!ok) {
+    m_failed = true;
+  }
+  m_syncs++;
+  m_flushing = false;
+  pthread_cond_broadcast(&m_durable_cond);
+}
@@ -0,0 +1,210 @@
+#ifndef COMMIT_LOG_H
+#define COMMIT_LOG_H
+
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <pthread.h>
+#include "write_set.h"
+
+// One change to the server's durable state: a committed set of key
+// changes (from a transaction or an autocommit SET), the creation,
+// removal or truncation of a table, or the creation of a table
+// restored with its rows
+struct LogRecord {
+  enum Type {
+    COMMIT = 1,
+    CREATE_TABLE,
+    DROP_TABLE,
+    TRUNCATE_TABLE,
+    RESTORE_TABLE,
+  };
+
+  Type type;
+  std::string table; // Table created, dropped, truncated or restored
+  std::vector<std::pair<std::string, WriteSet::Changes>> changes; // COMMIT: changes by table name
+                                                                  // RESTORE_TABLE: the table's rows
+
+  // A record is encoded as a frame: a header giving the payload's
+  // length and checksum, then the payload. A frame with an empty
+  // payload (all zeros) ends a stream of records.
+  static const size_t FRAME_HEADER_SIZE = 8;
+
+  // Longest payload accepted; anything longer is corrupt
+  static const uint32_t MAX_PAYLOAD_SIZE = 1u << 30;
+
+  // Append the record's frame to out
+  void encode(std::string &out) const;
+
+  // Decode a record from a payload, returning false if it is malformed
+  bool decode(const char *data, size_t len);
+
+  // The payload length a frame header gives
+  static uint32_t frame_length(const char *header);
+
+  // Decode the payload of the frame with the given header, returning
+  // false if it doesn't match the checksum or is malformed
+  bool decode_frame(const char *header, const char *payload);
+};
+
+// Write-ahead log of committed changes, which are replayed when the
+// server restarts. Each record is framed by its length and a checksum,
+// so a record torn by a crash is detected, and discarded along with
+// anything after it.
+//
+// The log is a series of segment files, named by appending a sequence
+// number to the log's path. A checkpoint starts a new segment, and once
+// it has saved everything the earlier segments record, they are removed.
+// Between checkpoints, segments no longer written to can be compacted:
+// rewritten as one, keeping only the latest change to each key.
+//
+// Committers only append records to a queue, and the records are
+// written to the file in batches. How often the file is synced is
+// chosen by the policy:
+//
+//   SYNC_ALWAYS    records are synced before their committers are told
+//                  they are durable, using group commit: a waiting
+//                  committer becomes the leader, and writes every queued
+//                  record with a single sync, releasing all of their
+//                  committers at once. Records queued meanwhile form the
+//                  next group, so the more committers are waiting, the
+//                  more records each sync covers.
+//   SYNC_INTERVAL  a dedicated writer thread writes records as they are
+//                  queued, so committers don't block on the disk, and
+//                  syncs them every sync_interval_ms
+//   SYNC_NEVER     the writer thread writes records, and leaves it to
+//                  the OS to sync them
+class CommitLog {
+public:
+  enum SyncPolicy {
+    SYNC_ALWAYS,
+    SYNC_INTERVAL,
+    SYNC_NEVER,
+  };
+
+  typedef std::function<void(LogRecord &)> ApplyFunc; // May move from the record
+  typedef std::function<void(uint64_t done, uint64_t total)> ProgressFunc; // In bytes
+
+private:
+  std::string m_path;
+  SyncPolicy m_policy;
+  unsigned m_sync_interval_ms;
+  int m_fd;                        // Current segment
+  unsigned long m_segment;         // Current segment's number
+  unsigned long m_oldest_segment;  // Oldest segment not yet removed
+  unsigned long m_compacted_segment; // Segment the last compaction wrote (0 = none)
+
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_appended; // Signaled when records are queued (or stopping)
+  pthread_cond_t m_durable_cond; // Signaled when a flush ends (and the queue shrinks)
+  std::deque<std::pair<std::string, uint64_t>> m_queue; // Encoded records, and their end offsets
+  size_t m_queued_bytes;
+  uint64_t m_end;      // Bytes queued since the log was opened
+  uint64_t m_durable;  // Bytes written (and synced, for SYNC_ALWAYS)
+  bool m_failed;       // A write or sync failed; nothing more is durable
+  bool m_flushing;     // The file is being written or synced (queued records aren't)
+  bool m_stopping;
+
+  pthread_t m_writer;  // Only for SYNC_INTERVAL and SYNC_NEVER
+  bool m_writer_started;
+  unsigned long m_syncs;
+
+  static void *writer_worker(void *arg);
+  void write_records();
+
+  // Write every queued record, syncing them if sync is true. Called
+  // with m_mutex held (and no flush in progress); releases it while
+  // writing.
+  void flush_queue(bool sync);
+  void sync_file(); // Sync written records, likewise releasing m_mutex
+
+  std::string segment_path(unsigned long segment) const;
+
+  // Pass each complete record read from fd to apply, stopping at the
+  // first torn or corrupt one, and calling progress with the bytes read
+  // so far after every progress_bytes (stopping if it returns false).
+  // Returns the number of bytes of good records, and adds to count.
+  static uint64_t read_records(int fd, const ApplyFunc &apply, unsigned long &count,
+                               const std::function<bool(uint64_t)> &progress, uint64_t progress_bytes);
+
+  // copy constructor and assignment operator are prohibited
+  CommitLog(const CommitLog &);
+  CommitLog &operator=(const CommitLog &);
+
+public:
+  // Committers wait while this much is queued, so they can't outpace
+  // the disk indefinitely
+  static const size_t MAX_QUEUED_BYTES = 8 << 20;
+
+  // How often open reports progress
+  static const uint64_t PROGRESS_BYTES = 16 << 20;
+
+  // Compaction's reads and writes are throttled this much at a time, and
+  // the changes it keeps are written in records of about COMPACT_RECORD_BYTES
+  static const uint64_t COMPACT_CHUNK = 64 << 10;
+  static const size_t COMPACT_RECORD_BYTES = 1 << 20;
+
+  CommitLog(const std::string &path, SyncPolicy policy, unsigned sync_interval_ms);
+
+  // Writes and syncs every queued record
+  ~CommitLog();
+
+  // Read the records in segments numbered first_segment or later,
+  // passing each to apply (earlier segments are removed), and reporting
+  // progress (if given) after every PROGRESS_BYTES or so. Then start
+  // the writer thread (if the policy uses one) to append new ones. A
+  // torn or corrupt record ends its segment; it is cut off there.
+  // Returns the number of records read. Throws StorageException if the
+  // files can't be used.
+  unsigned long open(const ApplyFunc &apply, unsigned long first_segment = 1,
+                     const ProgressFunc &progress = nullptr);
+
+  // Start a new segment, returning its number. Records appended from
+  // now on (and any still queued) go to it.
+  unsigned long rotate();
+
+  // Remove segments numbered below segment
+  void remove_segments_before(unsigned long segment);
+
+  // Rewrite the segments before the current one as a single segment
+  // (replacing the newest of them), keeping only the latest change to
+  // each key and the last creation, truncation or drop of each table.
+  // Reads and writes at most bytes_per_s (0 = no limit), and gives up if
+  // stopping becomes true. Returns false if there was nothing new to
+  // compact, or it gave up. Throws StorageException if the files can't
+  // be used. The caller must not rotate or remove segments meanwhile.
+  bool compact(uint64_t bytes_per_s, const std::atomic<bool> &stopping);
+
+  // Bytes written to the current segment
+  uint64_t get_segment_size();
+
+  // Queue a record, returning its log sequence number (the number of
+  // bytes queued up to its end). Waits first if too much is queued.
+  // Throws StorageException if the record is too large to be read back.
+  uint64_t append(const LogRecord &record);
+
+  // Wait until the record with the given sequence number is as durable
+  // as the policy makes it: synced for SYNC_ALWAYS (leading a group
+  // commit, or joining one), otherwise just queued. Returns false if
+  // it couldn't be written.
+  bool wait_durable(uint64_t lsn);
+
+  // Write all of data to fd, returning false if it fails
+  static bool write_all(int fd, const std::string &data);
+
+  // Sync the directory holding path, so a file created or renamed
+  // there is durable
+  static void sync_directory(const std::string &path);
+
+  // The numbers n of the files named <path>.n (n being all digits), in
+  // order. Throws StorageException if the directory can't be read.
+  static std::vector<unsigned long> list_numbered(const std::string &path);
+
+  SyncPolicy get_policy() const { return m_policy; }
+  unsigned long get_syncs(); // Times the file has been synced
+};
+
+#endif // COMMIT_LOG_H
@@ -0,0 +1,98 @@
+#include <cassert>
+#include <algorithm>
+#include "epoch_manager.h"
+#include "guard.h"
+
+EpochManager::EpochManager()
+  : m_epoch(1)
+{
+  pthread_mutex_init(&m_mutex, nullptr);
+}
+
+EpochManager::~EpochManager()
+{
+  assert(m_participants.empty());
+  for (Retired &r : m_retired) {
+    r.free();
+  }
+  pthread_mutex_destroy(&m_mutex);
+}
+
+EpochManager::Participant *EpochManager::register_participant()
+{
+  Participant *p = new Participant();
+  Guard g(m_mutex);
+  m_participants.push_back(p);
+  return p;
+}
+
+void EpochManager::unregister_participant(Participant *p)
+{
+  assert(p->m_epoch.load() == 0);
+  {
+    Guard g(m_mutex);
+    m_participants.erase(std::find(m_participants.begin(), m_participants.end(), p));
+  }
+  delete p;
+}
+
+void EpochManager::enter(Participant *p)
+{
+  p->m_epoch.store(m_epoch.load());
+  // Publish the pin before reading any shared pointer. Paired with
+  // the fetch_add in retire: either reclaim sees this participant as
+  // pinned, or this thread sees the object as already unlinked.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochManager::exit(Participant *p)
+{
+  p->m_epoch.store(0, std::memory_order_release);
+}
+
+void EpochManager::retire(std::function<void()> free)
+{
+  // Participants pinned from now on have a later epoch than this
+  // object, and can't have found it
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t epoch = m_epoch.fetch_add(1);
+  Guard g(m_mutex);
+  m_retired.push_back(Retired{epoch, std::move(free)});
+}
+
+size_t EpochManager::reclaim()
+{
+  std::vector<Retired> ready;
+  {
+    Guard g(m_mutex);
+    if (m_retired.empty()) {
+      return 0;
+    }
+
+    // Objects retired before the oldest pinned epoch are unreachable
+    uint64_t oldest = UINT64_MAX;
+    for (Participant *p : m_participants) {
+      uint64_t epoch = p->m_epoch.load();
+      if (epoch != 0) {
+        oldest = std::min(oldest, epoch);
+      }
+    }
+
+    auto keep = std::stable_partition(m_retired.begin(), m_retired.end(),
+                                      [oldest](const Retired &r) { return r.epoch >= oldest; });
+    ready.assign(std::make_move_iterator(keep), std::make_move_iterator(m_retired.end()));
+    m_retired.erase(keep, m_retired.end());
+  }
+
+  // Freeing a large table may take a while, so it's done unlocked
+  for (Retired &r : ready) {
+    r.free();
+  }
+  return ready.size();
+}
+
+size_t EpochManager::pending()
+{
+  Guard g(m_mutex);
+  return m_retired.size();
+}
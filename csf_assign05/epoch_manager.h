@@ -0,0 +1,92 @@
+#ifndef EPOCH_MANAGER_H
+#define EPOCH_MANAGER_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <pthread.h>
+
+// Epoch-based reclamation for objects that threads use without holding
+// a lock, such as tables found through the copy-on-write registry.
+//
+// A thread registers as a participant, and pins itself (enter) before
+// looking up shared objects, and unpins (exit) when it holds no more
+// pointers to them. An object that has been unlinked, so no new
+// reference to it can be found, is retired along with a function to
+// free it. reclaim() frees retired objects once every participant
+// that was pinned when they were retired has since unpinned.
+class EpochManager {
+public:
+  class Participant {
+  private:
+    friend class EpochManager;
+    std::atomic<uint64_t> m_epoch; // Epoch pinned at, or 0 if not pinned
+
+    Participant() : m_epoch(0) { }
+  };
+
+private:
+  struct Retired {
+    uint64_t epoch; // Global epoch when the object was retired
+    std::function<void()> free;
+  };
+
+  std::atomic<uint64_t> m_epoch;
+  pthread_mutex_t m_mutex; // Protects the participant and retired lists
+  std::vector<Participant*> m_participants;
+  std::vector<Retired> m_retired;
+
+  // copy constructor and assignment operator are prohibited
+  EpochManager(const EpochManager &);
+  EpochManager &operator=(const EpochManager &);
+
+public:
+  EpochManager();
+
+  // Frees every object that is still retired
+  ~EpochManager();
+
+  Participant *register_participant();
+  void unregister_participant(Participant *p); // p must not be pinned
+
+  // Pin and unpin the calling participant. Neither takes a lock.
+  void enter(Participant *p);
+  void exit(Participant *p);
+
+  // Schedule free to be called once no pinned participant can still
+  // reference the object. The object must already be unlinked.
+  void retire(std::function<void()> free);
+
+  // Free whatever retired objects are now safe to free, and return
+  // how many were freed. Freeing happens without holding the lock.
+  size_t reclaim();
+
+  size_t pending(); // Number of retired objects not yet freed
+};
+
+// Keeps a participant pinned for the lifetime of the guard
+class EpochGuard {
+private:
+  EpochManager &m_epochs;
+  EpochManager::Participant *m_participant;
+
+  // copy constructor and assignment operator are prohibited
+  EpochGuard(const EpochGuard &);
+  EpochGuard &operator=(const EpochGuard &);
+
+public:
+  EpochGuard(EpochManager &epochs, EpochManager::Participant *p)
+    : m_epochs(epochs)
+    , m_participant(p)
+  {
+    m_epochs.enter(m_participant);
+  }
+
+  ~EpochGuard()
+  {
+    m_epochs.exit(m_participant);
+  }
+};
+
+#endif // EPOCH_MANAGER_H
@@ -29,6 +29,18 @@ public:
   { }
 };
 
+// Exception indicating that the server's data couldn't be read from
+// or written to disk (e.g., the commit log can't be opened)
+class StorageException : public std::runtime_error {
+public:
+  StorageException( const std::string &msg )
+    : std::runtime_error( msg )
+  { }
+
+  ~StorageException()
+  { }
+};
+
 // Exception indicating a requested protocol operation couldn't be
 // performed (e.g., attempt to create a table, but the table
 // already exists.)
@@ -56,4 +68,17 @@ public:
   { }
 };
 
+// A transaction failed because it conflicted with another (deadlock,
+// lock timeout, or data it read optimistically having changed), so
+// trying it again may succeed.
+class TransactionConflict : public FailedTransaction {
+public:
+  TransactionConflict( const std::string &msg )
+    : FailedTransaction( msg )
+  { }
+
+  ~TransactionConflict()
+  { }
+};
+
 #endif // EXCEPTIONS_H
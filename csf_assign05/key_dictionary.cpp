@@ -0,0 +1,91 @@
+#include <cassert>
+#include <functional>
+#include "key_dictionary.h"
+#include "guard.h"
+
+KeyDictionary::KeyDictionary()
+{
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    pthread_mutex_init(&m_shards[i].mutex, nullptr);
+  }
+}
+
+KeyDictionary::~KeyDictionary()
+{
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    for (auto &pair : m_shards[i].entries) {
+      delete pair.second;
+    }
+    m_shards[i].entries.clear();
+    pthread_mutex_destroy(&m_shards[i].mutex);
+  }
+}
+
+KeyDictionary::Shard &KeyDictionary::shard_for(const std::string &key)
+{
+  return m_shards[std::hash<std::string>()(key) % NUM_SHARDS];
+}
+
+KeyId KeyDictionary::intern(const std::string &key)
+{
+  Shard &shard = shard_for(key);
+  Guard g(shard.mutex);
+
+  auto it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    it->second->refcount++;
+    return &it->second->key;
+  }
+
+  // The map key views the string owned by the entry, so it stays
+  // valid until the entry itself is deleted
+  Entry *entry = new Entry{key, 1};
+  shard.entries.emplace(std::string_view(entry->key), entry);
+  return &entry->key;
+}
+
+KeyId KeyDictionary::find(const std::string &key)
+{
+  Shard &shard = shard_for(key);
+  Guard g(shard.mutex);
+
+  auto it = shard.entries.find(key);
+  if (it == shard.entries.end()) {
+    return nullptr;
+  }
+  return &it->second->key;
+}
+
+void KeyDictionary::retain(KeyId id)
+{
+  Shard &shard = shard_for(*id);
+  Guard g(shard.mutex);
+
+  auto it = shard.entries.find(*id);
+  assert(it != shard.entries.end());
+  it->second->refcount++;
+}
+
+void KeyDictionary::release(KeyId id)
+{
+  Shard &shard = shard_for(*id);
+  Guard g(shard.mutex);
+
+  auto it = shard.entries.find(*id);
+  assert(it != shard.entries.end());
+  Entry *entry = it->second;
+  if (--entry->refcount == 0) {
+    shard.entries.erase(it);
+    delete entry;
+  }
+}
+
+size_t KeyDictionary::size()
+{
+  size_t total = 0;
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    Guard g(m_shards[i].mutex);
+    total += m_shards[i].entries.size();
+  }
+  return total;
+}
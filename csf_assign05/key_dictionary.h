@@ -0,0 +1,63 @@
+#ifndef KEY_DICTIONARY_H
+#define KEY_DICTIONARY_H
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <pthread.h>
+
+// A KeyId is the address of a key string. Two equal keys interned in
+// the same dictionary always have the same KeyId. Tables still hash and
+// compare KeyIds by the text they point to, so a lookup never has to
+// consult the dictionary. The string an interned KeyId points to stays
+// valid as long as a reference to it is held.
+typedef const std::string *KeyId;
+
+// Reference-counted dictionary of interned key strings. It is shared
+// by every table in the server (with -k), so a key that appears in many
+// tables is stored only once. The cost is a hash and a shard mutex each
+// time a table stores a new key or drops one; looking a key up or
+// overwriting its value doesn't touch the dictionary.
+class KeyDictionary {
+private:
+  static const unsigned NUM_SHARDS = 64;
+
+  struct Entry {
+    std::string key;
+    unsigned refcount;
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string_view, Entry*> entries;
+  };
+
+  Shard m_shards[NUM_SHARDS];
+
+  Shard &shard_for(const std::string &key);
+
+  // copy constructor and assignment operator are prohibited
+  KeyDictionary(const KeyDictionary &);
+  KeyDictionary &operator=(const KeyDictionary &);
+
+public:
+  KeyDictionary();
+  ~KeyDictionary();
+
+  // Return the KeyId for key, adding it if necessary.
+  // The caller owns one reference to the returned id.
+  KeyId intern(const std::string &key);
+
+  // Return the KeyId for key, or nullptr if the key isn't interned.
+  // No reference is added, so the result is only useful while the
+  // caller already holds some reference to the key. (Tables don't use
+  // this: they look keys up by text.)
+  KeyId find(const std::string &key);
+
+  void retain(KeyId id);  // Add a reference to an interned key
+  void release(KeyId id); // Drop a reference, freeing the key at zero
+
+  size_t size(); // Number of distinct interned keys
+};
+
+#endif // KEY_DICTIONARY_H
@@ -0,0 +1,512 @@
+#include <ctime>
+#include <cerrno>
+#include <cassert>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include "lock_manager.h"
+#include "table.h"
+#include "exceptions.h"
+#include "guard.h"
+
+size_t LockManager::LockIdHash::operator()(const LockId &id) const
+{
+  return std::hash<const Table*>()(id.table) * 31 + std::hash<std::string>()(id.key);
+}
+
+LockManager::Owner::Owner()
+  : m_waiting_for(nullptr)
+  , m_waiting_mode(SHARED)
+  , m_timestamp(0)
+  , m_in_transaction(false)
+  , m_declared(false)
+  , m_sealed(false)
+  , m_wounded(nullptr)
+{
+  // Wait on the monotonic clock, so timeouts ignore wall clock changes
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+LockManager::Owner::~Owner()
+{
+  assert(m_held.empty());
+  pthread_cond_destroy(&m_wakeup);
+}
+
+LockManager::LockManager(unsigned timeout_ms)
+  : m_timeout_ms(timeout_ms)
+  , m_next_timestamp(1)
+  , m_deadlocks(0)
+  , m_timeouts(0)
+  , m_wounds(0)
+{
+  for (Shard &shard : m_shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+  }
+}
+
+LockManager::~LockManager()
+{
+  for (Shard &shard : m_shards) {
+    assert(shard.locks.empty());
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+void LockManager::lock_all_shards()
+{
+  for (Shard &shard : m_shards) {
+    pthread_mutex_lock(&shard.mutex);
+  }
+}
+
+void LockManager::unlock_all_shards(const Shard *except)
+{
+  for (Shard &shard : m_shards) {
+    if (&shard != except) {
+      pthread_mutex_unlock(&shard.mutex);
+    }
+  }
+}
+
+bool LockManager::compatible(Mode a, Mode b)
+{
+  static const bool matrix[6][6] = {
+    //              IS     IX     S      U      SIX    X
+    /* IS  */     { true,  true,  true,  true,  true,  false },
+    /* IX  */     { true,  true,  false, false, false, false },
+    /* S   */     { true,  false, true,  true,  false, false },
+    /* U   */     { true,  false, true,  false, false, false },
+    /* SIX */     { true,  false, false, false, false, false },
+    /* X   */     { false, false, false, false, false, false },
+  };
+  return matrix[a][b];
+}
+
+// The weakest mode granting everything both a and b grant
+LockManager::Mode LockManager::combine(Mode a, Mode b)
+{
+  if (a == b || b == INTENTION_SHARED) {
+    return a;
+  }
+  if (a == INTENTION_SHARED) {
+    return b;
+  }
+  if (a == EXCLUSIVE || b == EXCLUSIVE) {
+    return EXCLUSIVE;
+  }
+  if (a == UPDATE || b == UPDATE) {
+    return UPDATE; // (Key modes: the other is S)
+  }
+  return SHARED_INTENTION_EXCLUSIVE; // IX with S, or either with SIX
+}
+
+bool LockManager::grantable(const LockEntry &entry, const Owner *owner, Mode mode) const
+{
+  bool upgrade = false;
+  for (const auto &grant : entry.granted) {
+    if (grant.first == owner) {
+      upgrade = true;
+    } else if (!compatible(grant.second, mode)) {
+      return false;
+    }
+  }
+  if (upgrade) {
+    return true; // Older waiters may be waiting for owner itself
+  }
+
+  // Don't overtake older waiters wanting a conflicting mode
+  for (const Owner *waiter : entry.waiters) {
+    if (waiter != owner && waiter->m_timestamp < owner->m_timestamp &&
+        !compatible(waiter->m_waiting_mode, mode)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Search the wait-for graph for a path from owner back to itself.
+// Owner A waits for owner B if B holds a lock A is waiting for, in a
+// mode that conflicts with the mode A wants. If there is a cycle, the
+// other owners on it are stored in cycle.
+bool LockManager::find_cycle(const Owner *owner, std::vector<Owner*> &cycle) const
+{
+  std::vector<const Owner*> pending{owner};
+  std::unordered_map<const Owner*, const Owner*> reached_from; // Owner -> owner waiting for it
+  while (!pending.empty()) {
+    const Owner *waiter = pending.back();
+    pending.pop_back();
+    if (waiter->m_waiting_for == nullptr) {
+      continue;
+    }
+    const LockEntry &entry = entry_for(*waiter->m_waiting_for);
+    for (const auto &grant : entry.granted) {
+      Owner *holder = grant.first;
+      if (holder == waiter || compatible(grant.second, waiter->m_waiting_mode)) {
+        continue;
+      }
+      if (holder == owner) {
+        cycle.clear();
+        for (const Owner *o = waiter; o != owner; o = reached_from.at(o)) {
+          cycle.push_back(const_cast<Owner*>(o));
+        }
+        return true;
+      }
+      if (reached_from.emplace(holder, waiter).second) {
+        pending.push_back(holder);
+      }
+    }
+  }
+  return false;
+}
+
+// Make victim abort: at once if it's waiting, otherwise when it next
+// requests a lock (or seals its locks). Its locks are taken back now,
+// so no one waits for it to notice. (Only the victim changes its own
+// m_held, each change with a shard locked, so it can be read here.)
+void LockManager::wound(Owner *victim, const char *reason)
+{
+  victim->m_wounded.store(reason);
+  pthread_cond_signal(&victim->m_wakeup);
+  for (const auto &held : victim->m_held) {
+    LockTable &locks = shard_for(held.first).locks;
+    auto it = locks.find(held.first);
+    if (it == locks.end()) {
+      continue;
+    }
+    LockEntry &entry = it->second;
+    auto grant = std::find_if(entry.granted.begin(), entry.granted.end(),
+                              [victim](const std::pair<Owner*, Mode> &g) { return g.first == victim; });
+    if (grant == entry.granted.end()) {
+      continue;
+    }
+    entry.granted.erase(grant);
+    if (entry.granted.empty() && entry.waiters.empty()) {
+      locks.erase(it);
+    } else {
+      for (Owner *waiter : entry.waiters) {
+        pthread_cond_signal(&waiter->m_wakeup);
+      }
+    }
+  }
+}
+
+// Wound-wait: wound holders younger than owner that stand in its way.
+// Only transactions are victims: owners that declared their locks are
+// exempt, and so are single requests (outside a transaction), which
+// finish once they have their locks.
+void LockManager::wound_younger(const LockEntry &entry, const Owner *owner, Mode mode)
+{
+  // wound() takes back the victim's grants, so pick victims before
+  // touching the entry
+  std::vector<Owner*> victims;
+  for (const auto &grant : entry.granted) {
+    Owner *holder = grant.first;
+    if (holder == owner || compatible(grant.second, mode) || holder->m_timestamp < owner->m_timestamp) {
+      continue;
+    }
+    if (!holder->m_in_transaction || holder->m_declared || holder->m_sealed ||
+        holder->m_wounded.load() != nullptr) {
+      continue;
+    }
+    victims.push_back(holder);
+  }
+  for (Owner *holder : victims) {
+    m_wounds.fetch_add(1, std::memory_order_relaxed);
+    wound(holder, "Aborted in favor of an older transaction");
+  }
+}
+
+bool LockManager::acquire(Owner *owner, const LockId &id, Mode mode, bool wait)
+{
+  const char *wounded = owner->m_wounded.load();
+  if (wounded) {
+    throw TransactionConflict(wounded);
+  }
+  if (owner->m_timestamp == 0) {
+    // Holds no locks, so no other owner can be looking at it
+    owner->m_timestamp = m_next_timestamp.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  auto held = owner->m_held.find(id);
+  if (held != owner->m_held.end()) {
+    if (combine(held->second, mode) == held->second) {
+      return true; // Already held in a strong enough mode
+    }
+    mode = combine(held->second, mode); // Upgrade
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += m_timeout_ms / 1000;
+  deadline.tv_nsec += long(m_timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  Shard &shard = shard_for(id);
+  Guard g(shard.mutex);
+  wounded = owner->m_wounded.load();
+  if (wounded) {
+    // Wounded since the check above: its locks were taken back, and a
+    // new grant now would be missed
+    throw TransactionConflict(wounded);
+  }
+  auto it = shard.locks.emplace(id, LockEntry()).first; // Nodes are stable
+  LockEntry &entry = it->second;
+
+  if (!grantable(entry, owner, mode)) {
+    if (!wait) {
+      return false; // (The entry has other grants or waiters, so it stays)
+    }
+    entry.waiters.push_back(owner);
+    owner->m_waiting_for = &it->first;
+    owner->m_waiting_mode = mode;
+
+    // Holders standing in owner's way (in its shard, which is locked)
+    auto blockers = [&entry, owner, mode]() {
+      std::vector<const Owner*> holders;
+      for (const auto &grant : entry.granted) {
+        if (grant.first != owner && !compatible(grant.second, mode)) {
+          holders.push_back(grant.first);
+        }
+      }
+      return holders;
+    };
+
+    const char *failure = nullptr;
+    std::vector<Owner*> cycle;
+    std::vector<const Owner*> checked; // Blockers as of the last check
+    bool check = true;
+    for (;;) {
+      if (check) {
+        // Other shards are involved, so all of them are locked, in order
+        pthread_mutex_unlock(&shard.mutex);
+        lock_all_shards();
+        failure = owner->m_wounded.load();
+        if (!failure) {
+          wound_younger(entry, owner, mode);
+          if (find_cycle(owner, cycle) &&
+              std::none_of(cycle.begin(), cycle.end(), [](const Owner *o) { return o->m_wounded.load() != nullptr; })) {
+            // (A cycle with a wounded owner will be broken when it aborts)
+            m_deadlocks.fetch_add(1, std::memory_order_relaxed);
+            auto victim = std::find_if(cycle.begin(), cycle.end(), [](const Owner *o) {
+              return o->m_in_transaction && !o->m_declared;
+            });
+            if (owner->m_in_transaction && !owner->m_declared) {
+              failure = "Deadlock detected waiting for lock";
+            } else if (victim != cycle.end()) {
+              wound(*victim, owner->m_declared ? "Aborted to let a transaction with declared locks proceed"
+                                               : "Aborted to let a single request proceed");
+            } else {
+              // Declared owners acquire in canonical order, and a single
+              // request locks a table before its key, so such owners can't
+              // deadlock among themselves. As a backstop, fail anyway.
+              failure = "Deadlock detected waiting for lock";
+            }
+          }
+        }
+        checked = blockers();
+        unlock_all_shards(&shard);
+        if (failure || grantable(entry, owner, mode)) {
+          break; // (Possibly released while the shards were being locked)
+        }
+      }
+
+      int rc;
+      if (owner->m_declared || !owner->m_in_transaction) {
+        rc = pthread_cond_wait(&owner->m_wakeup, &shard.mutex);
+      } else {
+        rc = pthread_cond_timedwait(&owner->m_wakeup, &shard.mutex, &deadline);
+      }
+      failure = owner->m_wounded.load();
+      if (failure || grantable(entry, owner, mode)) {
+        break;
+      }
+      if (rc == ETIMEDOUT) {
+        m_timeouts.fetch_add(1, std::memory_order_relaxed);
+        failure = "Timed out waiting for lock";
+        break;
+      }
+
+      // Only a new holder in owner's way could need wounding. A deadlock
+      // is found by whichever owner completes it by starting to wait,
+      // so it needn't be searched for again otherwise.
+      std::vector<const Owner*> holders = blockers();
+      check = std::any_of(holders.begin(), holders.end(), [&checked](const Owner *o) {
+        return std::find(checked.begin(), checked.end(), o) == checked.end();
+      });
+    }
+
+    entry.waiters.erase(std::find(entry.waiters.begin(), entry.waiters.end(), owner));
+    owner->m_waiting_for = nullptr;
+    if (failure) {
+      // Younger waiters may have been queued behind this one
+      for (Owner *waiter : entry.waiters) {
+        pthread_cond_signal(&waiter->m_wakeup);
+      }
+      if (entry.granted.empty() && entry.waiters.empty()) {
+        shard.locks.erase(it);
+      }
+      throw TransactionConflict(failure);
+    }
+  }
+
+  auto grant = std::find_if(entry.granted.begin(), entry.granted.end(),
+                            [owner](const std::pair<Owner*, Mode> &g) { return g.first == owner; });
+  if (grant != entry.granted.end()) {
+    grant->second = mode;
+  } else {
+    entry.granted.emplace_back(owner, mode);
+  }
+  owner->m_held[id] = mode;
+  return true;
+}
+
+void LockManager::lock_table(Owner *owner, Table *tbl, Mode mode)
+{
+  acquire(owner, LockId{tbl, ""}, mode);
+}
+
+void LockManager::lock_key(Owner *owner, Table *tbl, const std::string &key, Mode mode)
+{
+  assert(!key.empty() && (mode == SHARED || mode == UPDATE || mode == EXCLUSIVE));
+  acquire(owner, LockId{tbl, ""}, mode == EXCLUSIVE ? INTENTION_EXCLUSIVE : INTENTION_SHARED);
+  acquire(owner, LockId{tbl, key}, mode);
+}
+
+void LockManager::upgrade_key(Owner *owner, Table *tbl, const std::string &key)
+{
+  auto held = owner->m_held.find(LockId{tbl, key});
+  if (held != owner->m_held.end() && (held->second == SHARED || held->second == UPDATE)) {
+    lock_key(owner, tbl, key, EXCLUSIVE);
+  }
+}
+
+void LockManager::seal(Owner *owner)
+{
+  // Wounding owners lock every shard, so locking one is enough to
+  // settle whether owner was wounded first
+  Guard g(m_shards[0].mutex);
+  const char *wounded = owner->m_wounded.load();
+  if (wounded) {
+    throw TransactionConflict(wounded);
+  }
+  owner->m_sealed = true;
+}
+
+bool LockManager::try_lock_key(Owner *owner, Table *tbl, const std::string &key, Mode mode)
+{
+  assert(!key.empty() && (mode == SHARED || mode == UPDATE || mode == EXCLUSIVE));
+  return acquire(owner, LockId{tbl, ""}, mode == EXCLUSIVE ? INTENTION_EXCLUSIVE : INTENTION_SHARED, false) &&
+         acquire(owner, LockId{tbl, key}, mode, false);
+}
+
+void LockManager::lock_declared(Owner *owner, std::vector<Request> requests)
+{
+  // Canonical order: by table name, then key (the table itself first)
+  std::sort(requests.begin(), requests.end(), [](const Request &a, const Request &b) {
+    int cmp = a.table->get_name().compare(b.table->get_name());
+    return cmp != 0 ? cmp < 0 : a.key < b.key;
+  });
+
+  // Until its locks are released, it is never a victim
+  owner->m_declared.store(true);
+  for (const Request &req : requests) {
+    if (req.key.empty()) {
+      lock_table(owner, req.table, req.mode);
+    } else {
+      lock_key(owner, req.table, req.key, req.mode);
+    }
+  }
+}
+
+void LockManager::begin_transaction(Owner *owner)
+{
+  assert(owner->m_held.empty());
+  owner->m_timestamp = m_next_timestamp.fetch_add(1, std::memory_order_relaxed);
+  owner->m_in_transaction = true;
+}
+
+void LockManager::end_transaction(Owner *owner)
+{
+  owner->m_in_transaction = false;
+  release_all(owner);
+}
+
+void LockManager::release_all(Owner *owner)
+{
+  // Each lock is released with just its own shard locked (and removed
+  // from m_held meanwhile, since a wounding owner may read it). If owner
+  // was wounded, some locks may have been taken back already. Other
+  // owners only wound owners holding locks, so once all are released,
+  // owner can't be wounded again.
+  for (auto held = owner->m_held.begin(); held != owner->m_held.end(); ) {
+    Shard &shard = shard_for(held->first);
+    Guard g(shard.mutex);
+    auto it = shard.locks.find(held->first);
+    held = owner->m_held.erase(held);
+    if (it == shard.locks.end()) {
+      continue;
+    }
+    LockEntry &entry = it->second;
+    auto grant = std::find_if(entry.granted.begin(), entry.granted.end(),
+                              [owner](const std::pair<Owner*, Mode> &g) { return g.first == owner; });
+    if (grant == entry.granted.end()) {
+      continue;
+    }
+    entry.granted.erase(grant);
+    if (entry.granted.empty() && entry.waiters.empty()) {
+      shard.locks.erase(it);
+    } else {
+      for (Owner *waiter : entry.waiters) {
+        pthread_cond_signal(&waiter->m_wakeup);
+      }
+    }
+  }
+  owner->m_wounded.store(nullptr);
+  owner->m_sealed = false;
+  if (!owner->m_in_transaction) {
+    owner->m_timestamp = 0;
+    owner->m_declared = false;
+  }
+}
+
+bool LockManager::is_locked(const Table *tbl)
+{
+  LockId id{tbl, ""};
+  Shard &shard = shard_for(id);
+  Guard g(shard.mutex);
+  auto it = shard.locks.find(id);
+  return it != shard.locks.end() && !it->second.granted.empty();
+}
+
+bool LockManager::is_locked(const Table *tbl, const std::string &key)
+{
+  {
+    LockId id{tbl, key};
+    Shard &shard = shard_for(id);
+    Guard g(shard.mutex);
+    auto it = shard.locks.find(id);
+    if (it != shard.locks.end() && !it->second.granted.empty()) {
+      return true;
+    }
+  }
+  LockId id{tbl, ""};
+  Shard &shard = shard_for(id);
+  Guard g(shard.mutex);
+  auto it = shard.locks.find(id);
+  if (it != shard.locks.end()) {
+    for (const auto &grant : it->second.granted) {
+      if (grant.second == SHARED || grant.second == SHARED_INTENTION_EXCLUSIVE || grant.second == EXCLUSIVE) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,223 @@
+#ifndef LOCK_MANAGER_H
+#define LOCK_MANAGER_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <pthread.h>
+
+class Table; // forward declaration
+
+// Grants transactions locks on tables and on individual keys, held
+// until the transaction ends. (A table's own mutex is only a short-term
+// latch protecting its data during one operation.)
+//
+// Keys are locked SHARED to read and EXCLUSIVE to write. A key read by
+// a transaction that may write it later is locked UPDATE, which shares
+// the key with readers but not with another UPDATE, so two transactions
+// reading a key to update it conflict at the read, rather than both
+// upgrading later (each waiting for the other, so one must abort). An
+// owner writing a key it holds SHARED or UPDATE upgrades its lock: it
+// waits only for the key's other holders, ahead of any waiters. Locking a key
+// first takes the matching intention lock on its table, so a whole
+// table lock (SHARED for a scan, EXCLUSIVE to drop it) conflicts with
+// transactions using any of its keys, while transactions using
+// different keys of one table don't conflict at all. A transaction
+// that scans a table and then writes some of its keys holds it
+// SHARED_INTENTION_EXCLUSIVE, which still lets others read its keys.
+//
+// A request for a lock held in a conflicting mode by another owner
+// waits: a transaction for at most the configured timeout, and a
+// single request (an owner outside any transaction) as long as
+// necessary, since it is never chosen as a victim. Conflicts are
+// settled by age (wound-wait): each owner has a timestamp, which a
+// transaction keeps from BEGIN until it ends (even when the server
+// retries it), so it eventually becomes the oldest. An older requester
+// wounds younger holders in its way, taking back every lock they hold, so it never
+// waits for them: a waiting owner aborts at once, and a running (or
+// idle) transaction at its next lock request, or when it commits. A
+// transaction that has sealed its locks to commit can't be wounded,
+// and it finishes promptly. A younger requester just waits, and never
+// overtakes an older waiter wanting a conflicting mode.
+//
+// Lock entries are hashed into shards, each with its own mutex, so
+// requests for unrelated locks (and every request that is granted at
+// once) don't contend. A request that must wait locks every shard (in
+// order) to wound holders and search for deadlocks across them: when it
+// starts waiting, and then only when a new holder stands in its way.
+// Under contention that is a global step for each new conflict, but
+// other wakeups, releases and grants take just one shard.
+//
+// As a backstop, when it starts waiting the requester searches the
+// wait-for graph (owners waiting for locks held by other owners); if it
+// can reach itself, waiting would deadlock, so the requester is chosen
+// as the victim and aborted. Only an owner starting to wait can
+// complete a cycle, so each one is found by the owner that completes it.
+//
+// Alternatively, an owner can declare every lock it needs at once.
+// Declared locks are acquired in a canonical order (by table name,
+// then key, tables before their keys), so owners declaring their locks
+// can't deadlock with each other. They wait as long as necessary, and
+// are never chosen as victims: if one would complete a deadlock, it
+// wounds a transaction in the cycle, which then aborts instead. So
+// does a single request.
+class LockManager {
+public:
+  enum Mode {
+    INTENTION_SHARED,           // Table only: some keys will be locked SHARED (or UPDATE)
+    INTENTION_EXCLUSIVE,        // Table only: some keys will be locked EXCLUSIVE
+    SHARED,
+    UPDATE,                     // Key only: read, and may be upgraded to EXCLUSIVE
+    SHARED_INTENTION_EXCLUSIVE, // Table only: all of it read, some keys locked EXCLUSIVE
+    EXCLUSIVE,
+  };
+
+  // A lockable resource: a table, or (if key is non-empty) one of its keys
+  struct LockId {
+    const Table *table;
+    std::string key;
+
+    bool operator==(const LockId &other) const { return table == other.table && key == other.key; }
+  };
+
+  struct LockIdHash {
+    size_t operator()(const LockId &id) const;
+  };
+
+  // One of the locks declared by an owner (an empty key locks the table)
+  struct Request {
+    Table *table;
+    std::string key;
+    Mode mode;
+  };
+
+  // A lock owner: a transaction, or a single autocommit request.
+  // Each owner is used by one thread at a time.
+  class Owner {
+  private:
+    friend class LockManager;
+    std::unordered_map<LockId, Mode, LockIdHash> m_held;
+    const LockId *m_waiting_for; // Lock being waited for, if any
+    Mode m_waiting_mode;
+    uint64_t m_timestamp;        // Age (lower is older), or 0 if not assigned yet
+    std::atomic<bool> m_in_transaction; // Keeps its timestamp when releasing locks
+    std::atomic<bool> m_declared;       // Declared its locks; never a victim
+    std::atomic<bool> m_sealed;         // Committing; never a victim
+    std::atomic<const char *> m_wounded; // Why it must abort, if chosen as a victim
+    pthread_cond_t m_wakeup;     // Signaled when the awaited lock may be free
+
+    // copy constructor and assignment operator are prohibited
+    Owner(const Owner &);
+    Owner &operator=(const Owner &);
+
+  public:
+    Owner();
+    ~Owner();
+
+    bool holds_any() const { return !m_held.empty(); }
+  };
+
+private:
+  struct LockEntry {
+    std::vector<std::pair<Owner*, Mode>> granted;
+    std::vector<Owner*> waiters;
+  };
+  typedef std::unordered_map<LockId, LockEntry, LockIdHash> LockTable;
+
+  // An owner waits on the mutex of the shard holding the lock it wants.
+  // Its wait fields (and its grants in the shard) are changed only with
+  // that mutex held.
+  struct Shard {
+    pthread_mutex_t mutex;
+    LockTable locks;
+  };
+
+  static const unsigned NUM_SHARDS = 64;
+
+  unsigned m_timeout_ms;
+  Shard m_shards[NUM_SHARDS];
+
+  std::atomic<uint64_t> m_next_timestamp;
+  std::atomic<unsigned long> m_deadlocks;
+  std::atomic<unsigned long> m_timeouts;
+  std::atomic<unsigned long> m_wounds;
+
+  Shard &shard_for(const LockId &id) { return m_shards[LockIdHash()(id) % NUM_SHARDS]; }
+  const LockEntry &entry_for(const LockId &id) const {
+    return m_shards[LockIdHash()(id) % NUM_SHARDS].locks.at(id);
+  }
+  void lock_all_shards();
+  void unlock_all_shards(const Shard *except = nullptr);
+
+  static bool compatible(Mode a, Mode b);
+  static Mode combine(Mode a, Mode b);
+  bool grantable(const LockEntry &entry, const Owner *owner, Mode mode) const;
+
+  // These look at (and signal) owners waiting in any shard, so they
+  // are called with every shard locked
+  bool find_cycle(const Owner *owner, std::vector<Owner*> &cycle) const;
+  void wound(Owner *victim, const char *reason);
+  void wound_younger(const LockEntry &entry, const Owner *owner, Mode mode);
+
+  // Returns false (only if wait is false) if the lock isn't free
+  bool acquire(Owner *owner, const LockId &id, Mode mode, bool wait = true);
+
+  // copy constructor and assignment operator are prohibited
+  LockManager(const LockManager &);
+  LockManager &operator=(const LockManager &);
+
+public:
+  LockManager(unsigned timeout_ms);
+  ~LockManager();
+
+  // Give owner a timestamp that it keeps, across any number of
+  // release_all calls, until end_transaction (which also releases its
+  // locks). Other owners get a new timestamp whenever they start
+  // acquiring locks.
+  void begin_transaction(Owner *owner);
+  void end_transaction(Owner *owner);
+
+  // Lock a whole table, or one key of it, for owner (doing nothing if
+  // owner already holds a lock at least as strong). Locking a key also
+  // takes the table's intention lock. Throws TransactionConflict if the
+  // lock can't be granted because waiting would deadlock, or because
+  // the timeout expired (only in a transaction), or if owner has been
+  // wounded.
+  void lock_table(Owner *owner, Table *tbl, Mode mode);
+  void lock_key(Owner *owner, Table *tbl, const std::string &key, Mode mode);
+
+  // If owner holds key SHARED or UPDATE, upgrade its lock to EXCLUSIVE
+  // (throwing as lock_key does); otherwise do nothing
+  void upgrade_key(Owner *owner, Table *tbl, const std::string &key);
+
+  // Called once owner holds every lock it needs to commit: until they
+  // are released, it can't be wounded. Throws TransactionConflict if it
+  // was wounded already (and so may have lost locks it was using).
+  void seal(Owner *owner);
+
+  // Like lock_key, but never waits (or wounds anyone): returns false
+  // if the lock can't be granted at once
+  bool try_lock_key(Owner *owner, Table *tbl, const std::string &key, Mode mode);
+
+  // Acquire every lock in requests (key locks with their intention
+  // locks), in canonical order, waiting as long as necessary. Only
+  // throws if owner was wounded by another owner declaring locks.
+  void lock_declared(Owner *owner, std::vector<Request> requests);
+
+  // Release every lock owner holds
+  void release_all(Owner *owner);
+
+  // Whether any owner holds a lock on tbl (of any mode)
+  bool is_locked(const Table *tbl);
+
+  // Whether any owner has locked key, or all of tbl, to read or write it
+  bool is_locked(const Table *tbl, const std::string &key);
+
+  unsigned long get_deadlocks() const { return m_deadlocks.load(std::memory_order_relaxed); }
+  unsigned long get_timeouts() const { return m_timeouts.load(std::memory_order_relaxed); }
+  unsigned long get_wounds() const { return m_wounds.load(std::memory_order_relaxed); }
+};
+
+#endif // LOCK_MANAGER_H
@@ -0,0 +1,142 @@
+// Commit throughput benchmark for the commit log: with each sync
+// policy, and increasing numbers of threads, each thread repeatedly
+// logs a small commit and waits until it is durable (as the policy
+// defines it), the way a client connection commits. With "always",
+// group commit should let throughput grow with the number of threads,
+// as each sync covers more commits.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "commit_log.h"
+#include "exceptions.h"
+
+namespace {
+
+struct BenchState {
+  CommitLog *log;
+  unsigned id;
+  const std::atomic<bool> *stop;
+  long commits;
+};
+
+void *commit_worker(void *arg)
+{
+  BenchState *state = static_cast<BenchState *>(arg);
+  LogRecord record{LogRecord::COMMIT, "", {}};
+  record.changes.emplace_back("accounts", WriteSet::Changes());
+  WriteSet::Change &change = record.changes[0].second["acct" + std::to_string(state->id)];
+
+  long commits = 0;
+  while (!state->stop->load(std::memory_order_relaxed)) {
+    change.value = std::to_string(commits);
+    if (!state->log->wait_durable(state->log->append(record))) {
+      break;
+    }
+    commits++;
+  }
+  state->commits = commits;
+  return nullptr;
+}
+
+// Run nthreads committing threads for the given time against a new
+// log in dir; return commits per second, and the number of syncs
+double run(const std::string &dir, CommitLog::SyncPolicy policy, unsigned interval_ms,
+           unsigned nthreads, double seconds, unsigned long &syncs)
+{
+  std::string path = dir + "/log_bench.XXXXXX";
+  int fd = mkstemp(&path[0]); // Reserves the name; the log's segments add a suffix
+  if (fd < 0) {
+    throw StorageException("Could not create a log file in " + dir);
+  }
+  close(fd);
+
+  std::atomic<bool> stop(false);
+  std::vector<pthread_t> threads(nthreads);
+  std::vector<BenchState> states(nthreads);
+  double elapsed;
+  {
+    CommitLog log(path, policy, interval_ms);
+    log.open([](LogRecord &) { });
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < nthreads; i++) {
+      states[i] = BenchState{ &log, i, &stop, 0 };
+      pthread_create(&threads[i], nullptr, commit_worker, &states[i]);
+    }
+    usleep(useconds_t(seconds * 1000000));
+    stop.store(true);
+    for (unsigned i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], nullptr);
+    }
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    syncs = log.get_syncs();
+  }
+  unlink((path + ".000001").c_str());
+  unlink(path.c_str());
+
+  long commits = 0;
+  for (const BenchState &state : states) {
+    commits += state.commits;
+  }
+  return commits / elapsed;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 3) {
+    std::cerr << "Usage: ./log_bench [<directory>] [<seconds per run>]\n";
+    return 1;
+  }
+
+  std::string dir = (argc >= 2) ? argv[1] : ".";
+  double seconds = (argc >= 3) ? std::atof(argv[2]) : 1.0;
+
+  struct Policy {
+    const char *name;
+    CommitLog::SyncPolicy policy;
+    unsigned interval_ms;
+  };
+  const Policy policies[] = {
+    { "always", CommitLog::SYNC_ALWAYS, 0 },
+    { "100ms", CommitLog::SYNC_INTERVAL, 100 },
+    { "never", CommitLog::SYNC_NEVER, 0 },
+  };
+
+  std::cout << "log in " << dir << ", " << seconds << "s per run\n";
+  std::cout << std::setw(8) << "sync"
+            << std::setw(9) << "threads"
+            << std::setw(14) << "commits/s"
+            << std::setw(10) << "syncs"
+            << std::setw(14) << "commits/sync" << "\n";
+
+  try {
+    for (const Policy &p : policies) {
+      for (unsigned nthreads = 1; nthreads <= 64; nthreads *= 4) {
+        unsigned long syncs;
+        double rate = run(dir, p.policy, p.interval_ms, nthreads, seconds, syncs);
+        std::cout << std::setw(8) << p.name
+                  << std::setw(9) << nthreads
+                  << std::setw(14) << std::fixed << std::setprecision(0) << rate
+                  << std::setw(10) << syncs;
+        if (syncs > 0) {
+          std::cout << std::setw(14) << std::setprecision(1) << rate * seconds / syncs;
+        }
+        std::cout << "\n";
+      }
+    }
+  } catch (StorageException &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include "log_replay.h"
+#include "exceptions.h"
+#include "guard.h"
+
+LogReplay::LogReplay(unsigned nthreads)
+  : m_changes(0)
+{
+  for (unsigned i = 0; i < std::max(nthreads, 1u); i++) {
+    Worker *w = new Worker();
+    w->replay = this;
+    w->finishing = false;
+    pthread_mutex_init(&w->mutex, nullptr);
+    pthread_cond_init(&w->ready, nullptr);
+    pthread_cond_init(&w->space, nullptr);
+    if (pthread_create(&w->thread, nullptr, worker_main, w) != 0) {
+      pthread_cond_destroy(&w->space);
+      pthread_cond_destroy(&w->ready);
+      pthread_mutex_destroy(&w->mutex);
+      delete w;
+      finish(nullptr);
+      throw StorageException("Could not create log replay threads");
+    }
+    m_workers.push_back(w);
+  }
+}
+
+LogReplay::~LogReplay()
+{
+  finish(nullptr);
+}
+
+void *LogReplay::worker_main(void *arg)
+{
+  Worker *w = static_cast<Worker *>(arg);
+  w->replay->run(w);
+  return nullptr;
+}
+
+void LogReplay::run(Worker *w)
+{
+  while (true) {
+    Batch batch;
+    {
+      Guard g(w->mutex);
+      while (w->queue.empty() && !w->finishing) {
+        pthread_cond_wait(&w->ready, &w->mutex);
+      }
+      if (w->queue.empty()) {
+        break;
+      }
+      batch = std::move(w->queue.front());
+      w->queue.pop_front();
+      pthread_cond_signal(&w->space);
+    }
+
+    for (Item &item : batch) {
+      if (item.reset) {
+        w->latest.erase(item.table);
+      } else {
+        w->latest[item.table][item.key] = std::move(item.change);
+      }
+    }
+  }
+  apply(w);
+}
+
+void LogReplay::apply(Worker *w)
+{
+  if (m_find_table) {
+    uint64_t now = Table::wall_time_ms();
+    for (const auto &table : w->latest) {
+      Table *tbl = m_find_table(table.first);
+      if (!tbl) {
+        continue;
+      }
+      tbl->lock(); // Other workers have keys in the table too
+      for (const auto &change : table.second) {
+        // A key that has expired since is deleted instead
+        bool expired = change.second.expires_at != 0 && change.second.expires_at <= now;
+        tbl->set(change.first, expired ? "" : change.second.value, change.second.expires_at);
+      }
+      tbl->unlock();
+    }
+  }
+  w->latest.clear();
+}
+
+void LogReplay::queue(Worker *w, Item &&item)
+{
+  w->pending.push_back(std::move(item));
+  if (w->pending.size() < BATCH_SIZE) {
+    return;
+  }
+  Guard g(w->mutex);
+  while (w->queue.size() >= MAX_QUEUED_BATCHES) {
+    pthread_cond_wait(&w->space, &w->mutex);
+  }
+  w->queue.push_back(std::move(w->pending));
+  w->pending.clear();
+  pthread_cond_signal(&w->ready);
+}
+
+void LogReplay::add_commit(LogRecord &record)
+{
+  std::hash<std::string> hash;
+  for (auto &table : record.changes) {
+    size_t table_hash = hash(table.first);
+    for (auto &change : table.second) {
+      Worker *w = m_workers[(table_hash * 31 + hash(change.first)) % m_workers.size()];
+      queue(w, Item{false, table.first, change.first, std::move(change.second)});
+      m_changes++;
+    }
+  }
+}
+
+void LogReplay::reset_table(const std::string &name)
+{
+  for (Worker *w : m_workers) {
+    queue(w, Item{true, name, "", WriteSet::Change()});
+  }
+}
+
+void LogReplay::finish(const FindTableFunc &find_table)
+{
+  m_find_table = find_table;
+  for (Worker *w : m_workers) {
+    Guard g(w->mutex);
+    if (!w->pending.empty()) {
+      w->queue.push_back(std::move(w->pending));
+      w->pending.clear();
+    }
+    w->finishing = true;
+    pthread_cond_signal(&w->ready);
+  }
+  for (Worker *w : m_workers) {
+    pthread_join(w->thread, nullptr);
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->ready);
+    pthread_mutex_destroy(&w->mutex);
+    delete w;
+  }
+  m_workers.clear();
+}
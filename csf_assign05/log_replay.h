@@ -0,0 +1,93 @@
+#ifndef LOG_REPLAY_H
+#define LOG_REPLAY_H
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <pthread.h>
+#include "commit_log.h"
+#include "table.h"
+
+// Replays commit log records into tables on several threads, as the
+// server starts. Each key belongs to one worker's shard (chosen by
+// hashing the table name and key), and the worker keeps only the
+// latest change to each of its keys; those are applied to the tables
+// once the whole log has been read. Creating, dropping or truncating a
+// table discards every change its workers hold for it, in log order,
+// so changes reach only the table's last incarnation.
+//
+// Nothing is served until replay finishes, and a record (a whole
+// transaction) is read completely or not at all, so each transaction
+// is applied entirely or not at all.
+class LogReplay {
+public:
+  typedef std::function<Table *(const std::string &)> FindTableFunc;
+
+private:
+  struct Item {
+    bool reset;         // Discard the changes held for table
+    std::string table;
+    std::string key;
+    WriteSet::Change change;
+  };
+  typedef std::vector<Item> Batch;
+
+  typedef std::unordered_map<std::string, WriteSet::Change> KeyChanges;
+
+  struct Worker {
+    LogReplay *replay;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready; // Signaled when a batch is queued (or finishing)
+    pthread_cond_t space; // Signaled when a batch is taken
+    std::deque<Batch> queue;
+    bool finishing;
+    Batch pending;        // Not yet queued (used by the reading thread)
+    std::unordered_map<std::string, KeyChanges> latest; // By table, then key
+  };
+
+  std::vector<Worker *> m_workers;
+  FindTableFunc m_find_table; // Set when finishing
+  unsigned long m_changes;
+
+  static void *worker_main(void *arg);
+  void run(Worker *w);
+  void apply(Worker *w);
+  void queue(Worker *w, Item &&item);
+
+  // copy constructor and assignment operator are prohibited
+  LogReplay(const LogReplay &);
+  LogReplay &operator=(const LogReplay &);
+
+public:
+  // Items a worker is handed at a time, and most batches queued for
+  // a worker before the reading thread waits
+  static const size_t BATCH_SIZE = 1024;
+  static const size_t MAX_QUEUED_BATCHES = 64;
+
+  // Start nthreads workers (at least one). Throws StorageException if
+  // they can't be created.
+  LogReplay(unsigned nthreads);
+
+  // Stops the workers, if finish wasn't called
+  ~LogReplay();
+
+  // Hand a COMMIT record's changes to the workers (moving from it)
+  void add_commit(LogRecord &record);
+
+  // A table was created, dropped or truncated
+  void reset_table(const std::string &name);
+
+  // Wait for the workers to take in every change, then apply each key's
+  // latest change to the table find_table returns for its name (if
+  // any), in parallel. Changes to keys that have expired since become
+  // deletes.
+  void finish(const FindTableFunc &find_table);
+
+  unsigned get_threads() const { return m_workers.size(); }
+  unsigned long get_changes() const { return m_changes; } // Changes handed to workers
+};
+
+#endif // LOG_REPLAY_H
@@ -4,6 +4,11 @@
 #include <cassert>
 #include "message.h"
 
+const char *const Message::SCAN_START = "0";
+const char *const Message::BEGIN_OPTIMISTIC = "OPTIMISTIC";
+const char *const Message::BEGIN_RETRY = "RETRY";
+const char *const Message::BEGIN_READONLY = "READONLY";
+const char *const Message::ROLLBACK_TO = "TO";
 
 Message::Message()
   : m_message_type(MessageType::NONE)
@@ -57,7 +62,12 @@ std::string Message::get_table() const
 {
   if ((m_message_type == MessageType::CREATE || 
        m_message_type == MessageType::GET || 
-       m_message_type == MessageType::SET) && m_args.size() > 0) {
+       m_message_type == MessageType::SET ||
+       m_message_type == MessageType::SCAN ||
+       m_message_type == MessageType::DROP ||
+       m_message_type == MessageType::TRUNCATE ||
+       m_message_type == MessageType::DUMP ||
+       m_message_type == MessageType::RESTORE) && m_args.size() > 0) {
     return m_args[0];
   }
   return "";
@@ -90,6 +100,57 @@ std::string Message::get_quoted_text() const
   return "";
 }
 
+std::string Message::get_cursor() const
+{
+  if (m_message_type == MessageType::SCAN && m_args.size() > 1) {
+    return m_args[1];
+  }
+  if (m_message_type == MessageType::ROWS && m_args.size() > 0) {
+    return m_args[0];
+  }
+  return "";
+}
+
+std::string Message::get_prefix() const
+{
+  if (m_message_type == MessageType::SCAN && m_args.size() > 2) {
+    return m_args[2];
+  }
+  return "";
+}
+
+unsigned Message::get_ttl() const
+{
+  if (m_message_type == MessageType::SET && m_args.size() > 2) {
+    return std::stoul(m_args[2]);
+  }
+  return 0;
+}
+
+std::string Message::get_savepoint() const
+{
+  if (m_message_type == MessageType::SAVEPOINT && m_args.size() > 0) {
+    return m_args[0];
+  }
+  if (m_message_type == MessageType::ROLLBACK && m_args.size() > 1) {
+    return m_args[1];
+  }
+  return "";
+}
+
+bool Message::has_begin_options() const
+{
+  if (m_message_type != MessageType::BEGIN || m_args.empty()) {
+    return false;
+  }
+  for (const std::string &arg : m_args) {
+    if (arg != BEGIN_OPTIMISTIC && arg != BEGIN_RETRY && arg != BEGIN_READONLY) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void Message::push_arg( const std::string &arg )
 {
   m_args.push_back( arg );
@@ -104,19 +165,30 @@ bool Message::is_valid() const
       {MessageType::PUSH, {1, 1}},
       {MessageType::POP, {0, 0}},
       {MessageType::TOP, {0, 0}},
-      {MessageType::SET, {2, 3}},  // SET requires table, key, and (optional) value
+      {MessageType::SET, {2, 3}},  // SET requires table, key, and (optional) TTL in seconds
       {MessageType::GET, {2, 2}},
       {MessageType::ADD, {0, 0}},
       {MessageType::SUB, {0, 0}},
       {MessageType::MUL, {0, 0}},
       {MessageType::DIV, {0, 0}},
-      {MessageType::BEGIN, {0, 0}},
+      {MessageType::BEGIN, {0, int(MAX_ENCODED_LEN)}}, // BEGIN takes options, or locks to declare
       {MessageType::COMMIT, {0, 0}},
       {MessageType::BYE, {0, 0}},
+      {MessageType::SCAN, {2, 3}}, // SCAN requires table, cursor, and (optional) key prefix
+      {MessageType::STATS, {0, 0}},
+      {MessageType::DROP, {1, 1}},
+      {MessageType::TRUNCATE, {1, 1}},
+      {MessageType::SAVEPOINT, {1, 1}},
+      {MessageType::ROLLBACK, {2, 2}}, // ROLLBACK TO savepoint
+      {MessageType::SNAPSHOT, {0, 0}},
+      {MessageType::DUMP, {1, 1}},
+      {MessageType::RESTORE, {1, 1}}, // Followed by the dumped records
+      {MessageType::REPLICATE, {0, 0}},
       {MessageType::OK, {0, 0}},
       {MessageType::FAILED, {1, 1}},
       {MessageType::ERROR, {1, 1}},
       {MessageType::DATA, {1, 1}},
+      {MessageType::ROWS, {1, int(MAX_ENCODED_LEN)}}, // cursor followed by key/value pairs
   };
 
   // Check for NONE type (invalid message)
@@ -143,8 +215,12 @@ bool Message::is_valid() const
   switch (m_message_type) {
     case MessageType::LOGIN:
     case MessageType::CREATE:
-    case MessageType::SET:
     case MessageType::GET:
+    case MessageType::DROP:
+    case MessageType::TRUNCATE:
+    case MessageType::DUMP:
+    case MessageType::RESTORE:
+    case MessageType::SAVEPOINT:
       // Ensure table and key are valid identifiers (if present)
       for (const std::string &arg : m_args) {
         if (!std::regex_match(arg, std::regex("^[a-zA-Z][a-zA-Z0-9_]*$"))) {
@@ -153,6 +229,65 @@ bool Message::is_valid() const
       }
       break;
 
+    case MessageType::SET:
+      // Table and key are identifiers, the TTL is a positive number of seconds
+      for (unsigned i = 0; i < m_args.size(); i++) {
+        const char *pattern = (i == 2) ? "^[1-9][0-9]{0,8}$" : "^[a-zA-Z][a-zA-Z0-9_]*$";
+        if (!std::regex_match(m_args[i], std::regex(pattern))) {
+          return false;
+        }
+      }
+      break;
+
+    case MessageType::SCAN:
+      // Table and prefix are identifiers, the cursor is either the
+      // start cursor or a key returned by an earlier ROWS response
+      for (unsigned i = 0; i < m_args.size(); i++) {
+        if (i == 1 && m_args[i] == SCAN_START) {
+          continue;
+        }
+        if (!std::regex_match(m_args[i], std::regex("^[a-zA-Z][a-zA-Z0-9_]*$"))) {
+          return false;
+        }
+      }
+      break;
+
+    case MessageType::BEGIN:
+      // Either options (each at most once, and not both OPTIMISTIC and
+      // READONLY), or locks to declare: tables, and keys written as table.key
+      if (has_begin_options()) {
+        std::set<std::string> options(m_args.begin(), m_args.end());
+        if (options.size() != m_args.size() ||
+            (options.count(BEGIN_OPTIMISTIC) && options.count(BEGIN_READONLY))) {
+          return false;
+        }
+        break;
+      }
+      for (const std::string &arg : m_args) {
+        if (!std::regex_match(arg, std::regex("^[a-zA-Z][a-zA-Z0-9_]*([.][a-zA-Z][a-zA-Z0-9_]*)?$"))) {
+          return false;
+        }
+      }
+      break;
+
+    case MessageType::ROLLBACK:
+      if (m_args[0] != ROLLBACK_TO || !std::regex_match(m_args[1], std::regex("^[a-zA-Z][a-zA-Z0-9_]*$"))) {
+        return false;
+      }
+      break;
+
+    case MessageType::ROWS:
+      // Cursor plus complete key/value pairs, none containing a newline
+      if (num_args % 2 != 1) {
+        return false;
+      }
+      for (const std::string &arg : m_args) {
+        if (arg.find('\n') != std::string::npos) {
+          return false;
+        }
+      }
+      break;
+
     case MessageType::FAILED:
     case MessageType::ERROR:
     case MessageType::DATA:
@@ -24,12 +24,23 @@ enum class MessageType {
   BEGIN,
   COMMIT,
   BYE,
+  SCAN,
+  STATS,
+  DROP,
+  TRUNCATE,
+  SAVEPOINT,
+  ROLLBACK,
+  SNAPSHOT,
+  DUMP,
+  RESTORE,
+  REPLICATE,
 
   // Responses
   OK,
   FAILED,
   ERROR,
   DATA,
+  ROWS,
 };
 
 class Message {
@@ -41,6 +52,21 @@ public:
   // Maximum encoded message length (including terminator newline character)
   static const unsigned MAX_ENCODED_LEN = 1024;
 
+  // SCAN cursor that starts a scan, and ROWS cursor that ends one
+  static const char *const SCAN_START;
+
+  // BEGIN options selecting an optimistic transaction, one the server
+  // retries after a conflict, and one reading a snapshot
+  static const char *const BEGIN_OPTIMISTIC;
+  static const char *const BEGIN_RETRY;
+  static const char *const BEGIN_READONLY;
+
+  // Separates table and key in a lock declared by BEGIN ("table.key")
+  static const char BEGIN_KEY_SEPARATOR = '.';
+
+  // Keyword preceding the savepoint name in ROLLBACK TO
+  static const char *const ROLLBACK_TO;
+
   Message();
   Message( MessageType message_type, std::initializer_list<std::string> args = std::initializer_list<std::string>() );
   Message( const Message &other );
@@ -56,11 +82,18 @@ public:
   std::string get_key() const;
   std::string get_value() const;
   std::string get_quoted_text() const;
+  std::string get_cursor() const;
+  std::string get_prefix() const;
+  unsigned get_ttl() const; // SET's TTL in seconds, or 0 if none
+  std::string get_savepoint() const;
 
   void push_arg( const std::string &arg );
 
   bool is_valid() const;
 
+  // Whether every argument of a BEGIN is an option (rather than a lock to declare)
+  bool has_begin_options() const;
+
   unsigned get_num_args() const { return m_args.size(); }
   std::string get_arg( unsigned i ) const { return m_args.at( i ); }
 };
@@ -23,10 +23,21 @@ void MessageSerialization::encode(const Message &msg, std::string &encoded_msg)
         {MessageType::BEGIN, "BEGIN"},
         {MessageType::COMMIT, "COMMIT"},
         {MessageType::BYE, "BYE"},
+        {MessageType::SCAN, "SCAN"},
+        {MessageType::STATS, "STATS"},
+        {MessageType::DROP, "DROP"},
+        {MessageType::TRUNCATE, "TRUNCATE"},
+        {MessageType::SAVEPOINT, "SAVEPOINT"},
+        {MessageType::ROLLBACK, "ROLLBACK"},
+        {MessageType::SNAPSHOT, "SNAPSHOT"},
+        {MessageType::DUMP, "DUMP"},
+        {MessageType::RESTORE, "RESTORE"},
+        {MessageType::REPLICATE, "REPLICATE"},
         {MessageType::OK, "OK"},
         {MessageType::FAILED, "FAILED"},
         {MessageType::ERROR, "ERROR"},
-        {MessageType::DATA, "DATA"}
+        {MessageType::DATA, "DATA"},
+        {MessageType::ROWS, "ROWS"}
     };
 
     auto it = type_to_str.find(msg.get_message_type());
@@ -96,10 +107,21 @@ void MessageSerialization::decode(const std::string &encoded_msg_, Message &msg)
         {"BEGIN", MessageType::BEGIN},
         {"COMMIT", MessageType::COMMIT},
         {"BYE", MessageType::BYE},
+        {"SCAN", MessageType::SCAN},
+        {"STATS", MessageType::STATS},
+        {"DROP", MessageType::DROP},
+        {"TRUNCATE", MessageType::TRUNCATE},
+        {"SAVEPOINT", MessageType::SAVEPOINT},
+        {"ROLLBACK", MessageType::ROLLBACK},
+        {"SNAPSHOT", MessageType::SNAPSHOT},
+        {"DUMP", MessageType::DUMP},
+        {"RESTORE", MessageType::RESTORE},
+        {"REPLICATE", MessageType::REPLICATE},
         {"OK", MessageType::OK},
         {"FAILED", MessageType::FAILED},
         {"ERROR", MessageType::ERROR},
-        {"DATA", MessageType::DATA}
+        {"DATA", MessageType::DATA},
+        {"ROWS", MessageType::ROWS}
     };
 
     auto it = str_to_type.find(token);
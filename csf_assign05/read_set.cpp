@@ -0,0 +1,15 @@
+#include "read_set.h"
+
+ReadSet::ReadSet()
+  : m_versions()
+{
+}
+
+ReadSet::~ReadSet()
+{
+}
+
+void ReadSet::record(Table *tbl, const std::string &key, uint64_t version)
+{
+  m_versions[tbl].emplace(key, version);
+}
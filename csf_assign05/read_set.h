@@ -0,0 +1,38 @@
+#ifndef READ_SET_H
+#define READ_SET_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+
+class Table; // forward declaration
+
+// Versions of the keys read by one optimistic transaction. At commit,
+// every key must still have the version it had when first read, or
+// else another client changed it and the transaction must fail.
+// A version of 0 records that the key didn't exist.
+class ReadSet {
+public:
+  typedef std::map<std::string, uint64_t> Versions; // key -> version read
+  typedef std::map<Table*, Versions> TableVersions;
+
+private:
+  TableVersions m_versions;
+
+public:
+  ReadSet();
+  ~ReadSet();
+
+  // Record that key was read at the given version. Only the first
+  // read of each key is recorded.
+  void record(Table *tbl, const std::string &key, uint64_t version);
+
+  bool is_empty() const { return m_versions.empty(); }
+  void clear() { m_versions.clear(); }
+
+  // Per-table versions, ordered by Table pointer
+  TableVersions::const_iterator begin() const { return m_versions.begin(); }
+  TableVersions::const_iterator end() const { return m_versions.end(); }
+};
+
+#endif // READ_SET_H
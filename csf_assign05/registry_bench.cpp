@@ -0,0 +1,117 @@
+// Contention benchmark for table lookups: compares the server's
+// copy-on-write table registry against a map guarded by a single
+// mutex (how the registry used to work), with increasing numbers
+// of threads looking up tables concurrently.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "server.h"
+#include "guard.h"
+
+namespace {
+
+struct BenchState {
+  Server *server;
+  pthread_mutex_t *mutex;                // Non-null: use the mutex-guarded map
+  std::map<std::string, Table*> *locked_map;
+  const std::vector<std::string> *names;
+  long ops;
+  long found;
+};
+
+void *lookup_worker(void *arg)
+{
+  BenchState *state = static_cast<BenchState *>(arg);
+  const std::vector<std::string> &names = *state->names;
+  long found = 0;
+  for (long i = 0; i < state->ops; i++) {
+    const std::string &name = names[i % names.size()];
+    Table *tbl;
+    if (state->mutex) {
+      Guard g(*state->mutex);
+      auto it = state->locked_map->find(name);
+      tbl = (it == state->locked_map->end()) ? nullptr : it->second;
+    } else {
+      tbl = state->server->find_table(name);
+    }
+    if (tbl) {
+      found++;
+    }
+  }
+  state->found = found;
+  return nullptr;
+}
+
+// Run nthreads lookup threads; return total lookups per second
+double run(unsigned nthreads, BenchState proto)
+{
+  std::vector<pthread_t> threads(nthreads);
+  std::vector<BenchState> states(nthreads, proto);
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], nullptr, lookup_worker, &states[i]);
+  }
+  for (unsigned i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  return (proto.ops * nthreads) / elapsed.count();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 3) {
+    std::cerr << "Usage: ./registry_bench [<num tables>] [<lookups per thread>]\n";
+    return 1;
+  }
+
+  unsigned num_tables = (argc >= 2) ? std::atoi(argv[1]) : 16;
+  long ops = (argc >= 3) ? std::atol(argv[2]) : 2000000;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned max_threads = (ncpus > 1) ? unsigned(ncpus) * 2 : 4;
+
+  Server server;
+  std::map<std::string, Table*> locked_map;
+  pthread_mutex_t mutex;
+  pthread_mutex_init(&mutex, nullptr);
+
+  std::vector<std::string> names;
+  for (unsigned i = 0; i < num_tables; i++) {
+    std::string name = "table" + std::to_string(i);
+    server.create_table(name);
+    locked_map[name] = server.find_table(name);
+    names.push_back(name);
+  }
+
+  std::cout << num_tables << " tables, " << ops << " lookups per thread, "
+            << ncpus << " CPUs\n";
+  std::cout << std::setw(8) << "threads"
+            << std::setw(18) << "mutex lookups/s"
+            << std::setw(18) << "cow lookups/s"
+            << std::setw(10) << "speedup" << "\n";
+
+  for (unsigned nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    BenchState locked = { &server, &mutex, &locked_map, &names, ops, 0 };
+    BenchState cow = { &server, nullptr, nullptr, &names, ops, 0 };
+    double locked_rate = run(nthreads, locked);
+    double cow_rate = run(nthreads, cow);
+    std::cout << std::setw(8) << nthreads
+              << std::setw(18) << std::fixed << std::setprecision(0) << locked_rate
+              << std::setw(18) << cow_rate
+              << std::setw(9) << std::setprecision(2) << (cow_rate / locked_rate) << "x\n";
+  }
+
+  pthread_mutex_destroy(&mutex);
+  return 0;
+}
@@ -0,0 +1,459 @@
+#include <ctime>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/socket.h>
+#include "replication.h"
+#include "server.h"
+#include "message.h"
+#include "message_serialization.h"
+#include "exceptions.h"
+#include "guard.h"
+
+namespace {
+
+// A message starts with the time it was sent
+const size_t TIME_SIZE = 8;
+
+uint64_t now_ms()
+{
+  return Table::wall_time_ms();
+}
+
+timespec time_after_ms(unsigned ms)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += long(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+// Read exactly n bytes, throwing CommException if the connection ends
+void read_exactly(rio_t &rio, void *buf, size_t n)
+{
+  if (rio_readnb(&rio, buf, n) != ssize_t(n)) {
+    throw CommException("Connection to primary closed");
+  }
+}
+
+// Retry f until it gets the locks it needs. Only a transaction
+// declaring its locks, or the lock timeout, can make it give up.
+template <typename F>
+void retry_conflicts(F f)
+{
+  while (true) {
+    try {
+      f();
+      return;
+    } catch (TransactionConflict &ex) {
+      // Try again
+    }
+  }
+}
+
+}
+
+ReplicationFeed::ReplicationFeed()
+  : m_count(0)
+{
+  pthread_mutex_init(&m_mutex, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_published, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+ReplicationFeed::~ReplicationFeed()
+{
+  pthread_cond_destroy(&m_published);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+ReplicationFeed::Subscriber *ReplicationFeed::subscribe()
+{
+  Subscriber *subscriber = new Subscriber();
+  subscriber->overflowed = false;
+  Guard g(m_mutex);
+  m_subscribers.insert(subscriber);
+  m_count.store(m_subscribers.size());
+  return subscriber;
+}
+
+void ReplicationFeed::unsubscribe(Subscriber *subscriber)
+{
+  {
+    Guard g(m_mutex);
+    m_subscribers.erase(subscriber);
+    m_count.store(m_subscribers.size());
+  }
+  delete subscriber;
+}
+
+void ReplicationFeed::publish(const LogRecord &record)
+{
+  if (!has_subscribers()) {
+    return;
+  }
+  std::string message;
+  encode(&record, message);
+
+  Guard g(m_mutex);
+  for (Subscriber *subscriber : m_subscribers) {
+    if (subscriber->overflowed) {
+      continue;
+    }
+    if (subscriber->queued.size() + message.size() > MAX_QUEUED_BYTES) {
+      subscriber->overflowed = true; // It will be dropped
+      subscriber->queued.clear();
+      continue;
+    }
+    subscriber->queued += message;
+  }
+  pthread_cond_broadcast(&m_published);
+}
+
+bool ReplicationFeed::take(Subscriber *subscriber, std::string &out)
+{
+  Guard g(m_mutex);
+  timespec deadline = time_after_ms(HEARTBEAT_MS);
+  while (subscriber->queued.empty() && !subscriber->overflowed) {
+    if (pthread_cond_timedwait(&m_published, &m_mutex, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (subscriber->overflowed) {
+    return false;
+  }
+  if (subscriber->queued.empty()) {
+    encode(nullptr, out);
+  } else {
+    out += subscriber->queued;
+    subscriber->queued.clear();
+  }
+  return true;
+}
+
+size_t ReplicationFeed::get_backlog()
+{
+  Guard g(m_mutex);
+  size_t backlog = 0;
+  for (Subscriber *subscriber : m_subscribers) {
+    backlog = std::max(backlog, subscriber->queued.size());
+  }
+  return backlog;
+}
+
+void ReplicationFeed::send(int fd, const std::string &data)
+{
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t rc = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      throw CommException("Replication connection closed");
+    }
+    sent += rc;
+  }
+}
+
+void ReplicationFeed::encode(const LogRecord *record, std::string &out)
+{
+  uint64_t sent = now_ms();
+  for (size_t i = 0; i < TIME_SIZE; i++) {
+    out.push_back(char(sent >> (8 * i)));
+  }
+  if (record) {
+    record->encode(out);
+  } else {
+    out.append(LogRecord::FRAME_HEADER_SIZE, '\0');
+  }
+}
+
+Replica::Replica(Server *server, const std::string &primary)
+  : m_server(server)
+  , m_started(false)
+  , m_stopping(false)
+  , m_fd(-1)
+  , m_synced(false)
+  , m_last_sent_ms(0)
+  , m_applied(0)
+  , m_syncs(0)
+{
+  size_t colon = primary.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == primary.size()) {
+    throw std::invalid_argument("Primary must be given as host:port");
+  }
+  m_host = primary.substr(0, colon);
+  m_port = primary.substr(colon + 1);
+}
+
+Replica::~Replica()
+{
+  if (m_started) {
+    m_stopping.store(true);
+    int fd = m_fd.load();
+    if (fd >= 0) {
+      shutdown(fd, SHUT_RDWR); // Wakes the thread if it's reading
+    }
+    pthread_join(m_thread, nullptr);
+  }
+}
+
+void Replica::start()
+{
+  if (pthread_create(&m_thread, nullptr, worker, this) != 0) {
+    throw StorageException("Could not create replication thread");
+  }
+  m_started = true;
+}
+
+uint64_t Replica::get_lag_ms() const
+{
+  uint64_t sent = m_last_sent_ms.load(), now = now_ms();
+  return (sent == 0 || now < sent) ? 0 : now - sent;
+}
+
+void *Replica::worker(void *arg)
+{
+  static_cast<Replica *>(arg)->run();
+  return nullptr;
+}
+
+void Replica::run()
+{
+  // Errors are reported once, not at every attempt to reconnect
+  std::string last_error;
+  while (!m_stopping.load()) {
+    std::string error = "Could not connect to primary " + m_host + ":" + m_port;
+    int fd = open_clientfd(m_host.c_str(), m_port.c_str());
+    if (fd >= 0) {
+      m_fd.store(fd);
+      try {
+        replicate(fd);
+      } catch (std::exception &ex) {
+        error = std::string("Replication stopped: ") + ex.what();
+      }
+      m_synced.store(false);
+      m_fd.store(-1);
+      close(fd);
+    }
+    if (m_stopping.load()) {
+      break;
+    }
+    if (error != last_error) {
+      Server::log_error(error);
+      last_error = error;
+    }
+    for (unsigned ms = 0; ms < RECONNECT_MS && !m_stopping.load(); ms += 100) {
+      usleep(100 * 1000);
+    }
+  }
+}
+
+void Replica::replicate(int fd)
+{
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+  std::string login, subscribe;
+  MessageSerialization::encode(Message(MessageType::LOGIN, {"replica"}), login);
+  MessageSerialization::encode(Message(MessageType::REPLICATE), subscribe);
+  ReplicationFeed::send(fd, login + subscribe);
+  for (int i = 0; i < 2; i++) {
+    char buffer[Message::MAX_ENCODED_LEN];
+    if (rio_readlineb(&rio, buffer, sizeof(buffer)) <= 0) {
+      throw CommException("Connection to primary closed");
+    }
+    Message response;
+    MessageSerialization::decode(buffer, response);
+    if (response.get_message_type() != MessageType::OK) {
+      throw CommException("Primary refused to replicate: " + response.get_quoted_text());
+    }
+  }
+
+  EpochManager &epochs = m_server->get_epochs();
+  EpochManager::Participant *participant = epochs.register_participant();
+  try {
+    // Each table of the snapshot is loaded privately, then replaces the
+    // server's (which keeps being served meanwhile)
+    std::set<std::string> names;
+    std::string name;
+    Table *tbl = nullptr;
+    LogRecord record;
+    uint64_t sent;
+    try {
+      while (read_message(rio, record, sent)) {
+        if (record.type == LogRecord::CREATE_TABLE) {
+          finish_table(tbl, name, participant);
+          name = record.table;
+          names.insert(name);
+          tbl = m_server->new_table(name);
+        } else if (record.type == LogRecord::COMMIT && tbl) {
+          for (const auto &table : record.changes) {
+            tbl->load(table.second);
+          }
+        } else {
+          throw CommException("Unexpected record in snapshot");
+        }
+      }
+      finish_table(tbl, name, participant);
+    } catch (...) {
+      if (tbl) {
+        tbl->mark_dropped();
+        delete tbl;
+      }
+      throw;
+    }
+
+    // Tables the primary doesn't have
+    {
+      EpochGuard pin(epochs, participant);
+      for (const auto &table : *m_server->get_table_map()) {
+        if (!names.count(table.first)) {
+          name = table.first;
+          retry_conflicts([this, &name]() { m_server->drop_table(name); });
+        }
+      }
+    }
+    m_last_sent_ms.store(sent);
+    m_synced.store(true);
+    m_syncs.fetch_add(1);
+
+    while (!m_stopping.load()) {
+      if (read_message(rio, record, sent)) {
+        EpochGuard pin(epochs, participant);
+        retry_conflicts([this, &record]() { apply(record); });
+        m_applied.fetch_add(1);
+      }
+      m_last_sent_ms.store(sent);
+    }
+  } catch (...) {
+    epochs.unregister_participant(participant);
+    throw;
+  }
+  epochs.unregister_participant(participant);
+}
+
+bool Replica::read_message(rio_t &rio, LogRecord &record, uint64_t &sent)
+{
+  unsigned char time[TIME_SIZE];
+  char header[LogRecord::FRAME_HEADER_SIZE];
+  read_exactly(rio, time, sizeof(time));
+  read_exactly(rio, header, sizeof(header));
+  sent = 0;
+  for (size_t i = 0; i < TIME_SIZE; i++) {
+    sent |= uint64_t(time[i]) << (8 * i);
+  }
+
+  uint32_t len = LogRecord::frame_length(header);
+  if (len == 0) {
+    return false;
+  }
+  if (len > LogRecord::MAX_PAYLOAD_SIZE) {
+    throw CommException("Record from primary too large");
+  }
+  std::vector<char> payload(len);
+  read_exactly(rio, payload.data(), len);
+  if (!record.decode_frame(header, payload.data())) {
+    throw CommException("Corrupt record from primary");
+  }
+  return true;
+}
+
+// Replace the server's table named name (if any) with tbl, a table of
+// the snapshot
+void Replica::finish_table(Table *&tbl, const std::string &name, EpochManager::Participant *participant)
+{
+  if (!tbl) {
+    return;
+  }
+  Table *loaded = tbl;
+  tbl = nullptr; // restore_table takes it, even if it fails
+  EpochGuard pin(m_server->get_epochs(), participant);
+  if (m_server->find_table(name)) {
+    retry_conflicts([this, &name]() { m_server->drop_table(name); });
+  }
+  m_server->restore_table(name, loaded);
+}
+
+void Replica::apply(LogRecord &record)
+{
+  const std::string &name = record.table;
+  switch (record.type) {
+    case LogRecord::COMMIT:
+      apply_commit(record);
+      break;
+    case LogRecord::CREATE_TABLE:
+    case LogRecord::TRUNCATE_TABLE:
+      if (m_server->find_table(name)) {
+        m_server->truncate_table(name);
+      } else {
+        m_server->create_table(name);
+      }
+      break;
+    case LogRecord::DROP_TABLE:
+      if (m_server->find_table(name)) {
+        m_server->drop_table(name);
+      }
+      break;
+    case LogRecord::RESTORE_TABLE:
+      {
+        if (m_server->find_table(name)) {
+          m_server->drop_table(name);
+        }
+        Table *tbl = m_server->new_table(name);
+        for (const auto &table : record.changes) {
+          tbl->load(table.second);
+        }
+        m_server->restore_table(name, tbl);
+      }
+      break;
+  }
+}
+
+// Commit the record's changes as a transaction declaring its locks
+// would, so they wait for clients reading the keys, and are stamped for
+// read-only transactions' snapshots
+void Replica::apply_commit(LogRecord &record)
+{
+  WriteSet changes;
+  std::vector<LockManager::Request> requests;
+  for (const auto &table : record.changes) {
+    Table *tbl = m_server->find_table(table.first);
+    if (!tbl) {
+      continue; // Dropped since (and the drop follows)
+    }
+    for (const auto &change : table.second) {
+      changes.set(tbl, change.first, change.second.value, change.second.expires_at);
+      requests.push_back(LockManager::Request{tbl, change.first, LockManager::EXCLUSIVE});
+    }
+  }
+  if (changes.is_empty()) {
+    return;
+  }
+
+  LockManager &locks = m_server->get_locks();
+  LockManager::Owner owner;
+  locks.begin_transaction(&owner);
+  try {
+    locks.lock_declared(&owner, requests);
+    CommitGuard commit(m_server->get_commit_clock());
+    m_server->log_commit(changes); // For replicas of this replica
+    for (const auto &entry : changes) {
+      entry.first->lock();
+      entry.first->commit_changes(entry.second, commit.get());
+      entry.first->unlock();
+    }
+  } catch (...) {
+    locks.end_transaction(&owner);
+    throw;
+  }
+  locks.end_transaction(&owner);
+  m_server->enforce_memory_limit();
+}
@@ -0,0 +1,155 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <set>
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include "csapp.h"
+#include "commit_log.h"
+#include "epoch_manager.h"
+
+class Server; // forward declaration
+class Table;  // forward declaration
+
+// Asynchronous replication. A replica connects to its primary and sends
+// LOGIN and REPLICATE; the primary replies OK, then sends a stream of
+// messages, each the primary's wall clock time (ms, 8 bytes little-
+// endian) followed by a log record's frame:
+//
+//   - first a snapshot of every table: its CREATE_TABLE record, then
+//     COMMIT records of its rows as of one moment
+//   - then an empty frame, which ends the snapshot
+//   - then every record the primary logs from then on (as its commit
+//     log would, even if it has none), in the order they were logged,
+//     with an empty frame (a heartbeat) whenever none was sent for
+//     HEARTBEAT_MS
+//
+// Commits after the snapshot's moment are always streamed. Some
+// before it may be too, having been logged just after the replica
+// subscribed; records hold the keys' new values, so they are simply
+// applied again.
+//
+// The primary queues each replica's messages, so committers never
+// wait for replicas. A replica that falls MAX_QUEUED_BYTES behind is
+// disconnected; it reconnects and starts again from a new snapshot.
+class ReplicationFeed {
+public:
+  class Subscriber {
+  private:
+    friend class ReplicationFeed;
+    std::string queued; // Messages not yet taken
+    bool overflowed;
+  };
+
+private:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_published; // Signaled when messages are queued
+  std::set<Subscriber *> m_subscribers;
+  std::atomic<unsigned> m_count; // Subscribers, readable without the mutex
+
+  // copy constructor and assignment operator are prohibited
+  ReplicationFeed(const ReplicationFeed &);
+  ReplicationFeed &operator=(const ReplicationFeed &);
+
+public:
+  static const size_t MAX_QUEUED_BYTES = 64 << 20;
+
+  // Most time between messages sent to a replica
+  static const unsigned HEARTBEAT_MS = 100;
+
+  ReplicationFeed();
+  ~ReplicationFeed();
+
+  // Start queuing published records for a new subscriber. It receives
+  // every record published from now on.
+  Subscriber *subscribe();
+  void unsubscribe(Subscriber *subscriber);
+
+  bool has_subscribers() const { return m_count.load() > 0; }
+  unsigned get_subscribers() const { return m_count.load(); }
+
+  // Queue a record for every subscriber (doing nothing if there are none)
+  void publish(const LogRecord &record);
+
+  // Wait up to HEARTBEAT_MS for messages queued for subscriber, then
+  // move them to out (or, if there are none, a heartbeat). Returns
+  // false if the subscriber fell MAX_QUEUED_BYTES behind, and must be
+  // dropped.
+  bool take(Subscriber *subscriber, std::string &out);
+
+  // Bytes queued for the subscriber furthest behind
+  size_t get_backlog();
+
+  // Append a message holding record (or, if null, an empty frame) to out
+  static void encode(const LogRecord *record, std::string &out);
+
+  // Send data over a replication connection (without raising SIGPIPE
+  // if the other end has gone). Throws CommException if it fails.
+  static void send(int fd, const std::string &data);
+};
+
+// Keeps this server's tables a copy of a primary's. A thread connects
+// to the primary, loads its snapshot, and applies the records it
+// streams, in order. Tables are loaded privately and then replace the
+// server's; each commit is applied as a transaction would commit it
+// (with its keys locked, and a commit timestamp), so the replica's
+// clients see whole commits, and read-only transactions can read a
+// snapshot. If the connection fails, the replica keeps serving what it
+// has, and reconnects every RECONNECT_MS.
+class Replica {
+private:
+  Server *m_server;
+  std::string m_host;
+  std::string m_port;
+  pthread_t m_thread;
+  bool m_started;
+  std::atomic<bool> m_stopping;
+  std::atomic<int> m_fd;      // Connection to the primary, or -1
+
+  std::atomic<bool> m_synced;             // The current connection's snapshot is loaded
+  std::atomic<uint64_t> m_last_sent_ms;   // Primary's time when it sent the last message applied
+  std::atomic<unsigned long> m_applied;   // Streamed records applied
+  std::atomic<unsigned long> m_syncs;     // Snapshots loaded
+
+  static void *worker(void *arg);
+  void run();
+  void replicate(int fd);
+
+  // Read a message into record, and the time it was sent into sent.
+  // Returns false if it holds no record. Throws CommException if the
+  // connection fails, or the record is corrupt.
+  bool read_message(rio_t &rio, LogRecord &record, uint64_t &sent);
+  void finish_table(Table *&tbl, const std::string &name, EpochManager::Participant *participant);
+  void apply(LogRecord &record);
+  void apply_commit(LogRecord &record);
+
+  // copy constructor and assignment operator are prohibited
+  Replica(const Replica &);
+  Replica &operator=(const Replica &);
+
+public:
+  static const unsigned RECONNECT_MS = 1000;
+
+  // primary is host:port. Throws std::invalid_argument if it isn't.
+  Replica(Server *server, const std::string &primary);
+
+  // Disconnects and stops the thread
+  ~Replica();
+
+  // Start the thread. Throws StorageException if it can't be created.
+  void start();
+
+  bool is_synced() const { return m_synced.load(); }
+
+  // How far behind the primary the replica is: milliseconds since the
+  // primary sent the last message applied (by the primary's clock, so
+  // the clocks must agree)
+  uint64_t get_lag_ms() const;
+
+  unsigned long get_applied() const { return m_applied.load(); }
+  unsigned long get_syncs() const { return m_syncs.load(); }
+};
+
+#endif // REPLICATION_H
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <string>
+#include "csapp.h"
+#include "message.h"
+#include "message_serialization.h"
+
+int main(int argc, char **argv)
+{
+  if (argc != 5 && argc != 6) {
+    std::cerr << "Usage: ./scan_table <hostname> <port> <username> <table> [<key prefix>]\n";
+    return 1;
+  }
+
+  std::string hostname = argv[1];
+  std::string port = argv[2];
+  std::string username = argv[3];
+  std::string table = argv[4];
+  std::string prefix = (argc == 6) ? argv[5] : "";
+
+  int clientfd;
+  rio_t rio;
+
+  try {
+    // Establish a connection to the server
+    clientfd = Open_clientfd(hostname.c_str(), port.c_str());
+    Rio_readinitb(&rio, clientfd);
+
+    // Send LOGIN message
+    Message login_msg(MessageType::LOGIN, {username});
+    std::string encoded_login;
+    MessageSerialization::encode(login_msg, encoded_login);
+    Rio_writen(clientfd, encoded_login.c_str(), encoded_login.size());
+
+    // Read response to LOGIN
+    char buffer[Message::MAX_ENCODED_LEN];
+    Rio_readlineb(&rio, buffer, Message::MAX_ENCODED_LEN);
+    Message response;
+    MessageSerialization::decode(buffer, response);
+    if (response.get_message_type() != MessageType::OK) {
+      std::cerr << "Error: " << response.get_quoted_text() << "\n";
+      Close(clientfd);
+      return 1;
+    }
+
+    // Send SCAN requests, each resuming from the cursor returned by
+    // the previous one, until the server returns the end cursor
+    std::string cursor = Message::SCAN_START;
+    do {
+      Message scan_msg(MessageType::SCAN, {table, cursor});
+      if (!prefix.empty()) {
+        scan_msg.push_arg(prefix);
+      }
+      std::string encoded_scan;
+      MessageSerialization::encode(scan_msg, encoded_scan);
+      Rio_writen(clientfd, encoded_scan.c_str(), encoded_scan.size());
+
+      // Read response to SCAN
+      Rio_readlineb(&rio, buffer, Message::MAX_ENCODED_LEN);
+      MessageSerialization::decode(buffer, response);
+      if (response.get_message_type() != MessageType::ROWS) {
+        std::cerr << "Error: " << response.get_quoted_text() << "\n";
+        Close(clientfd);
+        return 1;
+      }
+
+      // Print each key/value pair
+      for (unsigned i = 1; i + 1 < response.get_num_args(); i += 2) {
+        std::cout << response.get_arg(i) << " " << response.get_arg(i + 1) << "\n";
+      }
+      cursor = response.get_cursor();
+    } while (cursor != Message::SCAN_START);
+
+    // Send BYE message
+    Message bye_msg(MessageType::BYE);
+    std::string encoded_bye;
+    MessageSerialization::encode(bye_msg, encoded_bye);
+    Rio_writen(clientfd, encoded_bye.c_str(), encoded_bye.size());
+
+    // Close the connection
+    Close(clientfd);
+  } catch (const std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
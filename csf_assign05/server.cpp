@@ -1,32 +1,233 @@
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <cassert>
+#include <ctime>
+#include <climits>
+#include <set>
 #include <stdexcept>
 #include "csapp.h"
 #include "exceptions.h"
 #include "guard.h"
 #include "server.h"
 #include "client_connection.h"
+#include "log_replay.h"
 #include "memory"
 
-Server::Server()
+Server::Server(const ServerOptions &options)
   : m_listenfd(-1)
+  , m_options(options)
+  , m_keys(options.share_keys ? new KeyDictionary() : nullptr)
+  , m_tables(new TableMap())
+  , m_locks(options.lock_timeout_ms)
+  , m_log(nullptr)
+  , m_have_full_checkpoint(false)
+  , m_checkpoints(0)
+  , m_merges(0)
+  , m_compactions(0)
+  , m_replica(nullptr)
+  , m_tables_generation(0)
+  , m_memory_used(0)
+  , m_evictions(0)
+  , m_expired(0)
+  , m_retries(0)
+  , m_background_started(false)
+  , m_checkpoint_started(false)
+  , m_compact_started(false)
+  , m_stopping(false)
 {
   pthread_mutex_init(&m_tables_mutex, nullptr);
+  pthread_mutex_init(&m_checkpoint_mutex, nullptr);
 }
 
 Server::~Server()
 {
-  // Clean up tables
-  lock_tables_map();
-  for (auto &pair : m_tables) {
+  delete m_replica; // Stops applying changes
+  if (m_background_started) {
+    m_stopping.store(true);
+    pthread_join(m_expiry_thread, nullptr);
+    pthread_join(m_reclaim_thread, nullptr);
+  }
+  if (m_checkpoint_started) {
+    pthread_join(m_checkpoint_thread, nullptr);
+  }
+  if (m_compact_started) {
+    pthread_join(m_compact_thread, nullptr);
+  }
+  delete m_log; // Syncs whatever is still queued
+
+  // Clean up tables and registry snapshots
+  const TableMap *tables = m_tables.load();
+  for (auto &pair : *tables) {
     delete pair.second;
   }
-  m_tables.clear();
-  unlock_tables_map();
+  delete tables;
+  m_epochs.reclaim();
+  assert(m_epochs.pending() == 0);
+  for (Checkpoint *checkpoint : m_checkpoint_files) {
+    delete checkpoint; // Tables may have used its rows
+  }
+
+  // Tables release their keys, so the dictionary goes last
+  delete m_keys;
 
+  pthread_mutex_destroy(&m_checkpoint_mutex);
   pthread_mutex_destroy(&m_tables_mutex);
 }
 
+void Server::recover()
+{
+  if (m_options.log_path.empty()) {
+    return;
+  }
+
+  // Nothing else uses the registry yet, so it is changed in place.
+  // Tables are created and dropped as their records are read, while
+  // commits' changes are handed to the replay workers, which apply each
+  // key's latest change once the whole log has been read.
+  TableMap *tables = const_cast<TableMap *>(m_tables.load());
+  unsigned nthreads = m_options.recovery_threads;
+  if (nthreads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus > 0 ? cpus : 1;
+  }
+  LogReplay replay(nthreads);
+  auto apply = [this, tables, &replay](LogRecord &record) {
+    if (record.type == LogRecord::COMMIT) {
+      replay.add_commit(record);
+      return;
+    }
+    replay.reset_table(record.table);
+    auto it = tables->find(record.table);
+    if (it != tables->end()) {
+      it->second->mark_dropped();
+      delete it->second;
+      tables->erase(it);
+    }
+    if (record.type != LogRecord::DROP_TABLE) {
+      (*tables)[record.table] = new_table(record.table);
+    }
+    if (record.type == LogRecord::RESTORE_TABLE) {
+      replay.add_commit(record); // Its rows
+    }
+  };
+
+  // Reported at most once a second, as a large log takes a while
+  time_t started = time(nullptr), reported = started;
+  auto progress = [&reported](uint64_t done, uint64_t total) {
+    time_t now = time(nullptr);
+    if (now != reported && total > 0) {
+      std::cerr << "Replaying commit log: " << (done * 100 / total) << "%\n";
+      reported = now;
+    }
+  };
+
+  // The full checkpoint's tables are used in place, as the tables'
+  // base data, and then each delta after it is applied, so only the
+  // log after the last one is read. Deltas no later than the full
+  // checkpoint were merged into it already.
+  unsigned long first_segment = 1;
+  Checkpoint *checkpoint = new Checkpoint();
+  m_checkpoint_files.push_back(checkpoint);
+  m_have_full_checkpoint = checkpoint->open(checkpoint_path());
+  if (m_have_full_checkpoint) {
+    for (const auto &table : checkpoint->get_tables()) {
+      (*tables)[table.first] = new Table(table.first, m_keys, &m_memory_used, table.second);
+    }
+    first_segment = checkpoint->get_first_segment();
+  }
+  for (unsigned long segment : CommitLog::list_numbered(checkpoint_path())) {
+    if (!m_have_full_checkpoint || segment <= first_segment) {
+      unlink(delta_path(segment).c_str());
+      continue;
+    }
+    Checkpoint *delta = new Checkpoint();
+    m_checkpoint_files.push_back(delta);
+    if (delta->open(delta_path(segment))) {
+      apply_delta(tables, *delta);
+      first_segment = delta->get_first_segment();
+      m_deltas.push_back(segment);
+    }
+  }
+
+  // Changes from here on are dirty, as the checkpoints don't have them
+  for (auto &pair : *tables) {
+    pair.second->set_checkpointed();
+    pair.second->track_dirty();
+  }
+  m_log = new CommitLog(m_options.log_path, m_options.log_sync, m_options.log_sync_interval_ms);
+  unsigned long records = m_log->open(apply, first_segment, progress);
+  replay.finish([tables](const std::string &name) {
+    auto it = tables->find(name);
+    return it != tables->end() ? it->second : nullptr;
+  });
+  if (records > 0) {
+    std::cerr << "Replayed " << records << " commit log records (" << replay.get_changes()
+              << " changes) in " << (time(nullptr) - started) << "s using "
+              << nthreads << " threads\n";
+  }
+  m_tables_generation.fetch_add(1, std::memory_order_release);
+  enforce_memory_limit();
+}
+
+std::string Server::delta_path(unsigned long segment) const
+{
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%06lu", segment);
+  return checkpoint_path() + suffix;
+}
+
+Table *Server::new_table(const std::string &name)
+{
+  Table *tbl = new Table(name, m_keys, &m_memory_used);
+  if (!m_options.log_path.empty()) {
+    tbl->track_dirty();
+  }
+  return tbl;
+}
+
+void Server::apply_delta(TableMap *tables, const Checkpoint &delta)
+{
+  // Tables the delta doesn't list were dropped
+  for (auto it = tables->begin(); it != tables->end(); ) {
+    bool listed = false;
+    for (const auto &table : delta.get_tables()) {
+      listed = listed || table.first == it->first;
+    }
+    if (listed) {
+      ++it;
+    } else {
+      it->second->mark_dropped();
+      delete it->second;
+      it = tables->erase(it);
+    }
+  }
+
+  uint64_t now = Table::wall_time_ms();
+  for (const auto &table : delta.get_tables()) {
+    const MappedTable &rows = table.second;
+    Table *&tbl = (*tables)[table.first];
+    if (!rows.is_delta()) {
+      // Created or truncated since the last checkpoint, so saved in full
+      if (tbl) {
+        tbl->mark_dropped();
+        delete tbl;
+      }
+      tbl = new Table(table.first, m_keys, &m_memory_used, rows);
+      continue;
+    }
+    if (!tbl) {
+      tbl = new Table(table.first, m_keys, &m_memory_used); // (Not possible: it would be saved in full)
+    }
+    for (size_t i = 0; i < rows.size(); i++) {
+      // A key that has expired since is deleted instead
+      uint64_t expires_at = rows.expires_at(i);
+      bool deleted = rows.is_deleted(i) || (expires_at != 0 && expires_at <= now);
+      tbl->set(rows.key(i), deleted ? "" : rows.value(i), expires_at);
+    }
+  }
+}
+
 void Server::listen(const std::string &port)
 {
   int fd = open_listenfd(port.c_str());
@@ -44,6 +245,31 @@ void Server::server_loop()
     throw CommException("Server listen failed (no socket)");
   }
 
+  if (pthread_create(&m_expiry_thread, nullptr, expiry_worker, this) != 0 ||
+      pthread_create(&m_reclaim_thread, nullptr, reclaim_worker, this) != 0) {
+    log_error("Could not create background threads");
+    throw CommException("Server start failed");
+  }
+  m_background_started = true;
+  if (is_replica()) {
+    m_replica = new Replica(this, m_options.primary);
+    m_replica->start();
+  }
+  if (m_log) {
+    if (pthread_create(&m_checkpoint_thread, nullptr, checkpoint_worker, this) != 0) {
+      log_error("Could not create checkpoint thread");
+      throw CommException("Server start failed");
+    }
+    m_checkpoint_started = true;
+  }
+  if (m_log && m_options.compact_log) {
+    if (pthread_create(&m_compact_thread, nullptr, compact_worker, this) != 0) {
+      log_error("Could not create log compaction thread");
+      throw CommException("Server start failed");
+    }
+    m_compact_started = true;
+  }
+
   while (true) {
     struct sockaddr_storage clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
@@ -78,6 +304,275 @@ void *Server::client_worker(void *arg)
   return nullptr;
 }
 
+void *Server::expiry_worker(void *arg)
+{
+  static_cast<Server *>(arg)->expire_keys();
+  return nullptr;
+}
+
+void *Server::reclaim_worker(void *arg)
+{
+  static_cast<Server *>(arg)->reclaim_retired();
+  return nullptr;
+}
+
+void *Server::checkpoint_worker(void *arg)
+{
+  static_cast<Server *>(arg)->checkpoint_periodically();
+  return nullptr;
+}
+
+void Server::expire_keys()
+{
+  EpochManager::Participant *participant = m_epochs.register_participant();
+  bool backlog = false;
+  while (!m_stopping.load()) {
+    // Work through a large wave of expirations in small batches,
+    // releasing each table's lock in between so clients aren't stalled.
+    // Old versions kept for snapshots are discarded at the same time.
+    usleep(backlog ? 1000 : Table::EXPIRY_TICK_MS * 1000);
+    backlog = false;
+
+    EpochGuard pin(m_epochs, participant);
+    uint64_t horizon = m_commits.get_horizon();
+    const TableMap *tables = m_tables.load(std::memory_order_acquire);
+    for (auto &pair : *tables) {
+      Table *tbl = pair.second;
+      if (!tbl->trylock()) {
+        backlog = true; // In use, so try again soon
+        continue;
+      }
+      unsigned removed;
+      if (tbl->remove_expired(EXPIRY_BATCH, removed)) {
+        backlog = true;
+      }
+      tbl->prune_history(horizon); // Versions no snapshot can read
+      tbl->unlock();
+      m_expired.fetch_add(removed, std::memory_order_relaxed);
+    }
+  }
+  m_epochs.unregister_participant(participant);
+}
+
+void Server::reclaim_retired()
+{
+  // Dropping a big table is cheap for the client that drops it:
+  // the table is deleted here
+  while (!m_stopping.load()) {
+    usleep(RECLAIM_INTERVAL_MS * 1000);
+    m_epochs.reclaim();
+  }
+}
+
+void *Server::compact_worker(void *arg)
+{
+  static_cast<Server *>(arg)->compact_periodically();
+  return nullptr;
+}
+
+void Server::checkpoint_periodically()
+{
+  unsigned long ticks = 0;
+  while (!m_stopping.load()) {
+    usleep(100 * 1000); // Checking often, so stopping isn't delayed
+    if (m_options.checkpoint_interval_s > 0 && ++ticks >= m_options.checkpoint_interval_s * 10UL) {
+      ticks = 0;
+      try {
+        checkpoint();
+      } catch (OperationException &ex) {
+        // Already logged; try again next time
+      }
+    }
+    merge_deltas(); // (Also after checkpoints clients requested)
+  }
+}
+
+void Server::compact_periodically()
+{
+  while (!m_stopping.load()) {
+    usleep(100 * 1000);
+    if (m_log->get_segment_size() >= m_options.log_segment_bytes) {
+      compact_log();
+    }
+  }
+}
+
+void Server::checkpoint()
+{
+  if (!m_log) {
+    throw OperationException("No commit log is configured");
+  }
+  Guard checkpointing(m_checkpoint_mutex);
+
+  EpochManager::Participant *participant = m_epochs.register_participant();
+  m_epochs.enter(participant); // The tables stay valid until the end
+
+  // The log switches to a new segment just before the snapshot opens,
+  // so every commit the snapshot misses is logged in the new segment
+  // (commits are stamped before they are logged). Creating, dropping
+  // and truncating tables are logged with the registry locked, so the
+  // registry matches the old segments too.
+  unsigned long segment;
+  uint64_t snapshot = 0;
+  const TableMap *tables;
+  try {
+    Guard g(m_tables_mutex);
+    segment = m_log->rotate();
+    tables = m_tables.load(std::memory_order_relaxed);
+    snapshot = m_commits.open_snapshot();
+  } catch (StorageException &ex) {
+    m_epochs.exit(participant);
+    m_epochs.unregister_participant(participant);
+    log_error(ex.what());
+    throw OperationException("Could not write checkpoint");
+  }
+
+  // A delta saves just the keys changed as of the snapshot, and in
+  // full, tables the last checkpoint didn't save (created or truncated
+  // since). Keys changed after the snapshot stay dirty for the next one.
+  bool full = !m_have_full_checkpoint;
+  std::vector<std::pair<Table *, std::vector<std::string>>> dirty;
+  bool ok = true;
+  try {
+    CheckpointWriter writer(full ? checkpoint_path() : delta_path(segment), segment);
+    for (auto &pair : *tables) {
+      Table *tbl = pair.second;
+      dirty.emplace_back(tbl, std::vector<std::string>());
+      tbl->lock();
+      tbl->take_dirty(snapshot, dirty.back().second);
+      tbl->unlock();
+      bool whole = full || !tbl->is_checkpointed();
+      write_table(writer, pair.first, tbl, snapshot, whole ? nullptr : &dirty.back().second);
+    }
+    writer.finish();
+  } catch (StorageException &ex) {
+    log_error(ex.what());
+    ok = false;
+    for (auto &taken : dirty) {
+      taken.first->lock();
+      taken.first->restore_dirty(taken.second);
+      taken.first->unlock();
+    }
+  }
+  m_commits.close_snapshot(snapshot);
+  if (ok) {
+    for (auto &pair : *tables) {
+      pair.second->set_checkpointed();
+    }
+  }
+  m_epochs.exit(participant);
+  m_epochs.unregister_participant(participant);
+  if (!ok) {
+    throw OperationException("Could not write checkpoint");
+  }
+
+  if (full) {
+    m_have_full_checkpoint = true;
+    for (unsigned long delta : m_deltas) {
+      unlink(delta_path(delta).c_str()); // Older than the full checkpoint
+    }
+    m_deltas.clear();
+  } else {
+    m_deltas.push_back(segment);
+  }
+  m_log->remove_segments_before(segment);
+  m_checkpoints.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Server::write_table(CheckpointWriter &writer, const std::string &name, Table *tbl, uint64_t snapshot,
+                         const std::vector<std::string> *keys)
+{
+  // The table's latch is held only while reading a batch, so clients
+  // can use the table in between
+  writer.begin_table(name, keys != nullptr);
+  if (keys) {
+    for (size_t i = 0; i < keys->size(); ) {
+      std::vector<std::pair<const std::string *, WriteSet::Change>> rows;
+      std::vector<bool> found;
+      tbl->lock();
+      for (size_t n = 0; n < CHECKPOINT_BATCH && i < keys->size(); n++, i++) {
+        rows.emplace_back(&(*keys)[i], WriteSet::Change());
+        found.push_back(tbl->find_at((*keys)[i], snapshot, rows.back().second));
+      }
+      tbl->unlock();
+      for (size_t r = 0; r < rows.size(); r++) {
+        if (found[r]) {
+          writer.add_row(*rows[r].first, rows[r].second.value, rows[r].second.expires_at);
+        } else {
+          writer.add_deletion(*rows[r].first);
+        }
+      }
+    }
+    return;
+  }
+
+  std::string after;
+  bool more = true;
+  while (more) {
+    WriteSet::Changes rows;
+    tbl->lock();
+    more = tbl->scan_at(after, "", snapshot, CHECKPOINT_BATCH, rows);
+    tbl->unlock();
+    if (rows.empty()) {
+      break;
+    }
+    for (const auto &row : rows) {
+      writer.add_row(row.first, row.second.value, row.second.expires_at);
+    }
+    after = rows.rbegin()->first;
+  }
+}
+
+void Server::merge_deltas()
+{
+  Guard merging(m_checkpoint_mutex);
+  if (m_deltas.size() < MAX_DELTAS) {
+    return;
+  }
+
+  // Only the files are read, not the tables, and the merged checkpoint
+  // covers the log as far as the last delta does
+  try {
+    std::vector<std::unique_ptr<Checkpoint>> files;
+    std::vector<const Checkpoint *> chain;
+    for (size_t i = 0; i <= m_deltas.size(); i++) {
+      std::string path = i == 0 ? checkpoint_path() : delta_path(m_deltas[i - 1]);
+      files.emplace_back(new Checkpoint());
+      if (!files.back()->open(path)) {
+        throw StorageException("Missing checkpoint " + path);
+      }
+      chain.push_back(files.back().get());
+    }
+    CheckpointWriter writer(checkpoint_path(), m_deltas.back());
+    Checkpoint::merge(chain, writer);
+    writer.finish();
+  } catch (StorageException &ex) {
+    log_error(ex.what()); // Try again next time
+    return;
+  }
+
+  // A crash before the deltas are removed leaves them behind, but
+  // recovery skips deltas the full checkpoint covers
+  for (unsigned long delta : m_deltas) {
+    unlink(delta_path(delta).c_str());
+  }
+  m_deltas.clear();
+  m_merges.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Server::compact_log()
+{
+  Guard compacting(m_checkpoint_mutex);
+  try {
+    m_log->rotate();
+    if (m_log->compact(m_options.compact_rate, m_stopping)) {
+      m_compactions.fetch_add(1, std::memory_order_relaxed);
+    }
+  } catch (StorageException &ex) {
+    log_error(ex.what()); // The log is left as it was; try again next time
+  }
+}
+
 void Server::log_error(const std::string &what)
 {
   std::cerr << "Error: " << what << "\n";
@@ -85,19 +580,297 @@ void Server::log_error(const std::string &what)
 
 void Server::create_table(const std::string &name)
 {
-  // caller must hold lock
-  if (m_tables.find(name) != m_tables.end()) {
-    throw OperationException("Table already exists");
+  uint64_t lsn = 0;
+  {
+    Guard g(m_tables_mutex);
+
+    const TableMap *current = m_tables.load(std::memory_order_relaxed);
+    if (current->find(name) != current->end()) {
+      throw OperationException("Table already exists");
+    }
+
+    // Logged before it's published, so no commit to it is logged first
+    lsn = log_record(LogRecord{LogRecord::CREATE_TABLE, name, {}});
+
+    // Publish a new snapshot containing the table. The release store
+    // makes the fully built map (and table) visible to readers.
+    TableMap *updated = new TableMap(*current);
+    (*updated)[name] = new_table(name);
+    m_tables.store(updated, std::memory_order_release);
+    m_tables_generation.fetch_add(1, std::memory_order_release);
+    m_epochs.retire([current]() { delete current; });
+  }
+  wait_durable(lsn);
+}
+
+void Server::restore_table(const std::string &name, Table *tbl)
+{
+  // One record, so after a crash the table is either restored with
+  // every row or not at all. Its rows are read before the registry is
+  // locked (no one else uses the table yet), unless a replica
+  // subscribes meanwhile.
+  LogRecord record{LogRecord::RESTORE_TABLE, name, {}};
+  auto read_rows = [&record, &name, tbl]() {
+    record.changes.emplace_back(name, WriteSet::Changes());
+    tbl->scan_at("", "", UINT64_MAX, UINT_MAX, record.changes.back().second);
+  };
+  if (m_log || m_feed.has_subscribers()) {
+    read_rows();
+  }
+
+  uint64_t lsn = 0;
+  try {
+    Guard g(m_tables_mutex);
+
+    const TableMap *current = m_tables.load(std::memory_order_relaxed);
+    if (current->find(name) != current->end()) {
+      throw OperationException("Table already exists");
+    }
+
+    if (record.changes.empty() && m_feed.has_subscribers()) {
+      read_rows();
+    }
+    try {
+      lsn = log_record(record);
+    } catch (StorageException &ex) {
+      throw OperationException(ex.what());
+    }
+
+    TableMap *updated = new TableMap(*current);
+    (*updated)[name] = tbl;
+    m_tables.store(updated, std::memory_order_release);
+    m_tables_generation.fetch_add(1, std::memory_order_release);
+    m_epochs.retire([current]() { delete current; });
+  } catch (...) {
+    tbl->mark_dropped();
+    delete tbl;
+    throw;
+  }
+  enforce_memory_limit();
+  wait_durable(lsn);
+}
+
+void Server::drop_table(const std::string &name)
+{
+  remove_table(name, false);
+}
+
+void Server::truncate_table(const std::string &name)
+{
+  remove_table(name, true);
+}
+
+void Server::remove_table(const std::string &name, bool recreate)
+{
+  // Wait for work in progress on the table (such as a transaction
+  // that read from it) to finish. Tables are only removed while
+  // locked, so once it is locked and not dropped, it is still in the
+  // registry. Only the caller waits; the registry stays available.
+  LockManager::Owner owner;
+  Table *tbl;
+  while (true) {
+    tbl = find_table(name);
+    if (!tbl) {
+      throw OperationException("No such table");
+    }
+    m_locks.lock_table(&owner, tbl, LockManager::EXCLUSIVE);
+    if (!tbl->is_dropped()) {
+      break;
+    }
+    m_locks.release_all(&owner); // Removed while we waited, so look it up again
+  }
+
+  uint64_t lsn = 0;
+  {
+    Guard g(m_tables_mutex);
+
+    // Logged while the table is locked, after every commit to it, and
+    // with the registry locked, so checkpoints see it logged and applied
+    // together
+    lsn = log_record(LogRecord{recreate ? LogRecord::TRUNCATE_TABLE : LogRecord::DROP_TABLE, name, {}});
+
+    const TableMap *current = m_tables.load(std::memory_order_relaxed);
+    TableMap *updated = new TableMap(*current);
+    if (recreate) {
+      (*updated)[name] = new_table(name);
+    } else {
+      updated->erase(name);
+    }
+    m_tables.store(updated, std::memory_order_release);
+    m_tables_generation.fetch_add(1, std::memory_order_release);
+    m_epochs.retire([current]() { delete current; });
   }
-  Table *t = new Table(name);
-  m_tables[name] = t;
+
+  // Background threads only take the latch
+  tbl->lock();
+  tbl->mark_dropped();
+  tbl->unlock();
+  m_locks.release_all(&owner);
+  m_epochs.retire([tbl]() { delete tbl; });
+  wait_durable(lsn);
 }
 
 Table *Server::find_table(const std::string &name)
 {
-  auto it = m_tables.find(name);
-  if (it == m_tables.end()) {
+  const TableMap *tables = m_tables.load(std::memory_order_acquire);
+  auto it = tables->find(name);
+  if (it == tables->end()) {
     return nullptr;
   }
   return it->second;
 }
+
+uint64_t Server::log_commit(const WriteSet &changes)
+{
+  if ((!m_log && !m_feed.has_subscribers()) || changes.is_empty()) {
+    return 0;
+  }
+  LogRecord record{LogRecord::COMMIT, "", {}};
+  for (const auto &entry : changes) {
+    record.changes.emplace_back(entry.first->get_name(), entry.second);
+  }
+  try {
+    return log_record(record);
+  } catch (StorageException &ex) {
+    // Nothing was applied yet, so the commit just fails
+    throw OperationException(ex.what());
+  }
+}
+
+uint64_t Server::log_record(const LogRecord &record)
+{
+  uint64_t lsn = m_log ? m_log->append(record) : 0;
+  m_feed.publish(record);
+  return lsn;
+}
+
+ReplicationFeed::Subscriber *Server::subscribe_replica()
+{
+  Guard g(m_tables_mutex);
+  return m_feed.subscribe();
+}
+
+void Server::wait_durable(uint64_t lsn)
+{
+  if (lsn != 0 && !m_log->wait_durable(lsn)) {
+    log_error("Could not write to commit log " + m_options.log_path);
+    throw OperationException("Could not write to commit log");
+  }
+}
+
+void Server::enforce_memory_limit()
+{
+  size_t limit = m_options.memory_limit;
+  if (limit == 0 || m_memory_used.load(std::memory_order_relaxed) <= limit) {
+    return;
+  }
+
+  // Evict from the largest tables first
+  const TableMap *tables = m_tables.load(std::memory_order_acquire);
+  std::vector<Table*> candidates;
+  for (auto &pair : *tables) {
+    candidates.push_back(pair.second);
+  }
+  std::sort(candidates.begin(), candidates.end(), [](Table *a, Table *b) {
+    return a->get_memory_used() > b->get_memory_used();
+  });
+
+  for (Table *tbl : candidates) {
+    size_t used;
+    while ((used = m_memory_used.load(std::memory_order_relaxed)) > limit && evict_keys(tbl, used - limit)) {
+    }
+    if (m_memory_used.load(std::memory_order_relaxed) <= limit) {
+      break;
+    }
+  }
+}
+
+bool Server::evict_keys(Table *tbl, size_t excess)
+{
+  // Choose keys no one has locked, enough to free excess bytes (or
+  // EVICTION_BATCH of them)
+  if (!tbl->trylock()) {
+    return false;
+  }
+  if (tbl->is_dropped()) {
+    tbl->unlock(); // Already uncounted, and about to be freed
+    return false;
+  }
+  std::set<std::string> victims;
+  auto in_use = [this, tbl, &victims](const std::string &key) {
+    return victims.count(key) > 0 || m_locks.is_locked(tbl, key);
+  };
+  size_t freed = 0;
+  std::string key;
+  while (freed < excess && victims.size() < EVICTION_BATCH) {
+    size_t size = tbl->choose_victim(key, in_use);
+    if (size == 0) {
+      break;
+    }
+    victims.insert(key);
+    freed += size;
+  }
+  tbl->unlock();
+
+  // Evicting a key deletes it, committed like any other change: with
+  // the key locked (skipping any locked meanwhile), stamped, and logged
+  // before it's applied. So snapshots still see it, and checkpoints,
+  // the log and replicas all agree that it's gone. The deletion isn't
+  // waited for to be durable; if it's lost, the key just comes back.
+  LockManager::Owner owner;
+  WriteSet deletions;
+  for (const std::string &key : victims) {
+    if (m_locks.try_lock_key(&owner, tbl, key, LockManager::EXCLUSIVE)) {
+      deletions.set(tbl, key, "");
+    }
+  }
+  bool evicted = false;
+  const WriteSet::Changes *changes = deletions.get_changes(tbl);
+  if (changes) {
+    tbl->lock();
+    bool dropped = tbl->is_dropped(); // Can't be dropped now, while it's locked
+    tbl->unlock();
+    if (!dropped) {
+      try {
+        CommitGuard commit(m_commits);
+        log_commit(deletions);
+        tbl->lock();
+        tbl->commit_changes(*changes, commit.get());
+        tbl->unlock();
+        m_evictions.fetch_add(changes->size(), std::memory_order_relaxed);
+        evicted = true;
+      } catch (OperationException &ex) {
+        log_error(ex.what());
+      }
+    }
+  }
+  m_locks.release_all(&owner);
+  return evicted;
+}
+
+std::string Server::get_stats()
+{
+  std::ostringstream oss;
+  oss << "tables=" << m_tables.load(std::memory_order_acquire)->size()
+      << " memory_used=" << m_memory_used.load(std::memory_order_relaxed)
+      << " memory_limit=" << m_options.memory_limit
+      << " evictions=" << m_evictions.load(std::memory_order_relaxed)
+      << " expired=" << m_expired.load(std::memory_order_relaxed)
+      << " deadlocks=" << m_locks.get_deadlocks()
+      << " lock_timeouts=" << m_locks.get_timeouts()
+      << " wounds=" << m_locks.get_wounds()
+      << " retries=" << m_retries.load(std::memory_order_relaxed)
+      << " log_syncs=" << (m_log ? m_log->get_syncs() : 0)
+      << " checkpoints=" << m_checkpoints.load(std::memory_order_relaxed)
+      << " checkpoint_merges=" << m_merges.load(std::memory_order_relaxed)
+      << " compactions=" << m_compactions.load(std::memory_order_relaxed)
+      << " replicas=" << m_feed.get_subscribers()
+      << " replication_backlog=" << m_feed.get_backlog();
+  if (m_replica) {
+    oss << " replica_synced=" << (m_replica->is_synced() ? 1 : 0)
+        << " replication_lag_ms=" << m_replica->get_lag_ms()
+        << " replicated=" << m_replica->get_applied()
+        << " replica_syncs=" << m_replica->get_syncs();
+  }
+  return oss.str();
+}
@@ -2,26 +2,173 @@
 #define SERVER_H
 
 #include <map>
+#include <vector>
 #include <string>
+#include <atomic>
 #include <pthread.h>
 #include "table.h"
+#include "key_dictionary.h"
+#include "epoch_manager.h"
+#include "lock_manager.h"
+#include "commit_clock.h"
+#include "commit_log.h"
+#include "checkpoint.h"
+#include "replication.h"
 
 class ClientConnection; // forward declaration
 
+// Settings chosen on the server command line
+struct ServerOptions {
+  bool share_keys;     // Intern keys in one dictionary shared by all tables
+  size_t memory_limit; // Evict committed keys beyond this many bytes (0 = no limit)
+  unsigned lock_timeout_ms; // Longest a request waits for a table lock
+  unsigned txn_retries;     // Times a RETRY transaction is replayed after a conflict
+  std::string log_path;     // Commit log files' base name (empty = no log, nothing is durable)
+  CommitLog::SyncPolicy log_sync; // When the commit log is synced to disk
+  unsigned log_sync_interval_ms;  // How often, for SYNC_INTERVAL
+  unsigned checkpoint_interval_s; // Seconds between checkpoints (0 = only on request)
+  unsigned recovery_threads;      // Threads replaying the commit log (0 = one per CPU)
+  bool compact_log;               // Compact the commit log in the background
+  size_t compact_rate;            // Bytes a second compaction reads and writes (0 = no limit)
+  size_t log_segment_bytes;       // Size at which compaction starts a new segment
+  std::string primary;            // Replicate this primary (host:port), serving reads only (empty = none)
+
+  ServerOptions()
+    : share_keys(false)
+    , memory_limit(0)
+    , lock_timeout_ms(1000)
+    , txn_retries(5)
+    , log_sync(CommitLog::SYNC_ALWAYS)
+    , log_sync_interval_ms(100)
+    , checkpoint_interval_s(0)
+    , recovery_threads(0)
+    , compact_log(false)
+    , compact_rate(4 << 20)
+    , log_segment_bytes(64 << 20)
+  { }
+};
+
 class Server {
+public:
+  typedef std::map<std::string, Table*> TableMap;
+
 private:
   int m_listenfd; // Listening socket file descriptor
-  pthread_mutex_t m_tables_mutex; // Mutex for m_tables map
-  std::map<std::string, Table*> m_tables;
+  ServerOptions m_options;
+  KeyDictionary *m_keys; // Server-wide key dictionary (null if not sharing keys)
+
+  // The table registry is copy-on-write: m_tables points to an immutable
+  // snapshot, so lookups just load the pointer and search it. Changes
+  // (serialized by m_tables_mutex) copy the map and publish the copy.
+  // Replaced snapshots and dropped tables may still be in use by
+  // readers, so they are retired to m_epochs, and freed by the reclaim
+  // thread once no thread is pinned at an epoch that could see them.
+  std::atomic<const TableMap*> m_tables;
+  pthread_mutex_t m_tables_mutex; // Serializes changes to the registry
+  EpochManager m_epochs;
+
+  LockManager m_locks; // Table locks held by transactions
+  CommitClock m_commits; // Timestamps commits, for read-only snapshots
+  CommitLog *m_log;      // Write-ahead log (null if not configured)
+  // The full checkpoint, then its deltas, mapped at startup. Tables
+  // may use their rows as base data.
+  std::vector<Checkpoint *> m_checkpoint_files;
+  pthread_mutex_t m_checkpoint_mutex; // Serializes checkpoints and log compaction
+  bool m_have_full_checkpoint;        // Later checkpoints can be deltas
+  std::vector<unsigned long> m_deltas; // Delta checkpoints since the full one, by first log segment
+  std::atomic<unsigned long> m_checkpoints; // Checkpoints written (full or delta)
+  std::atomic<unsigned long> m_merges;      // Times deltas were merged into the full checkpoint
+  std::atomic<unsigned long> m_compactions; // Log compactions finished
+
+  ReplicationFeed m_feed; // Records streamed to replicas of this server
+  Replica *m_replica;     // Only if this server is a replica
+
+  // Incremented (after the new snapshot is published) whenever the
+  // registry changes, so cached lookups can be validated cheaply
+  std::atomic<unsigned long> m_tables_generation;
+
+  std::atomic<size_t> m_memory_used;      // Sum of all tables' memory use
+  std::atomic<unsigned long> m_evictions; // Keys evicted to honor the memory limit
+  std::atomic<unsigned long> m_expired;   // Keys removed by the expiry thread
+  std::atomic<unsigned long> m_retries;   // Transactions replayed after a conflict
+
+  // Background threads reclaiming expired keys (a small batch at a
+  // time) and retired tables
+  pthread_t m_expiry_thread;
+  pthread_t m_reclaim_thread;
+  pthread_t m_checkpoint_thread; // Only with a log
+  pthread_t m_compact_thread;    // Only with log compaction
+  bool m_background_started;
+  bool m_checkpoint_started;
+  bool m_compact_started;
+  std::atomic<bool> m_stopping;
+
+  static void *expiry_worker(void *arg);
+  static void *reclaim_worker(void *arg);
+  static void *checkpoint_worker(void *arg);
+  static void *compact_worker(void *arg);
+  void expire_keys();
+  void reclaim_retired();
+  void checkpoint_periodically();
+  void compact_periodically();
+
+  // The full checkpoint's file, and each delta's (named by the first
+  // log segment it doesn't cover)
+  std::string checkpoint_path() const { return m_options.log_path + ".snapshot"; }
+  std::string delta_path(unsigned long segment) const;
+
+  // Apply a delta checkpoint's changes to the tables, at startup
+  void apply_delta(TableMap *tables, const Checkpoint &delta);
+
+  // Save a table to writer as of a snapshot: all of it, or (if keys
+  // isn't null) only the keys given
+  void write_table(CheckpointWriter &writer, const std::string &name, Table *tbl, uint64_t snapshot,
+                   const std::vector<std::string> *keys);
+
+  // Merge the deltas into a new full checkpoint, if there are
+  // MAX_DELTAS of them. Logs any error.
+  void merge_deltas();
+
+  // Unlink a table from the registry, replacing it with an empty
+  // table if recreate is true
+  void remove_table(const std::string &name, bool recreate);
+
+  // Evict keys from tbl (enough to free excess bytes, or at most
+  // EVICTION_BATCH), returning false if none could be
+  bool evict_keys(Table *tbl, size_t excess);
+
+  // Append a record to the commit log (if any), returning its sequence
+  // number (or 0), and stream it to replicas
+  uint64_t log_record(const LogRecord &record);
 
   // copy constructor and assignment operator are prohibited
   Server( const Server & );
   Server &operator=( const Server & );
 
 public:
-  Server();
+  Server(const ServerOptions &options = ServerOptions());
   ~Server();
 
+  // Map the latest checkpoint and open the commit log (if one is
+  // configured), restoring the tables and data they record. Throws
+  // StorageException if they can't be used.
+  void recover();
+
+  // Save every table's committed data, as of one moment, to a
+  // checkpoint file, then remove the log segments it makes redundant.
+  // Once there is a full checkpoint, later ones are deltas: they save
+  // only the keys changed since the last checkpoint (and in full, tables
+  // created or truncated since). Clients keep running meanwhile: tables
+  // are read through a snapshot, a batch of keys at a time. Throws
+  // OperationException if there is no log, or the checkpoint couldn't
+  // be written.
+  void checkpoint();
+
+  // Start a new log segment, then compact the earlier ones (see
+  // CommitLog::compact), at the configured rate. Checkpoints wait
+  // meanwhile. Logs any error.
+  void compact_log();
+
   // Start listening on the specified port
   void listen(const std::string &port);
 
@@ -35,11 +182,92 @@ public:
   // Create a table with the given name. Throws OperationException if exists.
   void create_table(const std::string &name);
 
-  // Find a table by name (caller must hold m_tables_mutex)
+  // A new, empty table, tracking its dirty keys if there is a log. It
+  // isn't in the registry, so only the caller uses it.
+  Table *new_table(const std::string &name);
+
+  // Add a table built by the caller (from new_table) to the registry
+  // under the given name, logging it with its rows. Takes ownership of
+  // the table, deleting it if it can't be added. Throws
+  // OperationException if a table with the name already exists.
+  void restore_table(const std::string &name, Table *tbl);
+
+  // Remove a table. Its memory is freed in the background once no
+  // connection can still be using it. Throws OperationException if
+  // there is no such table.
+  void drop_table(const std::string &name);
+
+  // Remove every key from a table, by replacing it with a new table
+  void truncate_table(const std::string &name);
+
+  // Find a table by name, returning null if there is no such table.
+  // Wait-free: no lock is taken. The caller must be pinned in the
+  // epoch manager for as long as it uses the returned table.
   Table *find_table(const std::string &name);
 
-  void lock_tables_map() { pthread_mutex_lock(&m_tables_mutex); }
-  void unlock_tables_map() { pthread_mutex_unlock(&m_tables_mutex); }
+  // The current registry snapshot, with the same requirement
+  const TableMap *get_table_map() const { return m_tables.load(std::memory_order_acquire); }
+
+  // Threads (such as connections) that find tables register here
+  EpochManager &get_epochs() { return m_epochs; }
+
+  LockManager &get_locks() { return m_locks; }
+
+  CommitClock &get_commit_clock() { return m_commits; }
+
+  const ServerOptions &get_options() const { return m_options; }
+
+  // Append a record of committed changes to the commit log, returning
+  // its sequence number (0 if there is no log, or nothing changed), and
+  // stream it to replicas. Changes to a key must be logged in the order
+  // they are applied. Throws OperationException if the log can't take
+  // the record, so the commit fails before anything is applied.
+  uint64_t log_commit(const WriteSet &changes);
+
+  // Start streaming logged records to a replica. Taken with the registry
+  // locked, so each table change is either in the registry as the
+  // replica's snapshot reads it, or streamed.
+  ReplicationFeed::Subscriber *subscribe_replica();
+  void unsubscribe_replica(ReplicationFeed::Subscriber *subscriber) { m_feed.unsubscribe(subscriber); }
+  bool take_replicated(ReplicationFeed::Subscriber *subscriber, std::string &out) { return m_feed.take(subscriber, out); }
+
+  // A replica's clients may only read
+  bool is_replica() const { return !m_options.primary.empty(); }
+
+  // Wait until a logged commit is durable (as the sync policy defines
+  // it). Throws OperationException if it couldn't be written.
+  void wait_durable(uint64_t lsn);
+
+  void count_retry() { m_retries.fetch_add(1, std::memory_order_relaxed); }
+
+  // Current registry generation. A Table* found after reading
+  // generation g remains valid as long as the generation is still g.
+  unsigned long get_tables_generation() const { return m_tables_generation.load(std::memory_order_acquire); }
+
+  // If the memory limit is exceeded, evict committed keys until it isn't
+  // (or nothing more can be evicted). Keys transactions have locked or
+  // pinned are never evicted. Evicting a key deletes it, as a commit would. The
+  // caller must not hold any table locks.
+  void enforce_memory_limit();
+
+  // Server counters, as space-separated name=value pairs
+  std::string get_stats();
+
+  // Most expired keys the expiry thread removes from a table per lock hold
+  static const unsigned EXPIRY_BATCH = 64;
+
+  // How often retired tables and registry snapshots are checked
+  static const unsigned RECLAIM_INTERVAL_MS = 10;
+
+  // Most keys evicted by one commit
+  static const unsigned EVICTION_BATCH = 64;
+
+  // Most keys a checkpoint reads from a table per latch hold
+  static const unsigned CHECKPOINT_BATCH = 1024;
+
+  // Delta checkpoints written before the checkpoint thread merges them
+  // into the full one (recovery applies each in turn)
+  static const unsigned MAX_DELTAS = 8;
 };
 
 #endif // SERVER_H
@@ -1,18 +1,177 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include "server.h"
+#include "exceptions.h"
+
+static void usage()
+{
+  std::cerr << "Usage: ./server [-k] [-m <bytes>] [-t <ms>] [-r <n>] [-l <file> [-s <sync>] [-p <sec>] [-j <n>] [-c <bytes>] [-g <bytes>]] [-R <host:port>] <port>\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -k          intern keys in a dictionary shared by all tables\n";
+  std::cerr << "  -m <bytes>  memory limit (suffix K, M, or G allowed); least\n";
+  std::cerr << "              recently used keys are evicted beyond it\n";
+  std::cerr << "  -t <ms>     longest time to wait for a table lock (default 1000)\n";
+  std::cerr << "  -r <n>      times a BEGIN RETRY transaction is replayed after a\n";
+  std::cerr << "              conflict before it fails (default 5)\n";
+  std::cerr << "  -l <file>   commit log (files <file>.NNNNNN, with checkpoints saved to\n";
+  std::cerr << "              <file>.snapshot), replayed when the server starts\n";
+  std::cerr << "  -s <sync>   when the commit log is synced: \"always\" (before a\n";
+  std::cerr << "              commit succeeds, the default), every <ms> milliseconds,\n";
+  std::cerr << "              or \"never\" (left to the OS)\n";
+  std::cerr << "  -p <sec>    write a checkpoint every <sec> seconds (as well as on\n";
+  std::cerr << "              SNAPSHOT), so older log files can be removed\n";
+  std::cerr << "  -j <n>      threads replaying the commit log at startup (default:\n";
+  std::cerr << "              one per CPU)\n";
+  std::cerr << "  -c <bytes>  compact the commit log in the background, reading and\n";
+  std::cerr << "              writing at most <bytes> a second (0 = no limit)\n";
+  std::cerr << "  -g <bytes>  with -c, size at which the log starts a new file and\n";
+  std::cerr << "              compacts the earlier ones (default 64M)\n";
+  std::cerr << "  -R <host:port>  run as a read-only replica of the server at\n";
+  std::cerr << "              <host:port>, copying its tables as they change\n";
+}
+
+// Parse a byte count such as 512, 64K, 100M, or 2G. Returns false if invalid.
+static bool parse_size( const char *s, size_t &size )
+{
+  char *end;
+  unsigned long long n = std::strtoull( s, &end, 10 );
+  if ( end == s ) {
+    return false;
+  }
+  switch ( *end ) {
+  case 'G': case 'g': n *= 1024; // fall through
+  case 'M': case 'm': n *= 1024; // fall through
+  case 'K': case 'k': n *= 1024; end++; break;
+  default: break;
+  }
+  if ( *end != '\0' ) {
+    return false;
+  }
+  size = n;
+  return true;
+}
 
 int main(int argc, char **argv)
 {
-  if ( argc != 2 ) {
-    std::cerr << "Usage: ./server <port>\n";
+  ServerOptions options;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "km:t:r:l:s:p:j:c:g:R:" )) != -1 ) {
+    switch ( opt ) {
+    case 'k':
+      options.share_keys = true;
+      break;
+    case 'm':
+      if ( !parse_size( optarg, options.memory_limit ) ) {
+        usage();
+        return 1;
+      }
+      break;
+    case 't':
+      {
+        char *end;
+        unsigned long ms = std::strtoul( optarg, &end, 10 );
+        if ( end == optarg || *end != '\0' ) {
+          usage();
+          return 1;
+        }
+        options.lock_timeout_ms = ms;
+      }
+      break;
+    case 'r':
+      {
+        char *end;
+        unsigned long n = std::strtoul( optarg, &end, 10 );
+        if ( end == optarg || *end != '\0' ) {
+          usage();
+          return 1;
+        }
+        options.txn_retries = n;
+      }
+      break;
+    case 'l':
+      options.log_path = optarg;
+      break;
+    case 's':
+      if ( std::strcmp( optarg, "always" ) == 0 ) {
+        options.log_sync = CommitLog::SYNC_ALWAYS;
+      } else if ( std::strcmp( optarg, "never" ) == 0 ) {
+        options.log_sync = CommitLog::SYNC_NEVER;
+      } else {
+        char *end;
+        unsigned long ms = std::strtoul( optarg, &end, 10 );
+        if ( end == optarg || *end != '\0' || ms == 0 ) {
+          usage();
+          return 1;
+        }
+        options.log_sync = CommitLog::SYNC_INTERVAL;
+        options.log_sync_interval_ms = ms;
+      }
+      break;
+    case 'p':
+      {
+        char *end;
+        unsigned long seconds = std::strtoul( optarg, &end, 10 );
+        if ( end == optarg || *end != '\0' || seconds == 0 ) {
+          usage();
+          return 1;
+        }
+        options.checkpoint_interval_s = seconds;
+      }
+      break;
+    case 'j':
+      {
+        char *end;
+        unsigned long n = std::strtoul( optarg, &end, 10 );
+        if ( end == optarg || *end != '\0' || n == 0 ) {
+          usage();
+          return 1;
+        }
+        options.recovery_threads = n;
+      }
+      break;
+    case 'c':
+      if ( !parse_size( optarg, options.compact_rate ) ) {
+        usage();
+        return 1;
+      }
+      options.compact_log = true;
+      break;
+    case 'g':
+      if ( !parse_size( optarg, options.log_segment_bytes ) || options.log_segment_bytes == 0 ) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'R':
+      if ( std::strchr( optarg, ':' ) == nullptr ) {
+        usage();
+        return 1;
+      }
+      options.primary = optarg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if ( optind != argc - 1 ) {
+    usage();
     return 1;
   }
 
-  Server server;
+  Server server( options );
 
   try {
-    server.listen( argv[1] );
+    server.recover();
+    server.listen( argv[optind] );
     server.server_loop();
+  } catch ( StorageException &ex ) {
+    server.log_error( ex.what() );
+    return 1;
   } catch ( std::runtime_error &ex ) {
     server.log_error( "Fatal error starting server" );
     return 1;
@@ -1,21 +1,162 @@
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <ctime>
 #include "table.h"
 #include "exceptions.h"
 #include "guard.h"
 
-Table::Table(const std::string &name)
+// Rough per-entry cost of the hash map node, ordered index node,
+// and string headers, on top of the key and value characters
+static const size_t ENTRY_OVERHEAD = 128;
+
+Table::Table(const std::string &name, KeyDictionary *keys, std::atomic<size_t> *total_memory,
+             const MappedTable &base)
     : m_name(name)
+    , m_keys(keys)
     , m_final_data()
-    , m_tentative_data()
+    , m_ordered_keys()
+    , m_memory_used(0)
+    , m_total_memory(total_memory)
+    , m_random_seed(std::hash<std::string>()(name))
+    , m_expiry_wheel(EXPIRY_TICK_MS, wall_time_ms())
+    , m_dropped(false)
+    , m_next_version(BASE_VERSION + 1)
+    , m_base(base)
+    , m_shadowed(base.size(), false)
+    , m_track_dirty(false)
+    , m_checkpointed(false)
 {
     pthread_mutex_init(&m_mutex, nullptr); // Initialize the mutex
 }
 
 Table::~Table()
 {
+    // Give back key references (a shared dictionary outlives us)
+    for (const auto &entry : m_final_data) {
+        drop_key(entry.first);
+    }
+    for (const auto &entry : m_history) {
+        drop_key(entry.first);
+    }
+    std::vector<TimingWheel::Item> items;
+    m_expiry_wheel.drain(items);
+    for (const auto &item : items) {
+        drop_key(item.key);
+    }
+    adjust_memory(0, m_memory_used);
     pthread_mutex_destroy(&m_mutex); // Destroy the mutex
 }
 
+size_t Table::entry_size(const std::string &key, const std::string &value)
+{
+    return key.size() + value.size() + ENTRY_OVERHEAD;
+}
+
+uint64_t Table::wall_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t Table::coarse_time_ms()
+{
+    // The coarse clock is cheap to read and precise enough for LRU
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void Table::adjust_memory(size_t added, size_t removed)
+{
+    m_memory_used.store(m_memory_used.load(std::memory_order_relaxed) + added - removed,
+                        std::memory_order_relaxed);
+    if (m_total_memory) {
+        m_total_memory->fetch_add(added - removed, std::memory_order_relaxed);
+    }
+}
+
+// A reference to key, owned by the caller: interned in the shared
+// dictionary, or else a private copy (since only this table uses it,
+// sharing it between the table's own indexes would save little)
+KeyId Table::hold_key(const std::string &key)
+{
+    return m_keys ? m_keys->intern(key) : new std::string(key);
+}
+
+void Table::drop_key(KeyId id)
+{
+    if (m_keys) {
+        m_keys->release(id);
+    } else {
+        delete id;
+    }
+}
+
+void Table::remove(DataMap::iterator it)
+{
+    KeyId id = it->first;
+    adjust_memory(0, entry_size(*id, it->second.value));
+    m_ordered_keys.erase(id);
+    m_final_data.erase(it);
+    drop_key(id);
+}
+
+void Table::keep_old_version(KeyId id, const Entry &entry, uint64_t superseded_at)
+{
+    auto hist = m_history.find(id);
+    if (hist == m_history.end()) {
+        KeyId held = hold_key(*id); // Owned by the history entry
+        hist = m_history.emplace(held, std::vector<OldVersion>()).first;
+        m_history_keys.insert(held);
+    }
+    hist->second.push_back(OldVersion{entry.value, entry.expires_at, entry.committed_at, superseded_at});
+}
+
+// Index of the base row holding key's current value, or npos if there
+// is none (no row has the key, or it was superseded, or it expired)
+size_t Table::find_base(const std::string &key, uint64_t now) const
+{
+    if (m_base.size() == 0) {
+        return MappedTable::npos;
+    }
+    size_t i = m_base.find(key);
+    return (i != MappedTable::npos && base_row_live(i, now)) ? i : MappedTable::npos;
+}
+
+// Supersede key's base row (if it has one) with a change being
+// committed. The row is kept as history if snapshots may need it.
+void Table::shadow_base(const std::string &key, const CommitClock::Commit &commit)
+{
+    if (m_base.size() == 0) {
+        return;
+    }
+    size_t i = m_base.find(key);
+    if (i == MappedTable::npos || m_shadowed[i]) {
+        return;
+    }
+    m_shadowed[i] = true;
+    if (commit.keep_history) {
+        keep_old_version(&key, Entry{m_base.value(i), 0, m_base.expires_at(i), BASE_VERSION, 0}, commit.ts);
+    }
+}
+
+void Table::mark_dirty(const std::string &key, uint64_t ts)
+{
+    uint64_t &dirty_ts = m_dirty[key];
+    dirty_ts = std::max(dirty_ts, ts);
+}
+
+void Table::mark_dropped()
+{
+    m_dropped = true;
+    if (m_total_memory) {
+        m_total_memory->fetch_sub(m_memory_used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m_total_memory = nullptr;
+    }
+}
+
 void Table::lock()
 {
     pthread_mutex_lock(&m_mutex); // Lock the mutex
@@ -31,45 +172,401 @@ bool Table::trylock()
     return pthread_mutex_trylock(&m_mutex) == 0; // Try to lock and return success status
 }
 
-void Table::set(const std::string &key, const std::string &value)
+void Table::set(const std::string &key, const std::string &value, uint64_t expires_at,
+               const CommitClock::Commit &commit)
+{
+    if (m_track_dirty) {
+        mark_dirty(key, commit.ts);
+    }
+    auto it = m_final_data.find(&key);
+    if (value.empty()) {
+        // Remove key if value is empty
+        if (it != m_final_data.end()) {
+            if (commit.keep_history) {
+                keep_old_version(it->first, it->second, commit.ts);
+            }
+            remove(it);
+            return; // (The base row, if any, is already shadowed)
+        }
+        shadow_base(key, commit);
+        return;
+    }
+
+    uint64_t version = m_next_version++;
+    KeyId id;
+    if (it != m_final_data.end()) {
+        // Setting a value replaces any earlier expiry time
+        Entry &entry = it->second;
+        if (commit.keep_history) {
+            keep_old_version(it->first, entry, commit.ts);
+        }
+        entry.committed_at = commit.ts;
+        adjust_memory(value.size(), entry.value.size());
+        entry.value = value;
+        entry.last_access = coarse_time_ms();
+        entry.expires_at = expires_at;
+        entry.version = version;
+        id = it->first;
+    } else {
+        shadow_base(key, commit);
+        id = hold_key(key); // Owned by the map entry
+        m_final_data.emplace(id, Entry{value, coarse_time_ms(), expires_at, version, commit.ts});
+        adjust_memory(entry_size(key, value), 0);
+        m_ordered_keys.insert(id);
+    }
+
+    if (expires_at != 0) {
+        m_expiry_wheel.schedule(hold_key(*id), expires_at); // Owned by the wheel entry
+    }
+}
+
+void Table::load(const WriteSet::Changes &rows)
 {
-    // Set a key-value pair in tentative data
-    m_tentative_data[key] = value;
+    uint64_t now = wall_time_ms();
+    uint64_t access = coarse_time_ms();
+    size_t added = 0;
+    m_final_data.reserve(m_final_data.size() + rows.size());
+    for (const auto &row : rows) {
+        const std::string &key = row.first;
+        const WriteSet::Change &change = row.second;
+        if (change.value.empty() || (change.expires_at != 0 && change.expires_at <= now)) {
+            continue;
+        }
+        if (m_base.size() > 0 || (!m_ordered_keys.empty() && key <= **m_ordered_keys.rbegin())) {
+            set(key, change.value, change.expires_at);
+            continue;
+        }
+
+        // A new key, and the last in order, so the index only grows at its end
+        KeyId id = hold_key(key);
+        m_final_data.emplace(id, Entry{change.value, access, change.expires_at, m_next_version++, 0});
+        m_ordered_keys.emplace_hint(m_ordered_keys.end(), id);
+        added += entry_size(key, change.value);
+        if (change.expires_at != 0) {
+            m_expiry_wheel.schedule(hold_key(key), change.expires_at); // Owned by the wheel entry
+        }
+    }
+    adjust_memory(added, 0);
 }
 
 std::string Table::get(const std::string &key)
 {
-    // Retrieve value from tentative data if it exists, otherwise from final data
-    if (m_tentative_data.count(key)) {
-        return m_tentative_data[key];
+    auto it = m_final_data.find(&key);
+    if (it != m_final_data.end()) {
+        if (is_expired(it->second, wall_time_ms())) {
+            remove(it); // Reclaim lazily
+        } else {
+            it->second.last_access = coarse_time_ms();
+            return it->second.value;
+        }
     }
-    if (m_final_data.count(key)) {
-        return m_final_data[key];
+    size_t i = find_base(key, wall_time_ms());
+    if (i != MappedTable::npos) {
+        return m_base.value(i);
     }
     throw OperationException("Key does not exist: " + key);
 }
 
 bool Table::has_key(const std::string &key)
 {
-    // Check if the key exists in either tentative or final data
-    return m_tentative_data.count(key) || m_final_data.count(key);
+    uint64_t now = wall_time_ms();
+    auto it = m_final_data.find(&key);
+    if (it != m_final_data.end()) {
+        return !is_expired(it->second, now);
+    }
+    return find_base(key, now) != MappedTable::npos;
+}
+
+uint64_t Table::get_version(const std::string &key)
+{
+    uint64_t now = wall_time_ms();
+    auto it = m_final_data.find(&key);
+    if (it != m_final_data.end()) {
+        return is_expired(it->second, now) ? 0 : it->second.version;
+    }
+    return find_base(key, now) != MappedTable::npos ? BASE_VERSION : 0;
+}
+
+void Table::commit_changes(const WriteSet::Changes &changes, const CommitClock::Commit &commit)
+{
+    // Apply a transaction's buffered changes to the committed data
+    for (const auto &entry : changes) {
+        set(entry.first, entry.second.value, entry.second.expires_at, commit);
+    }
+}
+
+// Find the version of a key visible to a snapshot: its latest version
+// committed at or before the snapshot's timestamp. Returns false if
+// there is none, or it has expired. (A key with no such entry may still
+// have a base row; every key found here has had its base row shadowed.)
+bool Table::find_version(KeyId id, uint64_t snapshot, WriteSet::Change &version)
+{
+    uint64_t now = wall_time_ms();
+    auto it = m_final_data.find(id);
+    if (it != m_final_data.end() && it->second.committed_at <= snapshot) {
+        if (is_expired(it->second, now)) {
+            return false;
+        }
+        version = WriteSet::Change{it->second.value, it->second.expires_at};
+        return true;
+    }
+
+    // Changed since the snapshot, so look for the version it saw
+    auto hist = m_history.find(id);
+    if (hist != m_history.end()) {
+        for (auto v = hist->second.rbegin(); v != hist->second.rend(); ++v) {
+            if (v->committed_at <= snapshot && snapshot < v->superseded_at) {
+                if (v->expires_at != 0 && v->expires_at <= now) {
+                    return false;
+                }
+                version = WriteSet::Change{v->value, v->expires_at};
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::string Table::get_at(const std::string &key, uint64_t snapshot)
+{
+    WriteSet::Change row;
+    if (!find_at(key, snapshot, row)) {
+        throw OperationException("Key does not exist: " + key);
+    }
+    return row.value;
+}
+
+bool Table::find_at(const std::string &key, uint64_t snapshot, WriteSet::Change &row)
+{
+    if (find_version(&key, snapshot, row)) {
+        return true;
+    }
+    // Base rows predate every snapshot
+    size_t i = find_base(key, wall_time_ms());
+    if (i == MappedTable::npos) {
+        return false;
+    }
+    row = WriteSet::Change{m_base.value(i), m_base.expires_at(i)};
+    return true;
+}
+
+bool Table::scan_at(const std::string &after, const std::string &prefix, uint64_t snapshot,
+                    unsigned max, WriteSet::Changes &rows)
+{
+    // Keys deleted since the snapshot are only in the history, so
+    // merge the two ordered indexes, and the base rows still current
+    // (whose keys are in neither). Start as scan does.
+    bool from_prefix = after.empty() || after < prefix;
+    auto cur = from_prefix ? m_ordered_keys.lower_bound(prefix) : m_ordered_keys.upper_bound(after);
+    auto old = from_prefix ? m_history_keys.lower_bound(prefix) : m_history_keys.upper_bound(after);
+    size_t base = from_prefix ? m_base.lower_bound(prefix) : m_base.upper_bound(after);
+    uint64_t now = wall_time_ms();
+    unsigned count = 0;
+    while (true) {
+        while (base < m_base.size() && !base_row_live(base, now)) {
+            base++;
+        }
+        bool in_memory = cur != m_ordered_keys.end() || old != m_history_keys.end();
+        if (base < m_base.size()) {
+            const std::string &next = (old == m_history_keys.end() || (cur != m_ordered_keys.end() && **cur <= **old))
+                ? **cur : **old;
+            if (!in_memory || m_base.compare(base, next) < 0) {
+                std::string key = m_base.key(base);
+                if (key.compare(0, prefix.size(), prefix) != 0) {
+                    return false; // Past the last key with the prefix
+                }
+                if (count == max) {
+                    return true;
+                }
+                rows[key] = WriteSet::Change{m_base.value(base), m_base.expires_at(base)};
+                count++;
+                base++;
+                continue;
+            }
+        }
+        if (!in_memory) {
+            return false;
+        }
+
+        KeyId id;
+        if (old == m_history_keys.end() || (cur != m_ordered_keys.end() && **cur <= **old)) {
+            id = *cur++;
+            if (old != m_history_keys.end() && **old == *id) {
+                ++old;
+            }
+        } else {
+            id = *old++;
+        }
+        if (id->compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+
+        WriteSet::Change version;
+        if (!find_version(id, snapshot, version)) {
+            continue;
+        }
+        if (count == max) {
+            return true;
+        }
+        rows[*id] = version;
+        count++;
+    }
+}
+
+void Table::prune_history(uint64_t horizon)
+{
+    for (auto it = m_history.begin(); it != m_history.end(); ) {
+        std::vector<OldVersion> &versions = it->second;
+        // Versions are superseded in order, so the prunable ones come first
+        auto keep = versions.begin();
+        while (keep != versions.end() && keep->superseded_at <= horizon) {
+            ++keep;
+        }
+        versions.erase(versions.begin(), keep);
+        if (versions.empty()) {
+            KeyId id = it->first;
+            it = m_history.erase(it);
+            m_history_keys.erase(id);
+            drop_key(id);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool Table::scan(const std::string &after, const std::string &prefix, unsigned max,
+                 std::vector<std::pair<std::string, std::string>> &rows)
+{
+    // Start at whichever comes later: the first key with the prefix,
+    // or the first key past the cursor
+    bool from_prefix = after.empty() || after < prefix;
+    auto it = from_prefix ? m_ordered_keys.lower_bound(prefix) : m_ordered_keys.upper_bound(after);
+    size_t base = from_prefix ? m_base.lower_bound(prefix) : m_base.upper_bound(after);
+
+    // Merge in the base rows still current (whose keys aren't in memory)
+    uint64_t now = wall_time_ms();
+    unsigned count = 0;
+    while (true) {
+        while (base < m_base.size() && !base_row_live(base, now)) {
+            base++;
+        }
+        std::string key;
+        std::string value;
+        if (base < m_base.size() && (it == m_ordered_keys.end() || m_base.compare(base, **it) < 0)) {
+            key = m_base.key(base);
+            if (key.compare(0, prefix.size(), prefix) != 0) {
+                return false; // Past the last key with the prefix
+            }
+            value = m_base.value(base++);
+        } else if (it != m_ordered_keys.end()) {
+            key = **it;
+            if (key.compare(0, prefix.size(), prefix) != 0) {
+                return false;
+            }
+            const Entry &entry = m_final_data[*it++];
+            if (is_expired(entry, now)) {
+                continue;
+            }
+            value = entry.value;
+        } else {
+            return false;
+        }
+        if (count == max) {
+            return true;
+        }
+        rows.emplace_back(key, value);
+        count++;
+    }
+}
+
+void Table::unpin_key(const std::string &key)
+{
+    auto it = m_pins.find(key);
+    assert(it != m_pins.end());
+    if (--it->second == 0) {
+        m_pins.erase(it);
+    }
+}
+
+size_t Table::choose_victim(std::string &key, const std::function<bool(const std::string &)> &in_use)
+{
+    if (m_final_data.empty()) {
+        return 0;
+    }
+
+    // Sample entries from randomly chosen hash buckets, and pick the
+    // one that was accessed least recently
+    DataMap::iterator victim = m_final_data.end();
+    unsigned sampled = 0;
+    unsigned probes = 0;
+    size_t nbuckets = m_final_data.bucket_count();
+    while (sampled < EVICTION_SAMPLES && probes < EVICTION_SAMPLES * 8) {
+        size_t bucket = rand_r(&m_random_seed) % nbuckets;
+        probes++;
+        for (auto local = m_final_data.begin(bucket); local != m_final_data.end(bucket); ++local) {
+            if (is_pinned(*local->first) || (in_use && in_use(*local->first))) {
+                continue;
+            }
+            if (victim == m_final_data.end() || local->second.last_access < victim->second.last_access) {
+                victim = m_final_data.find(local->first);
+            }
+            sampled++;
+        }
+    }
+    if (victim == m_final_data.end()) {
+        // Sparse table: no sampled bucket had entries we could use
+        auto it = m_final_data.begin();
+        for (unsigned n = 0; it != m_final_data.end() && n < EVICTION_SAMPLES * 8; ++it, ++n) {
+            if (!is_pinned(*it->first) && (!in_use || !in_use(*it->first))) {
+                victim = it;
+                break;
+            }
+        }
+        if (victim == m_final_data.end()) {
+            return 0;
+        }
+    }
+
+    key = *victim->first;
+    return entry_size(key, victim->second.value);
+}
+
+bool Table::remove_expired(unsigned max, unsigned &removed)
+{
+    uint64_t now = wall_time_ms();
+    std::vector<TimingWheel::Item> due;
+    bool more = m_expiry_wheel.expire(now, max, due);
+
+    removed = 0;
+    for (const auto &item : due) {
+        // Skip stale wheel entries: the key may have been deleted,
+        // or set again with a different expiry time (or none)
+        auto it = m_final_data.find(item.key);
+        if (it != m_final_data.end() && it->second.expires_at == item.expires_at) {
+            remove(it);
+            removed++;
+        }
+        drop_key(item.key);
+    }
+    return more;
 }
 
-void Table::commit_changes()
+void Table::take_dirty(uint64_t snapshot, std::vector<std::string> &keys)
 {
-    // Commit tentative changes to final data
-    for (const auto &entry : m_tentative_data) {
-        if (entry.second.empty()) {
-            m_final_data.erase(entry.first); // Remove key if value is empty
+    for (auto it = m_dirty.begin(); it != m_dirty.end(); ) {
+        if (it->second <= snapshot) {
+            keys.push_back(it->first);
+            it = m_dirty.erase(it);
         } else {
-            m_final_data[entry.first] = entry.second;
+            ++it;
         }
     }
-    m_tentative_data.clear(); // Clear tentative data after committing
+    std::sort(keys.begin(), keys.end());
 }
 
-void Table::rollback_changes()
+void Table::restore_dirty(const std::vector<std::string> &keys)
 {
-    // Discard all tentative changes
-    m_tentative_data.clear();
+    for (const std::string &key : keys) {
+        m_dirty.emplace(key, 0); // (Unless changed again since)
+    }
 }
@@ -1,38 +1,246 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include <map>
+#include <unordered_map>
+#include <set>
+#include <vector>
 #include <string>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <pthread.h>
+#include "key_dictionary.h"
+#include "write_set.h"
+#include "timing_wheel.h"
+#include "commit_clock.h"
+#include "checkpoint.h"
 
 class Table {
 private:
+  struct Entry {
+    std::string value;
+    uint64_t last_access; // Coarse time (ms) of the last write or GET
+    uint64_t expires_at;  // Wall clock time (ms) the key expires, or 0
+    uint64_t version;     // Changes every time the key is set
+    uint64_t committed_at; // Timestamp of the commit that set it
+  };
+
+  // A value that has been replaced or deleted, kept for snapshots
+  struct OldVersion {
+    std::string value;
+    uint64_t expires_at;
+    uint64_t committed_at;
+    uint64_t superseded_at; // Timestamp of the commit that replaced it
+  };
+
+  // Keys are stored as KeyIds, hashed and compared by the text of
+  // their keys, so a key is looked up by pointing a KeyId at a string
+  // holding it: no dictionary is involved. Every KeyId held in the map
+  // owns a reference to its key (see hold_key).
+  struct KeyHash {
+    size_t operator()(KeyId id) const { return std::hash<std::string>()(*id); }
+  };
+  struct KeyEqual {
+    bool operator()(KeyId a, KeyId b) const { return *a == *b; }
+  };
+  typedef std::unordered_map<KeyId, Entry, KeyHash, KeyEqual> DataMap;
+
+  // Orders KeyIds by the text of their keys. Transparent, so the
+  // ordered index can also be searched with a plain string.
+  struct KeyOrder {
+    typedef void is_transparent;
+    bool operator()(KeyId a, KeyId b) const { return *a < *b; }
+    bool operator()(KeyId a, const std::string &b) const { return *a < b; }
+    bool operator()(const std::string &a, KeyId b) const { return a < *b; }
+  };
+
   std::string m_name; // Table name
-  std::map<std::string, std::string> m_final_data;      // Committed data
-  std::map<std::string, std::string> m_tentative_data; // Tentative data (uncommitted changes)
+  KeyDictionary *m_keys; // Shared dictionary keys are interned in (null if keys are private)
+  DataMap m_final_data;  // Committed data
+  std::set<KeyId, KeyOrder> m_ordered_keys; // Keys of m_final_data in key order
   pthread_mutex_t m_mutex; // Mutex for synchronizing access to the table
 
+  // Estimated bytes used by committed data. Updated with the table
+  // locked, but readable at any time. Changes are also added to
+  // *m_total_memory (if non-null), which is shared by many tables.
+  std::atomic<size_t> m_memory_used;
+  std::atomic<size_t> *m_total_memory;
+  unsigned m_random_seed; // For sampling eviction candidates
+
+  // Deadlines of keys with a TTL. Each wheel entry owns a reference
+  // to its key, since it may outlive the table's own entry.
+  TimingWheel m_expiry_wheel;
+
+  bool m_dropped; // Removed from the server's registry
+
+  uint64_t m_next_version; // Version given to the next key set
+
+  // Replaced versions, oldest first, of keys that changed while
+  // snapshots were open. Each key here owns a reference to its key.
+  std::unordered_map<KeyId, std::vector<OldVersion>, KeyHash, KeyEqual> m_history;
+  std::set<KeyId, KeyOrder> m_history_keys; // Keys of m_history in key order
+
+  // Rows loaded from a checkpoint, read in place from the mapped file.
+  // Keys set or deleted since are shadowed: m_final_data (or nothing,
+  // if they were deleted) supersedes their rows. Rows aren't counted
+  // in the table's memory use, or evicted; the OS pages them in and out.
+  MappedTable m_base;
+  std::vector<bool> m_shadowed; // Base rows superseded, by index
+
+  // Keys set, deleted or evicted since they were last taken for a
+  // checkpoint, with the latest commit timestamp that changed each
+  // (only once tracking is enabled), so a checkpoint can save just them
+  bool m_track_dirty;
+  std::unordered_map<std::string, uint64_t> m_dirty;
+  bool m_checkpointed; // A checkpoint has saved the whole table
+
+  // Keys in use by transactions that don't lock them (yet), with the
+  // number of transactions using each, so they aren't evicted
+  std::unordered_map<std::string, unsigned> m_pins;
+
+  static size_t entry_size(const std::string &key, const std::string &value);
+  static uint64_t coarse_time_ms();
+  void adjust_memory(size_t added, size_t removed);
+  KeyId hold_key(const std::string &key);
+  void drop_key(KeyId id);
+  void remove(DataMap::iterator it);
+  void keep_old_version(KeyId id, const Entry &entry, uint64_t superseded_at);
+  bool find_version(KeyId id, uint64_t snapshot, WriteSet::Change &version);
+  size_t find_base(const std::string &key, uint64_t now) const;
+  bool base_row_live(size_t i, uint64_t now) const {
+    uint64_t expires_at = m_base.expires_at(i);
+    return !m_shadowed[i] && (expires_at == 0 || expires_at > now);
+  }
+  void shadow_base(const std::string &key, const CommitClock::Commit &commit);
+  void mark_dirty(const std::string &key, uint64_t ts);
+  static bool is_expired(const Entry &entry, uint64_t now) {
+    return entry.expires_at != 0 && entry.expires_at <= now;
+  }
+
   // Copy constructor and assignment operator are prohibited
   Table(const Table &);
   Table &operator=(const Table &);
 
 public:
-  Table(const std::string &name);
+  // Number of entries examined to choose one to evict
+  static const unsigned EVICTION_SAMPLES = 5;
+
+  // Resolution of key expiry times
+  static const unsigned EXPIRY_TICK_MS = 100;
+
+  // Version of every key read from the base (keys set later get
+  // higher versions)
+  static const uint64_t BASE_VERSION = 1;
+
+  // If keys is null, the table's keys are plain strings of its own;
+  // otherwise they are interned in keys, which is shared (e.g.,
+  // server-wide) and must outlive the table.
+  // If total_memory is non-null, the table's memory use is added to it.
+  // The table starts with the rows of base (whose checkpoint must
+  // outlive the table), if given.
+  Table(const std::string &name, KeyDictionary *keys = nullptr,
+        std::atomic<size_t> *total_memory = nullptr, const MappedTable &base = MappedTable());
   ~Table();
 
   std::string get_name() const { return m_name; }
+  size_t get_memory_used() const { return m_memory_used.load(std::memory_order_relaxed); }
 
-  void lock();     // Acquire the table lock
-  void unlock();   // Release the table lock
-  bool trylock();  // Attempt to acquire the table lock
+  // Once a table is dropped (or truncated, which replaces it with a new
+  // table) it is no longer counted in the server's memory use, and any
+  // pending operation on it must fail. Both require the table latch,
+  // and (when done by a client) the table's lock in the LockManager.
+  void mark_dropped();
+  bool is_dropped() const { return m_dropped; }
+
+  // Current wall clock time in milliseconds, the time base for expiry
+  static uint64_t wall_time_ms();
+
+  // The table's mutex is a latch, held only while one operation runs.
+  // Transactions keep tables locked through the server's LockManager.
+  void lock();     // Acquire the table latch
+  void unlock();   // Release the table latch
+  bool trylock();  // Attempt to acquire the table latch
 
   // Note: these functions should only be called while the
-  // table's lock is held!
-  void set(const std::string &key, const std::string &value); // Set a key-value pair
+  // table's latch is held! Uncommitted changes live in the
+  // owning transaction's WriteSet, not in the table.
+  // Keys whose expiry time has passed are treated as absent.
+  //
+  // Set (and commit) a key-value pair, expiring at expires_at if
+  // nonzero. The new version is stamped with commit, which also says
+  // whether the version replaced must be kept for snapshots.
+  void set(const std::string &key, const std::string &value, uint64_t expires_at = 0,
+           const CommitClock::Commit &commit = CommitClock::Commit());
   bool has_key(const std::string &key);                      // Check if a key exists
+  uint64_t get_version(const std::string &key);              // Key's version, or 0 if it doesn't exist
   std::string get(const std::string &key);                   // Get the value of a key
-  void commit_changes();                                     // Commit tentative changes
-  void rollback_changes();                                   // Roll back tentative changes
+  void commit_changes(const WriteSet::Changes &changes,      // Commit a transaction's changes
+                      const CommitClock::Commit &commit = CommitClock::Commit());
+
+  // Bulk-load rows (skipping deletes and expired rows) into a table no
+  // one else uses yet, so without the latch. Rows after the table's
+  // last key are appended to its storage directly; any others are set
+  // one by one. The rows aren't marked dirty: the table isn't
+  // checkpointed yet, so its first checkpoint saves all of it.
+  void load(const WriteSet::Changes &rows);
+
+  // Get the value a key had as of a snapshot (its latest version
+  // committed at or before the snapshot's timestamp)
+  std::string get_at(const std::string &key, uint64_t snapshot);
+
+  // Like get_at, but also getting the expiry time. Returns false if
+  // the key didn't exist as of the snapshot.
+  bool find_at(const std::string &key, uint64_t snapshot, WriteSet::Change &row);
+
+  // Like scan, but reading the table as of a snapshot: append up to
+  // max keys beginning with prefix, in key order after the key after
+  // (or from the first key, if after is empty), with their values and
+  // expiry times as of the snapshot. Returns true if more keys remain.
+  bool scan_at(const std::string &after, const std::string &prefix, uint64_t snapshot,
+               unsigned max, WriteSet::Changes &rows);
+
+  // Discard replaced versions superseded at or before horizon
+  void prune_history(uint64_t horizon);
+
+  // Append up to max committed rows, in key order, whose keys begin with
+  // prefix and (unless after is empty) come after the key after.
+  // Returns true if more matching rows remain beyond those appended.
+  bool scan(const std::string &after, const std::string &prefix, unsigned max,
+            std::vector<std::pair<std::string, std::string>> &rows);
+
+  // Pin a key a transaction is using without a lock (one it will write,
+  // or read optimistically), so it isn't evicted until unpinned. Keys
+  // may be pinned more than once, and whether or not they exist.
+  void pin_key(const std::string &key) { m_pins[key]++; }
+  void unpin_key(const std::string &key);
+  bool is_pinned(const std::string &key) const { return !m_pins.empty() && m_pins.count(key) > 0; }
+
+  // Choose the least recently used of a few randomly sampled committed
+  // entries (approximate LRU) to evict, skipping pinned keys, and keys
+  // for which in_use (if given) returns true. Stores its key in key, and returns the
+  // bytes evicting it frees, or 0 if there is nothing to evict. A key
+  // is evicted by committing its deletion, like any other change, so
+  // snapshots, checkpoints and the commit log all see it deleted.
+  size_t choose_victim(std::string &key, const std::function<bool(const std::string &)> &in_use = nullptr);
+
+  // Remove up to max keys whose expiry time has passed. Returns true
+  // if more expired keys remain to be removed.
+  bool remove_expired(unsigned max, unsigned &removed);
+
+  // Start tracking dirty keys (for incremental checkpoints)
+  void track_dirty() { m_track_dirty = true; }
+
+  // Take the dirty keys changed only by commits at or before snapshot,
+  // in key order. Keys changed since stay dirty.
+  void take_dirty(uint64_t snapshot, std::vector<std::string> &keys);
+
+  // Mark keys taken by take_dirty dirty again (their checkpoint failed)
+  void restore_dirty(const std::vector<std::string> &keys);
+
+  // Whether a checkpoint has saved the whole table, so later ones only
+  // need its dirty keys. Used only by the thread writing checkpoints.
+  bool is_checkpointed() const { return m_checkpointed; }
+  void set_checkpointed() { m_checkpointed = true; }
 };
 
 #endif // TABLE_H
@@ -0,0 +1,106 @@
+#include <cassert>
+#include <algorithm>
+#include "timing_wheel.h"
+
+TimingWheel::TimingWheel(uint64_t tick_ms, uint64_t now_ms)
+  : m_tick_ms(tick_ms)
+  , m_current_tick(now_ms / tick_ms)
+  , m_size(0)
+{
+}
+
+TimingWheel::~TimingWheel()
+{
+}
+
+void TimingWheel::place(const Item &item)
+{
+  // Round up, so an entry is never reported before its deadline
+  uint64_t tick = (item.expires_at + m_tick_ms - 1) / m_tick_ms;
+  if (tick <= m_current_tick) {
+    m_due.push_back(item);
+    return;
+  }
+
+  // Use the lowest level at which the deadline and the current tick
+  // fall in the same rotation of the level above; the deadline's slot
+  // at that level is then still ahead of the current position
+  for (unsigned level = 0; level < LEVELS; level++) {
+    unsigned shift = SLOT_BITS * (level + 1);
+    if (level == LEVELS - 1 || (tick >> shift) == (m_current_tick >> shift)) {
+      if ((tick >> shift) != (m_current_tick >> shift)) {
+        // Beyond the wheel's range: park it in the top level slot that
+        // is cascaded last, where it will be placed again
+        unsigned slot = ((m_current_tick >> (SLOT_BITS * level)) - 1) & (SLOTS - 1);
+        m_slots[level][slot].push_back(item);
+      } else {
+        unsigned slot = (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+        m_slots[level][slot].push_back(item);
+      }
+      return;
+    }
+  }
+}
+
+void TimingWheel::advance_one_tick()
+{
+  m_current_tick++;
+
+  // When a level's rotation completes, the next slot of the level
+  // above holds entries that now fit below it. Cascade from the top
+  // so entries can fall more than one level.
+  for (unsigned level = LEVELS - 1; level > 0; level--) {
+    uint64_t mask = (uint64_t(1) << (SLOT_BITS * level)) - 1;
+    if ((m_current_tick & mask) == 0) {
+      unsigned slot = (m_current_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+      std::vector<Item> items;
+      items.swap(m_slots[level][slot]);
+      for (const Item &item : items) {
+        place(item);
+      }
+    }
+  }
+
+  std::vector<Item> &slot = m_slots[0][m_current_tick & (SLOTS - 1)];
+  m_due.insert(m_due.end(), slot.begin(), slot.end());
+  slot.clear();
+}
+
+void TimingWheel::schedule(KeyId key, uint64_t expires_at)
+{
+  place(Item{key, expires_at});
+  m_size++;
+}
+
+bool TimingWheel::expire(uint64_t now_ms, unsigned max, std::vector<Item> &expired)
+{
+  uint64_t target = now_ms / m_tick_ms;
+  if (m_size == m_due.size()) {
+    m_current_tick = std::max(m_current_tick, target); // Nothing left to cascade
+  }
+  while (m_current_tick < target) {
+    advance_one_tick();
+  }
+
+  unsigned count = 0;
+  while (!m_due.empty() && count < max) {
+    expired.push_back(m_due.back());
+    m_due.pop_back();
+    count++;
+  }
+  m_size -= count;
+  return !m_due.empty();
+}
+
+void TimingWheel::drain(std::vector<Item> &items)
+{
+  for (unsigned level = 0; level < LEVELS; level++) {
+    for (unsigned slot = 0; slot < SLOTS; slot++) {
+      items.insert(items.end(), m_slots[level][slot].begin(), m_slots[level][slot].end());
+      m_slots[level][slot].clear();
+    }
+  }
+  items.insert(items.end(), m_due.begin(), m_due.end());
+  m_due.clear();
+  m_size = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <vector>
+#include <cstdint>
+#include "key_dictionary.h"
+
+// Hierarchical timing wheel tracking when keys expire. Time is divided
+// into ticks; level 0 has one slot per tick, and each higher level has
+// one slot per full rotation of the level below it. Entries in higher
+// levels are cascaded down as time reaches them, so scheduling and
+// expiring are O(1) per entry no matter how far away the deadline is.
+//
+// The wheel only records (key, deadline) pairs: an entry whose key was
+// overwritten or deleted in the meantime is still returned when due,
+// so the caller must check it against the key's current deadline.
+class TimingWheel {
+public:
+  struct Item {
+    KeyId key;
+    uint64_t expires_at; // Deadline in milliseconds
+  };
+
+private:
+  static const unsigned LEVELS = 4;
+  static const unsigned SLOT_BITS = 6;
+  static const unsigned SLOTS = 1 << SLOT_BITS;
+
+  uint64_t m_tick_ms;      // Length of one tick
+  uint64_t m_current_tick; // Last tick processed
+  std::vector<Item> m_slots[LEVELS][SLOTS];
+  std::vector<Item> m_due; // Expired entries not yet returned
+  size_t m_size;
+
+  void place(const Item &item);
+  void advance_one_tick();
+
+  // copy constructor and assignment operator are prohibited
+  TimingWheel(const TimingWheel &);
+  TimingWheel &operator=(const TimingWheel &);
+
+public:
+  TimingWheel(uint64_t tick_ms, uint64_t now_ms);
+  ~TimingWheel();
+
+  // Schedule key to expire at expires_at
+  void schedule(KeyId key, uint64_t expires_at);
+
+  // Advance the wheel to now, and append up to max entries whose deadline
+  // has passed to expired. Returns true if more expired entries remain.
+  bool expire(uint64_t now_ms, unsigned max, std::vector<Item> &expired);
+
+  // Remove and return every entry, due or not
+  void drain(std::vector<Item> &items);
+
+  size_t size() const { return m_size; }
+};
+
+#endif // TIMING_WHEEL_H
@@ -4,6 +4,18 @@
 #include "message_serialization.h"
 #include "table.h"
 #include "value_stack.h"
+#include "key_dictionary.h"
+#include "write_set.h"
+#include "timing_wheel.h"
+#include "epoch_manager.h"
+#include "lock_manager.h"
+#include "commit_clock.h"
+#include "commit_log.h"
+#include "checkpoint.h"
+#include "log_replay.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "exceptions.h"
 #include "tctest.h"
 
@@ -66,6 +78,7 @@ struct TestObjs
 // Create and clean up test fixture
 TestObjs *setup();
 void cleanup( TestObjs *objs );
+std::string temp_path( const std::string &name );
 
 // Guard object to ensure that Table is locked and unlocked
 // in unit tests. This could be used to manage locking and
@@ -105,6 +118,27 @@ void test_table_get( TestObjs *objs );
 void test_table_commit_changes( TestObjs *objs );
 void test_table_rollback_changes( TestObjs *objs );
 void test_table_commit_and_rollback( TestObjs *objs );
+void test_write_set_savepoints( TestObjs *objs );
+void test_table_scan( TestObjs *objs );
+void test_table_versions( TestObjs *objs );
+void test_table_snapshots( TestObjs *objs );
+void test_table_evict( TestObjs *objs );
+void test_table_expire( TestObjs *objs );
+void test_key_dictionary( TestObjs *objs );
+void test_table_shared_keys( TestObjs *objs );
+void test_timing_wheel( TestObjs *objs );
+void test_epoch_manager( TestObjs *objs );
+void test_lock_manager( TestObjs *objs );
+void test_lock_manager_wound_wait( TestObjs *objs );
+void test_commit_log( TestObjs *objs );
+void test_commit_log_compact( TestObjs *objs );
+void test_checkpoint( TestObjs *objs );
+void test_table_checkpoint_base( TestObjs *objs );
+void test_checkpoint_delta_merge( TestObjs *objs );
+void test_table_dirty_keys( TestObjs *objs );
+void test_table_load( TestObjs *objs );
+void test_log_record_frames( TestObjs *objs );
+void test_log_replay( TestObjs *objs );
 void test_value_stack( TestObjs *objs );
 void test_value_stack_exceptions( TestObjs *objs );
 
@@ -133,6 +167,27 @@ int main(int argc, char **argv)
   TEST( test_table_commit_changes );
   TEST( test_table_rollback_changes );
   TEST( test_table_commit_and_rollback );
+  TEST( test_write_set_savepoints );
+  TEST( test_table_scan );
+  TEST( test_table_versions );
+  TEST( test_table_snapshots );
+  TEST( test_table_evict );
+  TEST( test_table_expire );
+  TEST( test_key_dictionary );
+  TEST( test_table_shared_keys );
+  TEST( test_timing_wheel );
+  TEST( test_epoch_manager );
+  TEST( test_lock_manager );
+  TEST( test_lock_manager_wound_wait );
+  TEST( test_commit_log );
+  TEST( test_commit_log_compact );
+  TEST( test_checkpoint );
+  TEST( test_table_checkpoint_base );
+  TEST( test_checkpoint_delta_merge );
+  TEST( test_table_dirty_keys );
+  TEST( test_table_load );
+  TEST( test_log_record_frames );
+  TEST( test_log_replay );
   TEST( test_value_stack );
   TEST( test_value_stack_exceptions );
 
@@ -217,6 +272,17 @@ void cleanup(TestObjs *objs)
   delete objs;
 }
 
+// Create an empty temporary file (for tests of on-disk formats), and
+// return its name
+std::string temp_path( const std::string &name )
+{
+  std::string path = "/tmp/" + name + ".XXXXXX";
+  int fd = mkstemp( &path[0] );
+  ASSERT( fd >= 0 );
+  close( fd );
+  return path;
+}
+
 void test_message_default_ctor(TestObjs *objs)
 {
   ASSERT( MessageType::NONE == objs->m.get_message_type() );
@@ -292,6 +358,48 @@ void test_message_is_valid( TestObjs *objs )
   ASSERT( objs->long_get_req.is_valid() );
   ASSERT( objs->create_req_2.is_valid() );
 
+  // SCAN cursor is either the start cursor or a key
+  ASSERT( Message( MessageType::SCAN, { "accounts", "0" } ).is_valid() );
+  ASSERT( Message( MessageType::SCAN, { "accounts", "acct123", "acct" } ).is_valid() );
+  ASSERT( !Message( MessageType::SCAN, { "accounts", "1" } ).is_valid() );
+  ASSERT( !Message( MessageType::SCAN, { "accounts" } ).is_valid() );
+
+  // SET's optional third argument is a TTL in seconds
+  Message set_ttl( MessageType::SET, { "accounts", "acct123", "30" } );
+  ASSERT( set_ttl.is_valid() );
+  ASSERT( 30 == set_ttl.get_ttl() );
+  ASSERT( 0 == objs->set_req.get_ttl() );
+  ASSERT( !Message( MessageType::SET, { "accounts", "acct123", "0" } ).is_valid() );
+  ASSERT( !Message( MessageType::SET, { "accounts", "acct123", "ttl" } ).is_valid() );
+
+  ASSERT( Message( MessageType::BEGIN, { "OPTIMISTIC" } ).is_valid() );
+  ASSERT( Message( MessageType::BEGIN, { "RETRY", "OPTIMISTIC" } ).is_valid() );
+  ASSERT( Message( MessageType::BEGIN, { "RETRY" } ).has_begin_options() );
+  ASSERT( !Message( MessageType::BEGIN, { "RETRY", "RETRY" } ).is_valid() );
+  ASSERT( Message( MessageType::BEGIN, { "READONLY" } ).is_valid() );
+  ASSERT( !Message( MessageType::BEGIN, { "READONLY", "OPTIMISTIC" } ).is_valid() );
+  ASSERT( Message( MessageType::BEGIN, { "accounts", "audit.acct123" } ).is_valid() );
+  ASSERT( !Message( MessageType::BEGIN, { "RETRY", "accounts" } ).has_begin_options() );
+  ASSERT( !Message( MessageType::BEGIN, { "accounts", "OPTIMISTIC." } ).is_valid() );
+  ASSERT( !Message( MessageType::BEGIN, { "accounts.acct.123" } ).is_valid() );
+
+  ASSERT( Message( MessageType::DROP, { "accounts" } ).is_valid() );
+  ASSERT( Message( MessageType::TRUNCATE, { "accounts" } ).is_valid() );
+  ASSERT( !Message( MessageType::DROP ).is_valid() );
+  ASSERT( !Message( MessageType::TRUNCATE, { "1accounts" } ).is_valid() );
+
+  ASSERT( Message( MessageType::SAVEPOINT, { "before_fees" } ).is_valid() );
+  ASSERT( !Message( MessageType::SAVEPOINT ).is_valid() );
+  ASSERT( Message( MessageType::ROLLBACK, { "TO", "before_fees" } ).is_valid() );
+  ASSERT( "before_fees" == Message( MessageType::ROLLBACK, { "TO", "before_fees" } ).get_savepoint() );
+  ASSERT( !Message( MessageType::ROLLBACK, { "before_fees" } ).is_valid() );
+  ASSERT( !Message( MessageType::ROLLBACK, { "AT", "before_fees" } ).is_valid() );
+
+  // ROWS has a cursor followed by key/value pairs
+  ASSERT( Message( MessageType::ROWS, { "0" } ).is_valid() );
+  ASSERT( Message( MessageType::ROWS, { "acct1", "acct1", "100" } ).is_valid() );
+  ASSERT( !Message( MessageType::ROWS, { "acct1", "acct1" } ).is_valid() );
+
   ASSERT( !objs->invalid_login_req.is_valid() );
   ASSERT( !objs->invalid_create_req.is_valid() );
   ASSERT( !objs->invalid_data_resp.is_valid() );
@@ -410,7 +518,6 @@ void test_table_has_key( TestObjs *objs )
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
     ASSERT( objs->invoices->has_key( "abc123" ) );
     ASSERT( objs->invoices->has_key( "xyz456" ) );
 
@@ -430,7 +537,6 @@ void test_table_get( TestObjs *objs )
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
     ASSERT( "1000" == objs->invoices->get( "abc123" ) );
     ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
 
@@ -440,30 +546,36 @@ void test_table_get( TestObjs *objs )
 
 void test_table_commit_changes( TestObjs *objs )
 {
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+  WriteSet ws;
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
-  }
+  // Buffered changes are visible through the write set only
+  ws.set( objs->invoices, "abc123", "1000" );
+  ws.set( objs->invoices, "xyz456", "1318" );
+
+  std::string val;
+  ASSERT( ws.lookup( objs->invoices, "abc123", val ) );
+  ASSERT( "1000" == val );
+  ASSERT( !ws.lookup( objs->invoices, "nonexistent", val ) );
+  ASSERT( !ws.lookup( objs->line_items, "abc123", val ) );
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
-
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    // Changes haven't been committed yet
+    ASSERT( !objs->invoices->has_key( "abc123" ) );
+    ASSERT( !objs->invoices->has_key( "xyz456" ) );
   }
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
     // Commit changes
-    objs->invoices->commit_changes();
+    for ( auto &entry : ws ) {
+      entry.first->commit_changes( entry.second );
+    }
+    ws.clear();
 
-    // Changes should still be visible
+    // Changes should be visible now
     ASSERT( "1000" == objs->invoices->get( "abc123" ) );
     ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
 
@@ -473,34 +585,20 @@ void test_table_commit_changes( TestObjs *objs )
 
 void test_table_rollback_changes( TestObjs *objs )
 {
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+  WriteSet ws;
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
-  }
-
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+  ws.set( objs->invoices, "abc123", "1000" );
+  ws.set( objs->invoices, "xyz456", "1318" );
+  ASSERT( !ws.is_empty() );
 
-    // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
-
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
-  }
+  // Rollback changes
+  ws.clear();
+  ASSERT( ws.is_empty() );
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Rollback changes
-    objs->invoices->rollback_changes();
-  }
-
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
-
-    // Table should be empty again!
+    // Table should still be empty!
     ASSERT( !objs->invoices->has_key( "abc123" ) );
     ASSERT( !objs->invoices->has_key( "xyz456" ) );
     ASSERT( !objs->invoices->has_key( "nonexistent" ) );
@@ -512,61 +610,1104 @@ void test_table_rollback_changes( TestObjs *objs )
 // there.
 void test_table_commit_and_rollback( TestObjs *objs )
 {
+  WriteSet ws;
+
   // Add some data
+  ws.set( objs->line_items, "apples", "100" );
+  ws.set( objs->line_items, "bananas", "150" );
+
+  // Commit changes
   {
     TableGuard g( objs->line_items );
 
-    objs->line_items->set( "apples", "100" );
-    objs->line_items->set( "bananas", "150" );
+    for ( auto &entry : ws ) {
+      entry.first->commit_changes( entry.second );
+    }
+    ws.clear();
   }
 
-  // Commit changes
+  // Ensure that data is there
   {
     TableGuard g( objs->line_items );
 
-    objs->line_items->commit_changes();
+    ASSERT( "100" == objs->line_items->get( "apples" ) );
+    ASSERT( "150" == objs->line_items->get( "bananas" ) );
   }
 
-  // Ensure that data is there
+  // Add more data, and delete a key (empty value)
+  ws.set( objs->line_items, "oranges", "220" );
+  ws.set( objs->line_items, "apples", "" );
+
+  // Rollback most recent changes
+  ws.clear();
+
+  // Original data should still be there (since it was committed),
+  // but pending changes shouldn't be there
   {
     TableGuard g( objs->line_items );
 
     ASSERT( "100" == objs->line_items->get( "apples" ) );
     ASSERT( "150" == objs->line_items->get( "bananas" ) );
+    ASSERT( !objs->line_items->has_key( "oranges" ) );
   }
+}
+
+void test_write_set_savepoints( TestObjs *objs )
+{
+  WriteSet ws;
+  std::string val;
+
+  ws.set( objs->invoices, "abc123", "1000" );
+  ws.savepoint( "first" );
+  ASSERT( ws.has_savepoints() );
+
+  // Change an existing key, add keys in another table, delete a key
+  ws.set( objs->invoices, "abc123", "1100" );
+  ws.set( objs->line_items, "apples", "100" );
+  ws.savepoint( "second" );
+  ws.set( objs->line_items, "apples", "" );
+  ws.set( objs->invoices, "xyz456", "1318", 5000 );
+
+  // Rolling back to the second savepoint keeps the changes before it
+  ASSERT( ws.rollback_to( "second" ) );
+  ASSERT( ws.lookup( objs->line_items, "apples", val ) );
+  ASSERT( "100" == val );
+  ASSERT( !ws.lookup( objs->invoices, "xyz456", val ) );
+
+  // A savepoint can be rolled back to again
+  ws.set( objs->invoices, "xyz456", "1318" );
+  ASSERT( ws.rollback_to( "second" ) );
+  ASSERT( !ws.lookup( objs->invoices, "xyz456", val ) );
+
+  // Rolling back to an earlier savepoint forgets later ones, and
+  // drops tables that no longer have changes
+  ASSERT( ws.rollback_to( "first" ) );
+  ASSERT( ws.lookup( objs->invoices, "abc123", val ) );
+  ASSERT( "1000" == val );
+  ASSERT( nullptr == ws.get_changes( objs->line_items ) );
+  ASSERT( !ws.rollback_to( "second" ) );
+  ASSERT( !ws.rollback_to( "nonexistent" ) );
+
+  // Setting a savepoint with an existing name moves it
+  ws.set( objs->invoices, "abc123", "1200" );
+  ws.savepoint( "first" );
+  ws.set( objs->invoices, "abc123", "1300" );
+  ASSERT( ws.rollback_to( "first" ) );
+  ASSERT( ws.lookup( objs->invoices, "abc123", val ) );
+  ASSERT( "1200" == val );
+
+  ws.clear();
+  ASSERT( ws.is_empty() );
+  ASSERT( !ws.has_savepoints() );
+}
+
+void test_table_scan( TestObjs *objs )
+{
+  TableGuard g( objs->line_items );
+
+  objs->line_items->set( "pears", "4" );
+  objs->line_items->set( "apples", "1" );
+  objs->line_items->set( "apricots", "2" );
+  objs->line_items->set( "bananas", "3" );
+
+  // Full scan in batches of 3, resuming after the last key returned
+  std::vector<std::pair<std::string, std::string>> rows;
+  ASSERT( objs->line_items->scan( "", "", 3, rows ) );
+  ASSERT( 3 == rows.size() );
+  ASSERT( "apples" == rows[0].first && "1" == rows[0].second );
+  ASSERT( "apricots" == rows[1].first );
+  ASSERT( "bananas" == rows[2].first );
+  ASSERT( !objs->line_items->scan( rows.back().first, "", 3, rows ) );
+  ASSERT( 4 == rows.size() );
+  ASSERT( "pears" == rows[3].first && "4" == rows[3].second );
+
+  // Prefix scan
+  rows.clear();
+  ASSERT( !objs->line_items->scan( "", "ap", 10, rows ) );
+  ASSERT( 2 == rows.size() );
+  ASSERT( "apples" == rows[0].first );
+  ASSERT( "apricots" == rows[1].first );
+  rows.clear();
+  ASSERT( !objs->line_items->scan( "apples", "ap", 10, rows ) );
+  ASSERT( 1 == rows.size() );
+  ASSERT( "apricots" == rows[0].first );
+
+  // Deleted keys aren't returned
+  objs->line_items->set( "bananas", "" );
+  rows.clear();
+  ASSERT( !objs->line_items->scan( "apricots", "", 10, rows ) );
+  ASSERT( 1 == rows.size() );
+  ASSERT( "pears" == rows[0].first );
+}
+
+void test_table_versions( TestObjs *objs )
+{
+  TableGuard g( objs->line_items );
+
+  ASSERT( 0 == objs->line_items->get_version( "apples" ) );
+  objs->line_items->set( "apples", "1" );
+  uint64_t v1 = objs->line_items->get_version( "apples" );
+  ASSERT( 0 != v1 );
+
+  // Every change gives the key a new version, even to the same value
+  objs->line_items->set( "apples", "1" );
+  uint64_t v2 = objs->line_items->get_version( "apples" );
+  ASSERT( v1 != v2 );
+
+  objs->line_items->set( "bananas", "2" );
+  ASSERT( v2 == objs->line_items->get_version( "apples" ) );
+
+  objs->line_items->set( "apples", "" );
+  ASSERT( 0 == objs->line_items->get_version( "apples" ) );
+}
+
+void test_table_snapshots( TestObjs *objs )
+{
+  CommitClock clock;
+  Table *t = objs->line_items;
+  TableGuard g( t );
+
+  CommitClock::Commit c1 = clock.begin_commit();
+  t->set( "apples", "1", 0, c1 );
+  t->set( "bananas", "2", 0, c1 );
+  clock.end_commit( c1 );
+  ASSERT( !c1.keep_history );
+
+  // Later commits are invisible to the snapshot, and keep the
+  // versions they replace or delete for it
+  uint64_t snapshot = clock.open_snapshot();
+  CommitClock::Commit c2 = clock.begin_commit();
+  ASSERT( c2.keep_history );
+  t->set( "apples", "10", 0, c2 );
+  t->set( "bananas", "", 0, c2 );
+  t->set( "cherries", "3", 0, c2 );
+  clock.end_commit( c2 );
+
+  ASSERT( "10" == t->get( "apples" ) );
+  ASSERT( "1" == t->get_at( "apples", snapshot ) );
+  ASSERT( "2" == t->get_at( "bananas", snapshot ) );
+  try {
+    t->get_at( "cherries", snapshot );
+    FAIL( "cherries didn't exist at the snapshot" );
+  } catch ( OperationException &ex ) {
+  }
+  ASSERT( "10" == t->get_at( "apples", c2.ts ) );
+
+  // Scanning at the snapshot includes keys deleted since, and not
+  // those added since
+  WriteSet::Changes rows;
+  ASSERT( t->scan_at( "", "", snapshot, 1, rows ) );
+  ASSERT( 1 == rows.size() );
+  ASSERT( "1" == rows["apples"].value );
+  ASSERT( !t->scan_at( "apples", "", snapshot, 10, rows ) );
+  ASSERT( 2 == rows.size() );
+  ASSERT( "2" == rows["bananas"].value );
+  rows.clear();
+  ASSERT( !t->scan_at( "", "", c2.ts, 10, rows ) );
+  ASSERT( 2 == rows.size() );
+  ASSERT( "10" == rows["apples"].value );
+  ASSERT( "3" == rows["cherries"].value );
+  rows.clear();
+  ASSERT( !t->scan_at( "", "b", snapshot, 10, rows ) );
+  ASSERT( 1 == rows.size() );
+  ASSERT( "2" == rows["bananas"].value );
+
+  // History is kept until no snapshot can need it
+  ASSERT( snapshot == clock.get_horizon() );
+  t->prune_history( clock.get_horizon() );
+  ASSERT( "1" == t->get_at( "apples", snapshot ) );
+  clock.close_snapshot( snapshot );
+  t->prune_history( clock.get_horizon() );
+  try {
+    t->get_at( "bananas", snapshot );
+    FAIL( "history was not pruned" );
+  } catch ( OperationException &ex ) {
+  }
+
+  CommitClock::Commit c3 = clock.begin_commit();
+  ASSERT( !c3.keep_history );
+  clock.end_commit( c3 );
+
+  // A commit that fails partway still ends, so later snapshots (which
+  // wait for every commit before them) can open
+  try {
+    CommitGuard c4( clock );
+    throw OperationException( "Record too large for commit log" );
+  } catch ( OperationException &ex ) {
+  }
+  snapshot = clock.open_snapshot();
+  ASSERT( c3.ts + 1 == snapshot );
+  clock.close_snapshot( snapshot );
+}
+
+void test_table_evict( TestObjs *objs )
+{
+  std::atomic<size_t> total( 0 );
+  Table *t = new Table( "cache", nullptr, &total );
 
-  // Add more data
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( t );
+
+    for ( int i = 0; i < 100; i++ ) {
+      t->set( "key" + std::to_string( i ), "value" );
+    }
+    size_t used = t->get_memory_used();
+    ASSERT( used > 100 * 8 );
+    ASSERT( used == total );
+
+    // Overwriting with a longer value grows the estimate by the difference
+    t->set( "key0", "longer_value" );
+    ASSERT( used + 7 == t->get_memory_used() );
+    used = t->get_memory_used();
+
+    // Evicting the chosen key (by deleting it) frees its estimated size
+    std::string victim;
+    size_t freed = t->choose_victim( victim );
+    ASSERT( freed > 0 );
+    t->set( victim, "" );
+    ASSERT( used - freed == t->get_memory_used() );
+
+    int remaining = 0;
+    for ( int i = 0; i < 100; i++ ) {
+      if ( t->has_key( "key" + std::to_string( i ) ) ) {
+        remaining++;
+      }
+    }
+    ASSERT( 99 == remaining );
+
+    // Keys in use, or pinned, are never chosen
+    auto in_use = []( const std::string &key ) { return key == "key1"; };
+    t->pin_key( "key2" );
+    t->pin_key( "key2" );
+    t->unpin_key( "key2" );
+    for ( int i = 0; i < 200; i++ ) {
+      ASSERT( t->choose_victim( victim, in_use ) > 0 );
+      ASSERT( victim != "key1" && victim != "key2" );
+    }
+    t->unpin_key( "key2" );
+    ASSERT( !t->is_pinned( "key2" ) );
+
+    while ( t->choose_victim( victim ) > 0 ) {
+      t->set( victim, "" );
+    }
+    ASSERT( 0 == t->get_memory_used() );
+    ASSERT( 0 == total );
+  }
+
+  t->set( "key1", "value" );
+  delete t;
+  ASSERT( 0 == total );
+}
 
-    objs->line_items->set( "oranges", "220" );
+void test_table_expire( TestObjs *objs )
+{
+  KeyDictionary keys;
+  Table *t = new Table( "sessions", &keys );
+  uint64_t now = Table::wall_time_ms();
+
+  {
+    TableGuard g( t );
+
+    t->set( "old", "1", now - 1000 );
+    t->set( "later", "2", now + 60000 );
+    t->set( "forever", "3" );
+
+    // An expired key is gone as soon as it is accessed
+    ASSERT( !t->has_key( "old" ) );
+    try {
+      t->get( "old" );
+      FAIL( "expired key was returned" );
+    } catch ( OperationException &ex ) {
+      // good
+    }
+    ASSERT( "2" == t->get( "later" ) );
+
+    // Expired keys are skipped by scans
+    t->set( "old", "1", now - 1000 );
+    std::vector<std::pair<std::string, std::string>> rows;
+    t->scan( "", "", 10, rows );
+    ASSERT( 2 == rows.size() );
+
+    // ...and removed in batches in the background
+    t->set( "stale", "4", now - 1000 );
+    unsigned removed, total = 0, batches = 1;
+    while ( t->remove_expired( 1, removed ) ) {
+      ASSERT( removed <= 1 );
+      total += removed;
+      batches++;
+    }
+    total += removed;
+    ASSERT( 3 == batches ); // includes the entry for the "old" already removed
+    ASSERT( 2 == total );
+    ASSERT( !t->has_key( "stale" ) );
+    ASSERT( nullptr == keys.find( "old" ) );
+
+    // Setting a key again cancels its earlier expiry
+    t->set( "refreshed", "5", now - 1000 );
+    t->set( "refreshed", "6" );
+    ASSERT( !t->remove_expired( 10, removed ) );
+    ASSERT( 0 == removed );
+    ASSERT( "6" == t->get( "refreshed" ) );
   }
 
-  // Ensure that data is there
+  // Pending expirations give back their key references
+  delete t;
+  ASSERT( 0 == keys.size() );
+}
+
+void test_key_dictionary( TestObjs *objs )
+{
+  KeyDictionary keys;
+
+  KeyId apples = keys.intern( "apples" );
+  KeyId bananas = keys.intern( "bananas" );
+  ASSERT( apples != bananas );
+  ASSERT( "apples" == *apples );
+  ASSERT( 2 == keys.size() );
+
+  // Interning an existing key yields the same id
+  ASSERT( apples == keys.intern( "apples" ) );
+  ASSERT( apples == keys.find( "apples" ) );
+  ASSERT( nullptr == keys.find( "oranges" ) );
+
+  // apples has two references, so it survives one release
+  keys.release( apples );
+  ASSERT( apples == keys.find( "apples" ) );
+  keys.release( apples );
+  ASSERT( nullptr == keys.find( "apples" ) );
+  ASSERT( 1 == keys.size() );
+
+  keys.release( bananas );
+  ASSERT( 0 == keys.size() );
+}
+
+// Tables sharing a dictionary store each distinct key once, and give
+// back their references when keys are deleted or the table is deleted
+void test_table_shared_keys( TestObjs *objs )
+{
+  KeyDictionary keys;
+  Table *t1 = new Table( "t1", &keys );
+  Table *t2 = new Table( "t2", &keys );
+
   {
-    TableGuard g( objs->line_items );
+    TableGuard g1( t1 );
+    TableGuard g2( t2 );
+
+    t1->set( "user1", "10" );
+    t1->set( "user2", "20" );
+    t2->set( "user1", "30" );
+    ASSERT( 2 == keys.size() );
+    ASSERT( "10" == t1->get( "user1" ) );
+    ASSERT( "30" == t2->get( "user1" ) );
+
+    // Setting an empty value deletes the key
+    t1->set( "user2", "" );
+    ASSERT( !t1->has_key( "user2" ) );
+    ASSERT( nullptr == keys.find( "user2" ) );
+
+    t2->set( "user1", "" );
+    ASSERT( "10" == t1->get( "user1" ) );
+    ASSERT( 1 == keys.size() );
+  }
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( "220" == objs->line_items->get( "oranges" ) );
+  delete t1;
+  delete t2;
+  ASSERT( 0 == keys.size() );
+}
+
+void test_timing_wheel( TestObjs *objs )
+{
+  KeyDictionary keys;
+  KeyId soon = keys.intern( "soon" );
+  KeyId later = keys.intern( "later" );
+  KeyId much_later = keys.intern( "much_later" );
+
+  TimingWheel wheel( 10, 1000 );
+  wheel.schedule( soon, 1025 );
+  wheel.schedule( later, 2500 );          // cascades from level 1
+  wheel.schedule( much_later, 1000000 );  // cascades from level 2
+  ASSERT( 3 == wheel.size() );
+
+  // Nothing is returned before its deadline
+  std::vector<TimingWheel::Item> expired;
+  ASSERT( !wheel.expire( 1024, 10, expired ) );
+  ASSERT( expired.empty() );
+  ASSERT( !wheel.expire( 1030, 10, expired ) );
+  ASSERT( 1 == expired.size() );
+  ASSERT( soon == expired[0].key );
+
+  expired.clear();
+  ASSERT( !wheel.expire( 2499, 10, expired ) );
+  ASSERT( expired.empty() );
+  ASSERT( !wheel.expire( 2500, 10, expired ) );
+  ASSERT( 1 == expired.size() );
+  ASSERT( later == expired[0].key );
+
+  expired.clear();
+  ASSERT( !wheel.expire( 999990, 10, expired ) );
+  ASSERT( expired.empty() );
+  ASSERT( !wheel.expire( 1000000, 10, expired ) );
+  ASSERT( 1 == expired.size() );
+  ASSERT( much_later == expired[0].key );
+  ASSERT( 0 == wheel.size() );
+
+  // A wave of expirations is handed out in batches
+  for ( int i = 0; i < 5; i++ ) {
+    wheel.schedule( soon, 1000100 );
   }
+  expired.clear();
+  ASSERT( wheel.expire( 1000200, 2, expired ) );
+  ASSERT( wheel.expire( 1000200, 2, expired ) );
+  ASSERT( !wheel.expire( 1000200, 2, expired ) );
+  ASSERT( 5 == expired.size() );
+
+  wheel.schedule( later, 5000000 );
+  expired.clear();
+  wheel.drain( expired );
+  ASSERT( 1 == expired.size() );
+  ASSERT( 0 == wheel.size() );
+
+  keys.release( soon );
+  keys.release( later );
+  keys.release( much_later );
+}
+
+void test_epoch_manager( TestObjs *objs )
+{
+  EpochManager epochs;
+  EpochManager::Participant *reader = epochs.register_participant();
+  EpochManager::Participant *other = epochs.register_participant();
+  int freed = 0;
+
+  // Nothing is pinned, so a retired object can be freed right away
+  epochs.retire( [&freed]() { freed++; } );
+  ASSERT( 1 == epochs.reclaim() );
+  ASSERT( 1 == freed );
 
-  // Rollback most recent change
   {
-    TableGuard g( objs->line_items );
+    EpochGuard pin( epochs, reader );
+
+    // The pinned reader may still be using these
+    epochs.retire( [&freed]() { freed++; } );
+    epochs.retire( [&freed]() { freed++; } );
+    ASSERT( 0 == epochs.reclaim() );
+
+    // Pinning after an object is retired doesn't hold it back,
+    // but it does hold back anything retired later
+    epochs.enter( other );
+    epochs.exit( reader );
+    ASSERT( 2 == epochs.reclaim() );
+    epochs.retire( [&freed]() { freed++; } );
+    ASSERT( 0 == epochs.reclaim() );
+    ASSERT( 1 == epochs.pending() );
+    epochs.exit( other );
+    epochs.enter( reader );
+  }
+
+  ASSERT( 1 == epochs.reclaim() );
+  ASSERT( 4 == freed );
 
-    objs->line_items->rollback_changes();
+  // Anything still retired is freed when the manager is destroyed
+  epochs.retire( [&freed]() { freed++; } );
+  epochs.unregister_participant( reader );
+  epochs.unregister_participant( other );
+}
+
+struct LockRequest {
+  LockManager *locks;
+  LockManager::Owner *owner;
+  Table *table;
+  std::string key;
+  bool granted;
+};
+
+static void *lock_in_thread( void *arg )
+{
+  LockRequest *req = static_cast<LockRequest *>( arg );
+  try {
+    req->locks->lock_key( req->owner, req->table, req->key, LockManager::EXCLUSIVE );
+    req->granted = true;
+  } catch ( FailedTransaction &ex ) {
+    req->granted = false;
+    req->locks->release_all( req->owner ); // As rolling back would
   }
+  return nullptr;
+}
 
-  // Original data should still be there (since it was committed),
-  // but pending change shouldn't be there
+// Expect a lock request to fail with FailedTransaction
+#define ASSERT_LOCK_FAILS( request ) \
+  try { \
+    request; \
+    FAIL( "lock granted" ); \
+  } catch ( FailedTransaction &ex ) { \
+  }
+
+void test_lock_manager( TestObjs *objs )
+{
+  LockManager locks( 100 );
+  Table t1( "t1" ), t2( "t2" );
+  LockManager::Owner a, b;
+  locks.begin_transaction( &b ); // b is older, so a just waits for it
+  locks.begin_transaction( &a );
+
+  // Readers share a key, and writers of different keys don't conflict
+  locks.lock_key( &a, &t1, "x", LockManager::SHARED );
+  locks.lock_key( &b, &t1, "x", LockManager::SHARED );
+  locks.lock_key( &b, &t1, "y", LockManager::EXCLUSIVE );
+  locks.lock_key( &b, &t1, "y", LockManager::SHARED ); // already held
+  ASSERT( locks.is_locked( &t1 ) );
+  ASSERT( locks.is_locked( &t1, "x" ) );
+  ASSERT( !locks.is_locked( &t1, "z" ) );
+
+  // A lock that isn't released in time can't be acquired
+  ASSERT_LOCK_FAILS( locks.lock_key( &a, &t1, "y", LockManager::SHARED ) );
+  ASSERT( 1 == locks.get_timeouts() );
+
+  // A table lock conflicts with locks on its keys
+  locks.lock_table( &b, &t2, LockManager::SHARED );
+  ASSERT( locks.is_locked( &t2, "z" ) );
+  locks.lock_key( &a, &t2, "z", LockManager::SHARED );
+  ASSERT_LOCK_FAILS( locks.lock_key( &a, &t2, "z", LockManager::EXCLUSIVE ) );
+  ASSERT_LOCK_FAILS( locks.lock_table( &a, &t1, LockManager::EXCLUSIVE ) );
+  ASSERT( 3 == locks.get_timeouts() );
+  ASSERT( 0 == locks.get_wounds() );
+
+  locks.end_transaction( &a );
+  locks.end_transaction( &b );
+  ASSERT( !locks.is_locked( &t1 ) );
+  ASSERT( !locks.is_locked( &t2 ) );
+
+  // An UPDATE lock shares a key with readers, but not with another
+  // UPDATE lock, and upgrading it waits only for the readers
+  locks.begin_transaction( &b );
+  locks.begin_transaction( &a );
+  locks.lock_key( &b, &t1, "x", LockManager::UPDATE );
+  locks.lock_key( &a, &t1, "x", LockManager::SHARED );
+  ASSERT_LOCK_FAILS( locks.lock_key( &a, &t1, "x", LockManager::UPDATE ) );
+  ASSERT_LOCK_FAILS( locks.upgrade_key( &a, &t1, "x" ) );
+  ASSERT( 5 == locks.get_timeouts() );
+  locks.end_transaction( &a );
+  locks.upgrade_key( &b, &t1, "x" );
+  ASSERT( !locks.try_lock_key( &a, &t1, "x", LockManager::SHARED ) );
+  locks.release_all( &a );
+  locks.end_transaction( &b );
+
+  // Scanning a table and then writing one of its keys locks the table
+  // SHARED_INTENTION_EXCLUSIVE: others can still read its other keys,
+  // but can't write them, or scan the table
+  locks.begin_transaction( &b );
+  locks.begin_transaction( &a );
+  locks.lock_table( &b, &t1, LockManager::SHARED );
+  locks.lock_key( &b, &t1, "x", LockManager::EXCLUSIVE );
+  ASSERT( locks.is_locked( &t1, "y" ) );
+  locks.lock_key( &a, &t1, "y", LockManager::SHARED );
+  ASSERT_LOCK_FAILS( locks.lock_key( &a, &t1, "z", LockManager::EXCLUSIVE ) );
+  ASSERT_LOCK_FAILS( locks.lock_table( &a, &t1, LockManager::SHARED ) );
+  ASSERT( 7 == locks.get_timeouts() );
+  locks.end_transaction( &a );
+  locks.end_transaction( &b );
+
+  // A single request (outside any transaction) waits for as long as
+  // necessary, rather than timing out
+  LockManager::Owner c;
+  locks.begin_transaction( &a );
+  locks.lock_key( &a, &t1, "x", LockManager::SHARED );
+  LockRequest single = { &locks, &c, &t1, "x", false };
+  pthread_t thr;
+  pthread_create( &thr, nullptr, lock_in_thread, &single );
+  usleep( 300000 );
+  locks.end_transaction( &a );
+  pthread_join( thr, nullptr );
+  ASSERT( single.granted );
+  ASSERT( 7 == locks.get_timeouts() );
+  locks.release_all( &c );
+
+  // A single request is never the victim either: c, which would close
+  // a cycle by waiting for x (read by a, which waits for y, written by
+  // c), wounds a instead
+  LockManager patient( 10000 );
+  patient.begin_transaction( &a );
+  patient.lock_key( &a, &t1, "x", LockManager::SHARED );
+  patient.lock_key( &c, &t1, "y", LockManager::EXCLUSIVE );
+  LockRequest req = { &patient, &a, &t1, "y", false };
+  pthread_create( &thr, nullptr, lock_in_thread, &req );
+  usleep( 20000 );
+  patient.lock_key( &c, &t1, "x", LockManager::EXCLUSIVE );
+  pthread_join( thr, nullptr );
+  ASSERT( !req.granted );
+  ASSERT( 1 == patient.get_deadlocks() );
+  ASSERT( 0 == patient.get_timeouts() );
+  patient.end_transaction( &a );
+  patient.release_all( &c );
+  ASSERT( !patient.is_locked( &t1 ) );
+
+  // An owner acquiring declared locks is never the victim, even if
+  // it's younger: a, which waits for a key held by b, is wounded
+  // instead of waiting out its (long) timeout
+  patient.begin_transaction( &a );
+  patient.lock_key( &a, &t1, "y", LockManager::EXCLUSIVE );
+  patient.lock_key( &b, &t1, "x", LockManager::EXCLUSIVE );
+  LockRequest wounded = { &patient, &a, &t1, "x", false };
+  pthread_create( &thr, nullptr, lock_in_thread, &wounded );
+  usleep( 20000 );
+  patient.lock_declared( &b, { { &t2, "", LockManager::EXCLUSIVE },
+                               { &t1, "y", LockManager::EXCLUSIVE } } );
+  pthread_join( thr, nullptr );
+  ASSERT( !wounded.granted );
+  ASSERT( 2 == patient.get_deadlocks() );
+  ASSERT( 0 == patient.get_timeouts() );
+  ASSERT( patient.is_locked( &t1, "y" ) );
+  ASSERT( patient.is_locked( &t2, "z" ) );
+  patient.end_transaction( &a );
+  patient.release_all( &b );
+}
+
+// A transaction writing a key it has read upgrades its lock
+static void *upgrade_in_thread( void *arg )
+{
+  LockRequest *req = static_cast<LockRequest *>( arg );
+  try {
+    req->locks->upgrade_key( req->owner, req->table, req->key );
+    req->granted = true;
+  } catch ( TransactionConflict &ex ) {
+    req->granted = false;
+  }
+  req->locks->end_transaction( req->owner );
+  return nullptr;
+}
+
+void test_lock_manager_wound_wait( TestObjs *objs )
+{
+  LockManager locks( 500 );
+  Table t( "t" );
+  LockManager::Owner older, younger;
+  locks.begin_transaction( &older );
+  locks.begin_transaction( &younger );
+
+  // Wounding takes back the younger transaction's locks, so the older
+  // one acquires at once, even though the younger one is idle (rather
+  // than waiting out the long timeout). The younger one's next request
+  // fails, and so would its commit.
   {
-    TableGuard g( objs->line_items );
+    LockManager patient( 10000 );
+    LockManager::Owner first, second;
+    patient.begin_transaction( &first );
+    patient.begin_transaction( &second );
+    patient.lock_key( &second, &t, "x", LockManager::EXCLUSIVE );
+    patient.lock_key( &first, &t, "x", LockManager::EXCLUSIVE );
+    ASSERT( 1 == patient.get_wounds() );
+    ASSERT( 0 == patient.get_timeouts() );
+    ASSERT_LOCK_FAILS( patient.seal( &second ) );
+    ASSERT_LOCK_FAILS( patient.lock_key( &second, &t, "y", LockManager::SHARED ) );
+    patient.end_transaction( &second );
+    patient.end_transaction( &first );
+    ASSERT( !patient.is_locked( &t ) );
+  }
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( !objs->line_items->has_key( "oranges" ) );
+  // A transaction that sealed its locks to commit isn't wounded: the
+  // older transaction waits (here, until it times out)
+  locks.lock_key( &younger, &t, "x", LockManager::EXCLUSIVE );
+  locks.seal( &younger );
+  ASSERT_LOCK_FAILS( locks.lock_key( &older, &t, "x", LockManager::EXCLUSIVE ) );
+  ASSERT( 0 == locks.get_wounds() );
+  ASSERT( 1 == locks.get_timeouts() );
+  locks.end_transaction( &younger );
+  locks.end_transaction( &older );
+  locks.begin_transaction( &older );
+  locks.lock_key( &older, &t, "x", LockManager::EXCLUSIVE );
+
+  // An older transaction waits for a single request (outside any
+  // transaction) rather than wounding it, even while the request waits
+  // for a lock itself
+  LockManager::Owner single;
+  locks.begin_transaction( &younger );
+  locks.lock_key( &younger, &t, "w", LockManager::EXCLUSIVE );
+  locks.lock_key( &single, &t, "s", LockManager::EXCLUSIVE );
+  LockRequest waiting = { &locks, &single, &t, "w", false };
+  pthread_t thr;
+  pthread_create( &thr, nullptr, lock_in_thread, &waiting );
+  usleep( 20000 );
+  ASSERT_LOCK_FAILS( locks.lock_key( &older, &t, "s", LockManager::SHARED ) );
+  ASSERT( 0 == locks.get_wounds() );
+  ASSERT( 2 == locks.get_timeouts() );
+  locks.end_transaction( &younger );
+  pthread_join( thr, nullptr );
+  ASSERT( waiting.granted );
+  locks.release_all( &single );
+
+  // A younger transaction waits for an older one without wounding it
+  locks.begin_transaction( &younger );
+  ASSERT_LOCK_FAILS( locks.lock_key( &younger, &t, "x", LockManager::SHARED ) );
+  ASSERT( 0 == locks.get_wounds() );
+  locks.lock_key( &older, &t, "y", LockManager::EXCLUSIVE ); // Still usable
+  locks.end_transaction( &younger );
+  locks.end_transaction( &older );
+  ASSERT( !locks.is_locked( &t ) );
+
+  // Readers share a key. If both then write it, the younger one aborts,
+  // and the older one's lock is upgraded.
+  unsigned long timeouts = locks.get_timeouts();
+  locks.begin_transaction( &older );
+  locks.begin_transaction( &younger );
+  locks.lock_key( &older, &t, "r", LockManager::SHARED );
+  locks.lock_key( &younger, &t, "r", LockManager::SHARED );
+  locks.upgrade_key( &older, &t, "unread" ); // Not held, so not locked
+  ASSERT( !locks.is_locked( &t, "unread" ) );
+  LockRequest upgrade = { &locks, &younger, &t, "r", true };
+  pthread_create( &thr, nullptr, upgrade_in_thread, &upgrade );
+  usleep( 20000 );
+  locks.upgrade_key( &older, &t, "r" );
+  pthread_join( thr, nullptr );
+  ASSERT( !upgrade.granted );
+  ASSERT( 1 == locks.get_wounds() );
+  ASSERT( timeouts == locks.get_timeouts() );
+  LockManager::Owner reader;
+  ASSERT( !locks.try_lock_key( &reader, &t, "r", LockManager::SHARED ) );
+  locks.end_transaction( &older );
+  ASSERT( locks.try_lock_key( &reader, &t, "r", LockManager::SHARED ) );
+  locks.release_all( &reader );
+  ASSERT( !locks.is_locked( &t ) );
+}
+
+void test_commit_log( TestObjs *objs )
+{
+  std::string path = temp_path( "commit_log_test" );
+  std::string segment1 = path + ".000001";
+  std::string segment2 = path + ".000002";
+
+  std::vector<LogRecord> replayed;
+  auto collect = [&replayed]( const LogRecord &r ) { replayed.push_back( r ); };
+
+  LogRecord commit{ LogRecord::COMMIT, "", {} };
+  commit.changes.emplace_back( "invoices", WriteSet::Changes() );
+  commit.changes[0].second["abc123"] = WriteSet::Change{ "1000", 0 };
+  commit.changes[0].second["xyz456"] = WriteSet::Change{ "", 0 }; // deleted
+  commit.changes.emplace_back( "line_items", WriteSet::Changes() );
+  commit.changes[1].second["apples"] = WriteSet::Change{ "100", 123456789012ULL };
+
+  uint64_t end;
+  {
+    CommitLog log( path, CommitLog::SYNC_ALWAYS, 0 );
+    ASSERT( 0 == log.open( collect ) );
+    log.append( LogRecord{ LogRecord::CREATE_TABLE, "invoices", {} } );
+    ASSERT( log.wait_durable( log.append( commit ) ) );
+    end = log.append( LogRecord{ LogRecord::DROP_TABLE, "line_items", {} } );
+    ASSERT( log.wait_durable( end ) );
+    ASSERT( 2 <= log.get_syncs() );
+  }
+
+  // A torn record at the end is discarded
+  int fd = open( segment1.c_str(), O_WRONLY | O_APPEND );
+  ASSERT( 5 == write( fd, "\x20\0\0\0\x01", 5 ) );
+  close( fd );
+
+  {
+    replayed.clear();
+    CommitLog log( path, CommitLog::SYNC_NEVER, 0 );
+    ASSERT( 3 == log.open( collect ) );
+    ASSERT( LogRecord::CREATE_TABLE == replayed[0].type );
+    ASSERT( "invoices" == replayed[0].table );
+    ASSERT( LogRecord::COMMIT == replayed[1].type );
+    ASSERT( 2 == replayed[1].changes.size() );
+    ASSERT( "invoices" == replayed[1].changes[0].first );
+    ASSERT( "1000" == replayed[1].changes[0].second["abc123"].value );
+    ASSERT( "" == replayed[1].changes[0].second["xyz456"].value );
+    ASSERT( 123456789012ULL == replayed[1].changes[1].second["apples"].expires_at );
+    ASSERT( LogRecord::DROP_TABLE == replayed[2].type );
+
+    // New records follow the last good one, and after rotating, go to
+    // the next segment
+    ASSERT( 21 == log.append( LogRecord{ LogRecord::TRUNCATE_TABLE, "invoices", {} } ) );
+    ASSERT( 2 == log.rotate() );
+    log.append( LogRecord{ LogRecord::DROP_TABLE, "invoices", {} } );
+  }
+  struct stat st1, st2;
+  ASSERT( 0 == stat( segment1.c_str(), &st1 ) );
+  ASSERT( 0 == stat( segment2.c_str(), &st2 ) );
+  ASSERT( end + 42 == uint64_t( st1.st_size + st2.st_size ) );
+  replayed.clear();
+  {
+    CommitLog log( path, CommitLog::SYNC_NEVER, 0 );
+    ASSERT( 5 == log.open( collect ) );
+    ASSERT( LogRecord::TRUNCATE_TABLE == replayed[3].type );
+    ASSERT( LogRecord::DROP_TABLE == replayed[4].type );
+  }
+
+  // Segments before the first one wanted are skipped, and removed
+  replayed.clear();
+  {
+    CommitLog log( path, CommitLog::SYNC_NEVER, 0 );
+    ASSERT( 1 <= log.open( collect, 2 ) ); // (TRUNCATE may have still been queued when rotating)
+    ASSERT( LogRecord::DROP_TABLE == replayed.back().type );
+  }
+  ASSERT( 0 != stat( segment1.c_str(), &st1 ) );
+  unlink( segment2.c_str() );
+  unlink( path.c_str() );
+}
+
+void test_commit_log_compact( TestObjs *objs )
+{
+  std::string path = temp_path( "commit_log_test" );
+  std::string segment1 = path + ".000001";
+  std::string segment2 = path + ".000002";
+  std::string segment3 = path + ".000003";
+
+  auto commit = []( const std::string &table, const std::string &key, const std::string &value ) {
+    LogRecord r{ LogRecord::COMMIT, "", {} };
+    r.changes.emplace_back( table, WriteSet::Changes() );
+    r.changes[0].second[key] = WriteSet::Change{ value, 0 };
+    return r;
+  };
+  std::atomic<bool> stopping( false );
+  std::vector<LogRecord> replayed;
+  auto collect = [&replayed]( const LogRecord &r ) { replayed.push_back( r ); };
+  {
+    CommitLog log( path, CommitLog::SYNC_ALWAYS, 0 );
+    log.open( collect );
+    ASSERT( !log.compact( 0, stopping ) ); // Nothing but the current segment
+    log.append( LogRecord{ LogRecord::CREATE_TABLE, "a", {} } );
+    log.append( commit( "a", "k1", "1" ) );
+    log.append( commit( "a", "k2", "2" ) );
+    log.append( commit( "a", "k1", "3" ) );
+    log.append( LogRecord{ LogRecord::CREATE_TABLE, "b", {} } );
+    ASSERT( log.wait_durable( log.append( commit( "b", "x", "1" ) ) ) );
+    ASSERT( 2 == log.rotate() );
+    log.append( LogRecord{ LogRecord::TRUNCATE_TABLE, "b", {} } );
+    log.append( commit( "a", "k2", "" ) );
+    log.append( commit( "b", "y", "2" ) );
+    ASSERT( log.wait_durable( log.append( LogRecord{ LogRecord::DROP_TABLE, "c", {} } ) ) );
+    ASSERT( 3 == log.rotate() );
+    ASSERT( 0 == log.get_segment_size() );
+
+    // Giving up leaves the segments as they were
+    stopping.store( true );
+    ASSERT( !log.compact( 0, stopping ) );
+    struct stat st;
+    ASSERT( 0 == stat( segment1.c_str(), &st ) );
+    stopping.store( false );
+
+    ASSERT( log.compact( 1 << 30, stopping ) );
+    ASSERT( 0 != stat( segment1.c_str(), &st ) );
+    ASSERT( 0 == stat( segment2.c_str(), &st ) );
+    ASSERT( !log.compact( 0, stopping ) ); // Nothing new
+    ASSERT( log.wait_durable( log.append( commit( "a", "k3", "4" ) ) ) );
+  }
+
+  {
+    CommitLog log( path, CommitLog::SYNC_ALWAYS, 0 );
+    ASSERT( 5 == log.open( collect ) );
+  }
+  ASSERT( LogRecord::CREATE_TABLE == replayed[0].type && "a" == replayed[0].table );
+  ASSERT( LogRecord::TRUNCATE_TABLE == replayed[1].type && "b" == replayed[1].table );
+  ASSERT( LogRecord::DROP_TABLE == replayed[2].type && "c" == replayed[2].table );
+  ASSERT( LogRecord::COMMIT == replayed[3].type );
+  ASSERT( 2 == replayed[3].changes.size() );
+  ASSERT( "a" == replayed[3].changes[0].first );
+  ASSERT( 2 == replayed[3].changes[0].second.size() );
+  ASSERT( "3" == replayed[3].changes[0].second["k1"].value );
+  ASSERT( "" == replayed[3].changes[0].second["k2"].value );
+  ASSERT( "b" == replayed[3].changes[1].first );
+  ASSERT( 1 == replayed[3].changes[1].second.size() );
+  ASSERT( "2" == replayed[3].changes[1].second["y"].value );
+  ASSERT( "4" == replayed[4].changes[0].second["k3"].value );
+  unlink( segment2.c_str() );
+  unlink( segment3.c_str() );
+  unlink( path.c_str() );
+}
+
+void test_checkpoint( TestObjs *objs )
+{
+  std::string path = temp_path( "checkpoint_test" );
+  unlink( path.c_str() );
+
+  {
+    Checkpoint none;
+    ASSERT( !none.open( path ) );
+  }
+  {
+    // Not finished, so nothing is saved
+    CheckpointWriter writer( path, 3 );
+    writer.begin_table( "invoices" );
+  }
+  {
+    Checkpoint none;
+    ASSERT( !none.open( path ) );
+  }
+  {
+    CheckpointWriter writer( path, 7 );
+    writer.begin_table( "empty" );
+    writer.begin_table( "invoices" );
+    writer.add_row( "abc123", "1000", 0 );
+    writer.add_row( "abc1234", "", 0 );
+    writer.add_row( "xyz456", "25", 123456789012ULL );
+    writer.finish();
+  }
+
+  Checkpoint checkpoint;
+  ASSERT( checkpoint.open( path ) );
+  ASSERT( 7 == checkpoint.get_first_segment() );
+  ASSERT( 2 == checkpoint.get_tables().size() );
+  ASSERT( "empty" == checkpoint.get_tables()[0].first );
+  ASSERT( 0 == checkpoint.get_tables()[0].second.size() );
+  const MappedTable &rows = checkpoint.get_tables()[1].second;
+  ASSERT( 3 == rows.size() );
+  ASSERT( 1 == rows.find( "abc1234" ) );
+  ASSERT( "" == rows.value( 1 ) );
+  ASSERT( "xyz456" == rows.key( 2 ) );
+  ASSERT( "25" == rows.value( 2 ) );
+  ASSERT( 123456789012ULL == rows.expires_at( 2 ) );
+  ASSERT( MappedTable::npos == rows.find( "abc" ) );
+  ASSERT( 0 == rows.lower_bound( "abc" ) );
+  ASSERT( 1 == rows.upper_bound( "abc123" ) );
+  ASSERT( 3 == rows.upper_bound( "zzz" ) );
+
+  // A file that isn't a complete checkpoint is rejected
+  int fd = open( path.c_str(), O_WRONLY );
+  ASSERT( 1 == write( fd, "x", 1 ) );
+  close( fd );
+  try {
+    Checkpoint corrupt;
+    corrupt.open( path );
+    FAIL( "corrupt checkpoint was opened" );
+  } catch ( StorageException &ex ) {
+  }
+  unlink( path.c_str() );
+}
+
+void test_table_checkpoint_base( TestObjs *objs )
+{
+  std::string path = temp_path( "checkpoint_test" );
+  {
+    CheckpointWriter writer( path, 1 );
+    writer.begin_table( "fruit" );
+    writer.add_row( "apples", "1", 0 );
+    writer.add_row( "bananas", "2", 0 );
+    writer.add_row( "cherries", "3", 0 );
+    writer.add_row( "dates", "4", 1 ); // long expired
+    writer.finish();
+  }
+  Checkpoint checkpoint;
+  ASSERT( checkpoint.open( path ) );
+  unlink( path.c_str() ); // Still mapped
+
+  CommitClock clock;
+  Table t( "fruit", nullptr, nullptr, checkpoint.get_tables()[0].second );
+  TableGuard g( &t );
+  ASSERT( 0 == t.get_memory_used() );
+  ASSERT( "2" == t.get( "bananas" ) );
+  ASSERT( Table::BASE_VERSION == t.get_version( "bananas" ) );
+  ASSERT( !t.has_key( "dates" ) );
+
+  // Changes shadow the base rows; a snapshot still sees them
+  uint64_t snapshot = clock.open_snapshot();
+  CommitClock::Commit c1 = clock.begin_commit();
+  t.set( "apples", "10", 0, c1 );
+  t.set( "bananas", "", 0, c1 );
+  t.set( "blueberries", "5", 0, c1 );
+  clock.end_commit( c1 );
+  ASSERT( "10" == t.get( "apples" ) );
+  ASSERT( Table::BASE_VERSION < t.get_version( "apples" ) );
+  ASSERT( !t.has_key( "bananas" ) );
+  ASSERT( "2" == t.get_at( "bananas", snapshot ) );
+
+  std::vector<std::pair<std::string, std::string>> rows;
+  ASSERT( !t.scan( "", "", 10, rows ) );
+  ASSERT( 3 == rows.size() );
+  ASSERT( "apples" == rows[0].first && "10" == rows[0].second );
+  ASSERT( "blueberries" == rows[1].first );
+  ASSERT( "cherries" == rows[2].first && "3" == rows[2].second );
+  rows.clear();
+  ASSERT( !t.scan( "", "b", 10, rows ) );
+  ASSERT( 1 == rows.size() );
+
+  WriteSet::Changes at;
+  ASSERT( !t.scan_at( "", "", snapshot, 10, at ) );
+  ASSERT( 3 == at.size() );
+  ASSERT( "1" == at["apples"].value );
+  ASSERT( "2" == at["bananas"].value );
+  ASSERT( "3" == at["cherries"].value );
+  clock.close_snapshot( snapshot );
+
+  // Evicting a shadowing entry doesn't bring the base row back
+  std::string victim;
+  while ( t.choose_victim( victim ) > 0 ) {
+    t.set( victim, "" );
+  }
+  ASSERT( !t.has_key( "apples" ) );
+  ASSERT( "3" == t.get( "cherries" ) );
+}
+
+void test_checkpoint_delta_merge( TestObjs *objs )
+{
+  std::string path = temp_path( "checkpoint_test" );
+  std::string delta1 = path + ".000005";
+  std::string delta2 = path + ".000006";
+  std::string merged = path + ".merged";
+  {
+    CheckpointWriter writer( path, 4 );
+    writer.begin_table( "a" );
+    writer.add_row( "k1", "1", 0 );
+    writer.add_row( "k2", "2", 0 );
+    writer.add_row( "k3", "3", 0 );
+    writer.begin_table( "b" );
+    writer.add_row( "x", "1", 0 );
+    writer.begin_table( "c" );
+    writer.add_row( "y", "1", 0 );
+    writer.finish();
+  }
+  {
+    // k2 deleted and k4 added; b truncated; c dropped
+    CheckpointWriter writer( delta1, 5 );
+    writer.begin_table( "a", true );
+    writer.add_deletion( "k2" );
+    writer.add_row( "k4", "4", 0 );
+    writer.begin_table( "b" );
+    writer.add_row( "z", "9", 0 );
+    writer.finish();
+  }
+  {
+    CheckpointWriter writer( delta2, 6 );
+    writer.begin_table( "a", true );
+    writer.add_row( "k1", "10", 0 );
+    writer.add_row( "k5", "5", 1 ); // long expired
+    writer.begin_table( "b", true );
+    writer.begin_table( "d" );
+    writer.add_row( "w", "1", 0 );
+    writer.finish();
   }
+
+  Checkpoint base, d1, d2;
+  ASSERT( base.open( path ) && d1.open( delta1 ) && d2.open( delta2 ) );
+  ASSERT( d1.get_tables()[0].second.is_delta() );
+  ASSERT( d1.get_tables()[0].second.is_deleted( 0 ) );
+  ASSERT( !d1.get_tables()[0].second.is_deleted( 1 ) );
+  ASSERT( !d1.get_tables()[1].second.is_delta() );
+  {
+    CheckpointWriter writer( merged, d2.get_first_segment() );
+    Checkpoint::merge( { &base, &d1, &d2 }, writer );
+    writer.finish();
+  }
+
+  Checkpoint result;
+  ASSERT( result.open( merged ) );
+  ASSERT( 6 == result.get_first_segment() );
+  const auto &tables = result.get_tables();
+  ASSERT( 3 == tables.size() );
+  ASSERT( "a" == tables[0].first );
+  ASSERT( !tables[0].second.is_delta() );
+  ASSERT( 3 == tables[0].second.size() );
+  ASSERT( "10" == tables[0].second.value( 0 ) );
+  ASSERT( "k3" == tables[0].second.key( 1 ) );
+  ASSERT( "k4" == tables[0].second.key( 2 ) );
+  ASSERT( "b" == tables[1].first );
+  ASSERT( 1 == tables[1].second.size() );
+  ASSERT( "z" == tables[1].second.key( 0 ) );
+  ASSERT( "d" == tables[2].first );
+  ASSERT( 1 == tables[2].second.size() );
+  unlink( path.c_str() );
+  unlink( delta1.c_str() );
+  unlink( delta2.c_str() );
+  unlink( merged.c_str() );
 }
 
 void test_value_stack( TestObjs *objs )
@@ -614,3 +1755,151 @@ void test_value_stack_exceptions( TestObjs *objs )
     // good
   }
 }
+
+void test_table_dirty_keys( TestObjs *objs )
+{
+  Table t( "t" );
+  TableGuard g( &t );
+  std::vector<std::string> keys;
+  t.set( "untracked", "1" );
+  t.track_dirty();
+  t.take_dirty( 100, keys );
+  ASSERT( keys.empty() );
+
+  CommitClock::Commit c5, c7, c9;
+  c5.ts = 5;
+  c7.ts = 7;
+  c9.ts = 9;
+  t.set( "b", "1", 0, c5 );
+  t.set( "untracked", "", 0, c7 );
+  t.set( "a", "2", 0, c9 );
+  t.set( "c", "3", 0, c5 );
+  t.set( "c", "4", 0, c9 );
+
+  // Keys changed after the snapshot stay dirty
+  t.take_dirty( 8, keys );
+  ASSERT( 2 == keys.size() );
+  ASSERT( "b" == keys[0] );
+  ASSERT( "untracked" == keys[1] );
+  WriteSet::Change row;
+  ASSERT( t.find_at( "b", 8, row ) && "1" == row.value );
+  ASSERT( !t.find_at( "untracked", 8, row ) );
+
+  t.restore_dirty( keys );
+  keys.clear();
+  t.take_dirty( 100, keys );
+  ASSERT( 4 == keys.size() );
+  ASSERT( "a" == keys[0] && "c" == keys[2] );
+  keys.clear();
+  t.take_dirty( 100, keys );
+  ASSERT( keys.empty() );
+}
+
+void test_table_load( TestObjs *objs )
+{
+  std::atomic<size_t> memory( 0 );
+  Table t( "t", nullptr, &memory );
+  uint64_t later = Table::wall_time_ms() + 60000;
+  WriteSet::Changes rows;
+  rows["a"] = WriteSet::Change{ "1", 0 };
+  rows["b"] = WriteSet::Change{ "", 0 };      // A delete
+  rows["c"] = WriteSet::Change{ "3", 1 };     // Expired
+  rows["d"] = WriteSet::Change{ "4", later };
+  t.load( rows );
+
+  // Rows before the last key are set one by one
+  rows.clear();
+  rows["0"] = WriteSet::Change{ "0", 0 };
+  rows["a"] = WriteSet::Change{ "5", 0 };
+  rows["e"] = WriteSet::Change{ "6", 0 };
+  t.load( rows );
+
+  TableGuard g( &t );
+  ASSERT( "0" == t.get( "0" ) );
+  ASSERT( "5" == t.get( "a" ) );
+  ASSERT( !t.has_key( "b" ) );
+  ASSERT( !t.has_key( "c" ) );
+  ASSERT( "4" == t.get( "d" ) );
+  ASSERT( "6" == t.get( "e" ) );
+  ASSERT( memory.load() == t.get_memory_used() && memory.load() > 0 );
+
+  std::vector<std::pair<std::string, std::string>> scanned;
+  ASSERT( !t.scan( "", "", 10, scanned ) );
+  ASSERT( 4 == scanned.size() );
+  ASSERT( "0" == scanned[0].first && "e" == scanned[3].first );
+  WriteSet::Changes at;
+  ASSERT( !t.scan_at( "", "", 1, 10, at ) );
+  ASSERT( 4 == at.size() && later == at["d"].expires_at );
+}
+
+void test_log_record_frames( TestObjs *objs )
+{
+  LogRecord restore{ LogRecord::RESTORE_TABLE, "t", {} };
+  restore.changes.emplace_back( "t", WriteSet::Changes() );
+  restore.changes.back().second["k"] = WriteSet::Change{ "v", 42 };
+  std::string encoded;
+  restore.encode( encoded );
+  ASSERT( encoded.size() - LogRecord::FRAME_HEADER_SIZE == LogRecord::frame_length( encoded.data() ) );
+
+  LogRecord decoded;
+  ASSERT( decoded.decode_frame( encoded.data(), encoded.data() + LogRecord::FRAME_HEADER_SIZE ) );
+  ASSERT( LogRecord::RESTORE_TABLE == decoded.type && "t" == decoded.table );
+  ASSERT( 1 == decoded.changes.size() && "t" == decoded.changes[0].first );
+  ASSERT( "v" == decoded.changes[0].second["k"].value && 42 == decoded.changes[0].second["k"].expires_at );
+
+  // A damaged payload fails the checksum
+  encoded.back() ^= 1;
+  ASSERT( !decoded.decode_frame( encoded.data(), encoded.data() + LogRecord::FRAME_HEADER_SIZE ) );
+}
+
+void test_log_replay( TestObjs *objs )
+{
+  Table a( "a", nullptr, nullptr );
+  Table b( "b", nullptr, nullptr );
+  LogReplay replay( 3 );
+  ASSERT( 3 == replay.get_threads() );
+
+  LogRecord r1{ LogRecord::COMMIT, "", {} };
+  r1.changes.emplace_back( "a", WriteSet::Changes() );
+  r1.changes[0].second["k1"] = WriteSet::Change{ "1", 0 };
+  r1.changes[0].second["k2"] = WriteSet::Change{ "2", 0 };
+  r1.changes.emplace_back( "b", WriteSet::Changes() );
+  r1.changes[1].second["k1"] = WriteSet::Change{ "x", 0 };
+  r1.changes.emplace_back( "gone", WriteSet::Changes() );
+  r1.changes[2].second["k1"] = WriteSet::Change{ "y", 0 };
+  replay.add_commit( r1 );
+
+  // Enough changes to fill several batches; the last change to each key wins
+  for ( int i = 0; i < 5000; i++ ) {
+    LogRecord r{ LogRecord::COMMIT, "", {} };
+    r.changes.emplace_back( "a", WriteSet::Changes() );
+    r.changes[0].second["n" + std::to_string( i % 1000 )] = WriteSet::Change{ std::to_string( i ), 0 };
+    replay.add_commit( r );
+  }
+
+  // Table b was truncated, so only the changes after are applied
+  replay.reset_table( "b" );
+  LogRecord r2{ LogRecord::COMMIT, "", {} };
+  r2.changes.emplace_back( "a", WriteSet::Changes() );
+  r2.changes[0].second["k1"] = WriteSet::Change{ "11", 0 };
+  r2.changes[0].second["k3"] = WriteSet::Change{ "3", 1 }; // long expired
+  r2.changes.emplace_back( "b", WriteSet::Changes() );
+  r2.changes[1].second["k2"] = WriteSet::Change{ "z", 0 };
+  replay.add_commit( r2 );
+  ASSERT( 5007 == replay.get_changes() );
+
+  replay.finish( [&a, &b]( const std::string &name ) {
+    return name == "a" ? &a : ( name == "b" ? &b : nullptr );
+  } );
+  ASSERT( 0 == replay.get_threads() );
+
+  TableGuard ga( &a );
+  ASSERT( "11" == a.get( "k1" ) );
+  ASSERT( "2" == a.get( "k2" ) );
+  ASSERT( !a.has_key( "k3" ) );
+  ASSERT( "4000" == a.get( "n0" ) );
+  ASSERT( "4999" == a.get( "n999" ) );
+  TableGuard gb( &b );
+  ASSERT( !b.has_key( "k1" ) );
+  ASSERT( "z" == b.get( "k2" ) );
+}
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include "write_set.h"
+
+WriteSet::WriteSet()
+  : m_changes()
+{
+}
+
+WriteSet::~WriteSet()
+{
+}
+
+void WriteSet::set(Table *tbl, const std::string &key, const std::string &value,
+                   uint64_t expires_at)
+{
+  Changes &changes = m_changes[tbl];
+  if (!m_savepoints.empty()) {
+    auto i = changes.find(key);
+    if (i == changes.end()) {
+      m_undo_log.push_back(Undo{tbl, key, false, Change()});
+    } else {
+      m_undo_log.push_back(Undo{tbl, key, true, i->second});
+    }
+  }
+  changes[key] = Change{value, expires_at};
+}
+
+bool WriteSet::lookup(Table *tbl, const std::string &key, std::string &value) const
+{
+  auto i = m_changes.find(tbl);
+  if (i == m_changes.end()) {
+    return false;
+  }
+  auto j = i->second.find(key);
+  if (j == i->second.end()) {
+    return false;
+  }
+  value = j->second.value;
+  return true;
+}
+
+const WriteSet::Changes *WriteSet::get_changes(Table *tbl) const
+{
+  auto i = m_changes.find(tbl);
+  return (i == m_changes.end()) ? nullptr : &i->second;
+}
+
+void WriteSet::savepoint(const std::string &name)
+{
+  auto i = std::find_if(m_savepoints.begin(), m_savepoints.end(),
+                        [&name](const std::pair<std::string, size_t> &sp) { return sp.first == name; });
+  if (i != m_savepoints.end()) {
+    m_savepoints.erase(i);
+  }
+  m_savepoints.emplace_back(name, m_undo_log.size());
+}
+
+bool WriteSet::rollback_to(const std::string &name)
+{
+  auto i = std::find_if(m_savepoints.begin(), m_savepoints.end(),
+                        [&name](const std::pair<std::string, size_t> &sp) { return sp.first == name; });
+  if (i == m_savepoints.end()) {
+    return false;
+  }
+
+  // Undo the newest changes first, so each key ends up as it was
+  size_t mark = i->second;
+  while (m_undo_log.size() > mark) {
+    const Undo &undo = m_undo_log.back();
+    Changes &changes = m_changes[undo.table];
+    if (undo.had_change) {
+      changes[undo.key] = undo.change;
+    } else {
+      changes.erase(undo.key);
+      if (changes.empty()) {
+        m_changes.erase(undo.table);
+      }
+    }
+    m_undo_log.pop_back();
+  }
+
+  // The savepoint itself remains, so it can be rolled back to again
+  m_savepoints.erase(i + 1, m_savepoints.end());
+  return true;
+}
+
+void WriteSet::clear()
+{
+  m_changes.clear();
+  m_undo_log.clear();
+  m_savepoints.clear();
+}
@@ -0,0 +1,71 @@
+#ifndef WRITE_SET_H
+#define WRITE_SET_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+class Table; // forward declaration
+
+// Changes buffered by one transaction. Nothing here is visible to
+// other clients until the transaction commits and the changes are
+// applied to each table. An empty value marks a key to be deleted.
+//
+// Once a savepoint has been set, each change also records how to undo
+// it, so the write set can be rolled back to any savepoint.
+class WriteSet {
+public:
+  struct Change {
+    std::string value;
+    uint64_t expires_at; // Expiry time (wall clock ms), or 0 for none
+  };
+  typedef std::map<std::string, Change> Changes; // key -> new value
+  typedef std::map<Table*, Changes> TableChanges;
+
+private:
+  // The earlier change to a key, which an undo record restores
+  struct Undo {
+    Table *table;
+    std::string key;
+    bool had_change; // If false, the key was unchanged before
+    Change change;
+  };
+
+  TableChanges m_changes;
+  std::vector<Undo> m_undo_log;
+  std::vector<std::pair<std::string, size_t>> m_savepoints; // Name, undo log length
+
+public:
+  WriteSet();
+  ~WriteSet();
+
+  // Record a change to a key
+  void set(Table *tbl, const std::string &key, const std::string &value,
+           uint64_t expires_at = 0);
+
+  // If this write set changes the key, store the new value in value
+  // and return true; otherwise return false
+  bool lookup(Table *tbl, const std::string &key, std::string &value) const;
+
+  // Changes to one table, or null if the table hasn't been changed
+  const Changes *get_changes(Table *tbl) const;
+
+  // Set a savepoint, replacing any earlier savepoint with the same name
+  void savepoint(const std::string &name);
+
+  // Undo every change made since the named savepoint was set, and
+  // forget later savepoints. Returns false if there is no such savepoint.
+  bool rollback_to(const std::string &name);
+
+  bool has_savepoints() const { return !m_savepoints.empty(); }
+
+  bool is_empty() const { return m_changes.empty(); }
+  void clear();
+
+  // Per-table changes, ordered by Table pointer
+  TableChanges::const_iterator begin() const { return m_changes.begin(); }
+  TableChanges::const_iterator end() const { return m_changes.end(); }
+};
+
+#endif // WRITE_SET_H